@@ -0,0 +1,63 @@
+#include "AllocHook.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef RST_ALLOC_HOOK
+
+static std::atomic<std::size_t> allocation_count{0};
+
+static void* counted_alloc(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+static void* counted_alloc(std::size_t size, std::align_val_t align)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    std::size_t a = static_cast<std::size_t>(align);
+    if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) { return counted_alloc(size); }
+void* operator new[](std::size_t size) { return counted_alloc(size); }
+void* operator new(std::size_t size, std::align_val_t align) { return counted_alloc(size, align); }
+void* operator new[](std::size_t size, std::align_val_t align) { return counted_alloc(size, align); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+bool rst::alloc_hook::enabled()
+{
+    return true;
+}
+
+std::size_t rst::alloc_hook::allocations()
+{
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+#else
+
+bool rst::alloc_hook::enabled()
+{
+    return false;
+}
+
+std::size_t rst::alloc_hook::allocations()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef RASTERIZER_ALLOC_HOOK_H
+#define RASTERIZER_ALLOC_HOOK_H
+
+#include <cstddef>
+
+namespace rst::alloc_hook
+{
+    // True when the binary was built with RST_ALLOC_HOOK, in which case the global
+    // operator new is replaced by a counting version.
+    bool enabled();
+
+    // Number of global operator new calls made by any thread so far.
+    std::size_t allocations();
+}
+
+#endif //RASTERIZER_ALLOC_HOOK_H
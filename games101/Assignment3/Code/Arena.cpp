@@ -0,0 +1,96 @@
+#include "Arena.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+rst::arena::arena(std::size_t block_size, memory_account* owner, memory_kind kind)
+    : block_size(block_size), account(owner), account_kind(kind)
+{
+}
+
+rst::arena::~arena()
+{
+    track(nullptr, account_kind);
+    for (auto& b : blocks)
+        ::operator delete(b.data);
+}
+
+void rst::arena::add_block(std::size_t min_size)
+{
+    std::size_t size = std::max(block_size, min_size);
+    if (!blocks.empty())
+        size = std::max(size, blocks.back().size * 2);
+    blocks.push_back({static_cast<char*>(::operator new(size)), size});
+    if (account)
+        account->add(account_kind, size);
+}
+
+void* rst::arena::allocate(std::size_t size, std::size_t align)
+{
+    for (;;)
+    {
+        if (current < blocks.size())
+        {
+            auto& b = blocks[current];
+            auto base = reinterpret_cast<std::uintptr_t>(b.data);
+            std::size_t aligned = ((base + offset + align - 1) & ~(std::uintptr_t)(align - 1)) - base;
+            if (aligned + size <= b.size)
+            {
+                offset = aligned + size;
+                return b.data + aligned;
+            }
+            used_before_current += offset;
+            ++current;
+            offset = 0;
+            continue;
+        }
+        add_block(size + align);
+    }
+}
+
+void rst::arena::reset()
+{
+    if (blocks.size() > 1)
+    {
+        std::size_t total = capacity();
+        for (auto& b : blocks)
+            ::operator delete(b.data);
+        blocks.clear();
+        blocks.push_back({static_cast<char*>(::operator new(total)), total});
+    }
+    current = 0;
+    offset = 0;
+    used_before_current = 0;
+}
+
+std::size_t rst::arena::used() const
+{
+    return used_before_current + offset;
+}
+
+std::size_t rst::arena::capacity() const
+{
+    std::size_t total = 0;
+    for (auto& b : blocks)
+        total += b.size;
+    return total;
+}
+
+void rst::arena::track(memory_account* owner, memory_kind kind)
+{
+    if (account)
+        account->release(account_kind, capacity());
+    account = owner;
+    account_kind = kind;
+    if (account)
+        account->add(account_kind, capacity());
+}
+
+rst::arena& rst::scratch_arena()
+{
+    // Shared by the arenas of all threads, and never destroyed since pool threads
+    // may exit after static destructors have run
+    static memory_account* scratch_account = new memory_account("scratch arenas");
+    thread_local arena scratch(1 << 16, scratch_account, memory_kind::arenas);
+    return scratch;
+}
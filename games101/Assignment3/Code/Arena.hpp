@@ -0,0 +1,92 @@
+#ifndef RASTERIZER_ARENA_H
+#define RASTERIZER_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "MemoryAccount.hpp"
+
+namespace rst
+{
+    // Bump allocator. Everything handed out lives until the next reset() (or until the
+    // arena dies); there is no per-object free and no destructors are run, so only
+    // trivially destructible types may be placed in it.
+    //
+    // The arena grows by chaining blocks while warming up. reset() folds the chain
+    // into a single block large enough for the high-water mark, so a workload that
+    // repeats (a frame, a mesh chunk) stops touching the heap after its first pass.
+    class arena
+    {
+    public:
+        explicit arena(std::size_t block_size = 1 << 16, memory_account* owner = nullptr,
+                       memory_kind kind = memory_kind::arenas);
+        ~arena();
+
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t));
+
+        template <typename T, typename... Args>
+        T* make(Args&&... args)
+        {
+            static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+            return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        // Default-constructs n objects of T.
+        template <typename T>
+        T* make_array(std::size_t n)
+        {
+            static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+            T* p = static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+            for (std::size_t i = 0; i < n; ++i)
+                new (p + i) T();
+            return p;
+        }
+
+        // Uninitialised storage for n objects of T (T must be trivial).
+        template <typename T>
+        T* alloc_array(std::size_t n)
+        {
+            static_assert(std::is_trivial_v<T>, "alloc_array leaves objects uninitialised");
+            return static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+        }
+
+        void reset();
+
+        std::size_t used() const;
+        std::size_t capacity() const;
+
+        // Counts the blocks, from now on, as `kind` in `owner`, which must outlive
+        // the arena or be replaced first. Growth is never refused: a frame that has
+        // started binning has to finish.
+        void track(memory_account* owner, memory_kind kind);
+
+    private:
+        struct block
+        {
+            char* data;
+            std::size_t size;
+        };
+
+        void add_block(std::size_t min_size);
+
+        std::vector<block> blocks;
+        std::size_t current = 0;
+        std::size_t offset = 0;
+        std::size_t used_before_current = 0;
+        std::size_t block_size;
+
+        memory_account* account = nullptr;
+        memory_kind account_kind = memory_kind::arenas;
+    };
+
+    // Per-thread scratch arena for worker-local temporaries. The owner of a job
+    // resets it when the job is done; nothing in it survives across jobs.
+    arena& scratch_arena();
+}
+
+#endif //RASTERIZER_ARENA_H
@@ -0,0 +1,531 @@
+#include "BVH.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "ThreadPool.hpp"
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    constexpr int bin_count = 16;
+    constexpr std::uint32_t max_leaf = 4;
+    // Ranges below this size are built by a single thread
+    constexpr std::uint32_t serial_range = 4096;
+    // Past this depth nodes are split at the median, which halves them and so
+    // bounds the depth for any 32-bit triangle count to max_depth
+    constexpr int median_depth = 28;
+    constexpr int max_depth = median_depth + 30;
+    // Traversal holds at most one sibling per level above the node it visits
+    constexpr int stack_size = max_depth + 2;
+    constexpr float ray_epsilon = 1e-4f;
+    // Offset along the normal so rays do not hit the surface they start on
+    constexpr float ray_bias = 1e-3f;
+
+    float area(const Eigen::Vector3f& lower, const Eigen::Vector3f& upper)
+    {
+        Eigen::Vector3f d = (upper - lower).cwiseMax(0.0f);
+        return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+    }
+
+    Eigen::Vector3f inverse(const Eigen::Vector3f& d)
+    {
+        // 1/0 is fine for the slab test, but 1/-0 is not
+        auto inv = [](float x) { return std::abs(x) < 1e-20f ? std::copysign(1e20f, x) : 1.0f / x; };
+        return {inv(d.x()), inv(d.y()), inv(d.z())};
+    }
+
+    // Small hash-based generator; shading asks for a seed per fragment
+    struct random_sequence
+    {
+        std::uint32_t state;
+
+        float next()
+        {
+            state = state * 747796405u + 2891336453u;
+            std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+            return ((word >> 22u) ^ word) * (1.0f / 4294967296.0f);
+        }
+    };
+
+    void basis(const Eigen::Vector3f& n, Eigen::Vector3f& t, Eigen::Vector3f& b)
+    {
+        t = std::abs(n.x()) > 0.9f ? Eigen::Vector3f(0, 1, 0) : Eigen::Vector3f(1, 0, 0);
+        t = n.cross(t).normalized();
+        b = n.cross(t);
+    }
+}
+
+void rst::bvh::gather(const mesh& m, const Eigen::Matrix4f& transform)
+{
+    std::size_t count = m.triangle_count;
+    tris.resize(count);
+    centroids.resize(count);
+    lower_bounds.resize(count);
+    upper_bounds.resize(count);
+
+    Eigen::Matrix3f linear = transform.topLeftCorner<3, 3>();
+    Eigen::Vector3f offset = transform.topRightCorner<3, 1>();
+    const vertex_arrays& in = m.vertices;
+    for (std::size_t t = 0; t < count; ++t)
+    {
+        Eigen::Vector3f v[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            std::size_t i = m.indices ? m.indices[t * 3 + j] : t * 3 + j;
+            v[j] = linear * Eigen::Vector3f(in.px[i], in.py[i], in.pz[i]) + offset;
+        }
+        tris[t] = {v[0], v[1] - v[0], v[2] - v[0]};
+        lower_bounds[t] = v[0].cwiseMin(v[1]).cwiseMin(v[2]);
+        upper_bounds[t] = v[0].cwiseMax(v[1]).cwiseMax(v[2]);
+        centroids[t] = (v[0] + v[1] + v[2]) / 3.0f;
+    }
+}
+
+void rst::bvh::update_bounds(node& n) const
+{
+    n.lower = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+    n.upper = -n.lower;
+    for (std::uint32_t k = n.first; k < n.first + n.count; ++k)
+    {
+        n.lower = n.lower.cwiseMin(lower_bounds[order[k]]);
+        n.upper = n.upper.cwiseMax(upper_bounds[order[k]]);
+    }
+}
+
+// Splits out[index], covering order[begin, end) at `depth`, into two new
+// children. Returns false when the node stays a leaf.
+bool rst::bvh::split(std::vector<node>& out, std::uint32_t index, std::uint32_t begin, std::uint32_t end, int depth)
+{
+    node& n = out[index];
+    n.first = begin;
+    n.count = end - begin;
+    update_bounds(n);
+    if (n.count <= max_leaf)
+        return false;
+
+    Eigen::Vector3f c_lower = centroids[order[begin]], c_upper = c_lower;
+    for (std::uint32_t k = begin + 1; k < end; ++k)
+    {
+        c_lower = c_lower.cwiseMin(centroids[order[k]]);
+        c_upper = c_upper.cwiseMax(centroids[order[k]]);
+    }
+    Eigen::Vector3f extent = c_upper - c_lower;
+    int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+    std::uint32_t mid;
+    if (extent[axis] <= 0.0f)
+    {
+        // Coincident centroids: binning cannot separate them
+        mid = begin + (end - begin) / 2;
+    }
+    else if (depth >= median_depth)
+    {
+        // Deep enough that a skewed mesh peeled a slice at a time could overflow
+        // the traversal stack
+        mid = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](std::uint32_t a, std::uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+    }
+    else
+    {
+        struct bin
+        {
+            std::uint32_t count = 0;
+            Eigen::Vector3f lower = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+            Eigen::Vector3f upper = Eigen::Vector3f::Constant(-std::numeric_limits<float>::infinity());
+        } bins[bin_count];
+
+        float scale = bin_count * 0.9999f / extent[axis];
+        auto bin_of = [&](std::uint32_t t) { return (int)((centroids[t][axis] - c_lower[axis]) * scale); };
+        for (std::uint32_t k = begin; k < end; ++k)
+        {
+            std::uint32_t t = order[k];
+            bin& b = bins[bin_of(t)];
+            ++b.count;
+            b.lower = b.lower.cwiseMin(lower_bounds[t]);
+            b.upper = b.upper.cwiseMax(upper_bounds[t]);
+        }
+
+        // Sweep from the right for the suffix costs, then from the left
+        float right_cost[bin_count];
+        Eigen::Vector3f lower = bins[bin_count - 1].lower, upper = bins[bin_count - 1].upper;
+        std::uint32_t right_count = 0;
+        for (int i = bin_count - 1; i > 0; --i)
+        {
+            lower = lower.cwiseMin(bins[i].lower);
+            upper = upper.cwiseMax(bins[i].upper);
+            right_count += bins[i].count;
+            right_cost[i] = right_count ? area(lower, upper) * right_count : 0.0f;
+        }
+
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best_bin = -1;
+        lower = bins[0].lower;
+        upper = bins[0].upper;
+        std::uint32_t left_count = 0;
+        for (int i = 0; i < bin_count - 1; ++i)
+        {
+            lower = lower.cwiseMin(bins[i].lower);
+            upper = upper.cwiseMax(bins[i].upper);
+            left_count += bins[i].count;
+            if (left_count == 0 || left_count == n.count)
+                continue;
+            float cost = area(lower, upper) * left_count + right_cost[i + 1];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_bin = i;
+            }
+        }
+
+        // A leaf costs one intersection per triangle, an inner node one box test more
+        float leaf_cost = area(n.lower, n.upper) * n.count;
+        if (best_bin < 0 || (best_cost + area(n.lower, n.upper) >= leaf_cost && n.count <= 4 * max_leaf))
+            return false;
+
+        mid = (std::uint32_t)(std::partition(order.begin() + begin, order.begin() + end,
+                                             [&](std::uint32_t t) { return bin_of(t) <= best_bin; }) - order.begin());
+    }
+
+    std::uint32_t left = (std::uint32_t)out.size();
+    out[index].first = left;
+    out[index].count = 0;
+    out.push_back({});
+    out.push_back({});
+    out[left].first = begin;
+    out[left].count = mid - begin;
+    out[left + 1].first = mid;
+    out[left + 1].count = end - mid;
+    return true;
+}
+
+// Builds root's range into out[0] and below, depth first
+void rst::bvh::build_subtree(std::vector<node>& out, const build_range& root)
+{
+    std::vector<build_range> stack{{0, root.begin, root.end, root.depth}};
+    while (!stack.empty())
+    {
+        build_range r = stack.back();
+        stack.pop_back();
+        if (!split(out, r.node, r.begin, r.end, r.depth))
+            continue;
+        std::uint32_t left = out[r.node].first;
+        stack.push_back({left + 1, out[left + 1].first, out[left + 1].first + out[left + 1].count, r.depth + 1});
+        stack.push_back({left, out[left].first, out[left].first + out[left].count, r.depth + 1});
+    }
+}
+
+void rst::bvh::build(const mesh& m, const Eigen::Matrix4f& transform)
+{
+    gather(m, transform);
+    std::uint32_t count = (std::uint32_t)tris.size();
+    nodes.clear();
+    order.resize(count);
+    for (std::uint32_t t = 0; t < count; ++t)
+        order[t] = t;
+    if (count == 0)
+        return;
+
+    // Split breadth first until there is enough independent work for every thread
+    nodes.reserve(2 * count);
+    nodes.push_back({});
+    std::vector<build_range> pending{{0, 0, count, 0}}, subtrees;
+    std::size_t wanted = 4 * (thread_pool::global().size() + 1);
+    for (std::size_t i = 0; i < pending.size(); ++i)
+    {
+        build_range r = pending[i];
+        if (r.end - r.begin <= serial_range || subtrees.size() + (pending.size() - i) >= wanted)
+        {
+            subtrees.push_back(r);
+            continue;
+        }
+        if (!split(nodes, r.node, r.begin, r.end, r.depth))
+            continue;
+        std::uint32_t left = nodes[r.node].first;
+        pending.push_back({left, r.begin, nodes[left + 1].first, r.depth + 1});
+        pending.push_back({left + 1, nodes[left + 1].first, r.end, r.depth + 1});
+    }
+
+    std::vector<std::vector<node>> built(subtrees.size());
+    thread_pool::global().parallel_for(subtrees.size(), 1, [&](std::size_t b, std::size_t e)
+    {
+        for (std::size_t s = b; s < e; ++s)
+        {
+            built[s].reserve(2 * (subtrees[s].end - subtrees[s].begin));
+            built[s].push_back({});
+            build_subtree(built[s], subtrees[s]);
+        }
+    });
+
+    // Splice each subtree in place of its root; inner indices shift by the append offset
+    for (std::size_t s = 0; s < subtrees.size(); ++s)
+    {
+        std::uint32_t base = (std::uint32_t)nodes.size() - 1;
+        for (node& n : built[s])
+            if (n.count == 0)
+                n.first += base;
+        nodes[subtrees[s].node] = built[s][0];
+        nodes.insert(nodes.end(), built[s].begin() + 1, built[s].end());
+    }
+
+    // Triangles in leaf order, so a leaf reads one contiguous run
+    reorder();
+}
+
+void rst::bvh::reorder()
+{
+    reordered.resize(tris.size());
+    for (std::size_t k = 0; k < tris.size(); ++k)
+        reordered[k] = tris[order[k]];
+    tris.swap(reordered);
+}
+
+void rst::bvh::refit(const mesh& m, const Eigen::Matrix4f& transform)
+{
+    if (m.triangle_count != order.size() || nodes.empty())
+    {
+        build(m, transform);
+        return;
+    }
+
+    gather(m, transform);
+    reorder();
+
+    // Children always sit after their parent
+    for (std::size_t i = nodes.size(); i-- > 0;)
+    {
+        node& n = nodes[i];
+        if (n.count > 0)
+        {
+            update_bounds(n);
+            continue;
+        }
+        const node& l = nodes[n.first];
+        const node& r = nodes[n.first + 1];
+        n.lower = l.lower.cwiseMin(r.lower);
+        n.upper = l.upper.cwiseMax(r.upper);
+    }
+}
+
+bool rst::bvh::occluded(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float t_max) const
+{
+    if (nodes.empty())
+        return false;
+
+    Eigen::Vector3f inv = inverse(dir);
+    std::uint32_t stack[stack_size];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const node& n = nodes[stack[--top]];
+        Eigen::Vector3f t0 = (n.lower - origin).cwiseProduct(inv);
+        Eigen::Vector3f t1 = (n.upper - origin).cwiseProduct(inv);
+        float t_near = std::max(t0.cwiseMin(t1).maxCoeff(), 0.0f);
+        float t_far = std::min(t0.cwiseMax(t1).minCoeff(), t_max);
+        if (t_near > t_far)
+            continue;
+
+        if (n.count == 0)
+        {
+            stack[top++] = n.first + 1;
+            stack[top++] = n.first;
+            continue;
+        }
+        for (std::uint32_t k = n.first; k < n.first + n.count; ++k)
+        {
+            // Moller-Trumbore
+            const triangle& tri = tris[k];
+            Eigen::Vector3f p = dir.cross(tri.e2);
+            float det = tri.e1.dot(p);
+            if (std::abs(det) < 1e-12f)
+                continue;
+            float inv_det = 1.0f / det;
+            Eigen::Vector3f s = origin - tri.v0;
+            float u = s.dot(p) * inv_det;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+            Eigen::Vector3f q = s.cross(tri.e1);
+            float v = dir.dot(q) * inv_det;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+            float t = tri.e2.dot(q) * inv_det;
+            if (t > ray_epsilon && t < t_max)
+                return true;
+        }
+    }
+    return false;
+}
+
+std::uint32_t rst::bvh::occluded(const ray_packet& rays) const
+{
+    if (nodes.empty())
+        return 0;
+
+    alignas(32) float ix[8], iy[8], iz[8];
+    for (int k = 0; k < 8; ++k)
+    {
+        Eigen::Vector3f inv = inverse({rays.dx[k], rays.dy[k], rays.dz[k]});
+        ix[k] = inv.x();
+        iy[k] = inv.y();
+        iz[k] = inv.z();
+    }
+
+    std::uint32_t hit = 0;
+    std::uint32_t stack[stack_size];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0 && hit != rays.active)
+    {
+        const node& n = nodes[stack[--top]];
+
+        // Slab test for all eight rays; the node is visited if any live ray enters it
+        std::uint32_t live = rays.active & ~hit;
+#if defined(__AVX__)
+        auto slab = [](float lo, float hi, const float* o, const float* inv, __m256& t_near, __m256& t_far)
+        {
+            __m256 orig = _mm256_loadu_ps(o), scale = _mm256_load_ps(inv);
+            __m256 a = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(lo), orig), scale);
+            __m256 b = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(hi), orig), scale);
+            t_near = _mm256_max_ps(t_near, _mm256_min_ps(a, b));
+            t_far = _mm256_min_ps(t_far, _mm256_max_ps(a, b));
+        };
+        __m256 t_near = _mm256_setzero_ps(), t_far = _mm256_loadu_ps(rays.t_max);
+        slab(n.lower.x(), n.upper.x(), rays.ox, ix, t_near, t_far);
+        slab(n.lower.y(), n.upper.y(), rays.oy, iy, t_near, t_far);
+        slab(n.lower.z(), n.upper.z(), rays.oz, iz, t_near, t_far);
+        std::uint32_t enter = (std::uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+#else
+        std::uint32_t enter = 0;
+        for (int k = 0; k < 8; ++k)
+        {
+            float ax = (n.lower.x() - rays.ox[k]) * ix[k], bx = (n.upper.x() - rays.ox[k]) * ix[k];
+            float ay = (n.lower.y() - rays.oy[k]) * iy[k], by = (n.upper.y() - rays.oy[k]) * iy[k];
+            float az = (n.lower.z() - rays.oz[k]) * iz[k], bz = (n.upper.z() - rays.oz[k]) * iz[k];
+            float t_near = std::max({0.0f, std::min(ax, bx), std::min(ay, by), std::min(az, bz)});
+            float t_far = std::min({rays.t_max[k], std::max(ax, bx), std::max(ay, by), std::max(az, bz)});
+            enter |= (t_near <= t_far ? 1u : 0u) << k;
+        }
+#endif
+        if ((enter & live) == 0)
+            continue;
+
+        if (n.count == 0)
+        {
+            stack[top++] = n.first + 1;
+            stack[top++] = n.first;
+            continue;
+        }
+        for (std::uint32_t i = n.first; i < n.first + n.count; ++i)
+        {
+            // Moller-Trumbore across the lanes, written branch free so it vectorizes
+            const triangle& tri = tris[i];
+            const float e1x = tri.e1.x(), e1y = tri.e1.y(), e1z = tri.e1.z();
+            const float e2x = tri.e2.x(), e2y = tri.e2.y(), e2z = tri.e2.z();
+            std::uint32_t lanes = 0;
+            for (int k = 0; k < 8; ++k)
+            {
+                float px = rays.dy[k] * e2z - rays.dz[k] * e2y;
+                float py = rays.dz[k] * e2x - rays.dx[k] * e2z;
+                float pz = rays.dx[k] * e2y - rays.dy[k] * e2x;
+                float det = e1x * px + e1y * py + e1z * pz;
+                float inv_det = 1.0f / det;
+                float sx = rays.ox[k] - tri.v0.x(), sy = rays.oy[k] - tri.v0.y(), sz = rays.oz[k] - tri.v0.z();
+                float u = (sx * px + sy * py + sz * pz) * inv_det;
+                float qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+                float v = (rays.dx[k] * qx + rays.dy[k] * qy + rays.dz[k] * qz) * inv_det;
+                float t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+                bool accept = std::abs(det) > 1e-12f && u >= 0.0f && v >= 0.0f && u + v <= 1.0f &&
+                              t > ray_epsilon && t < rays.t_max[k];
+                lanes |= (accept ? 1u : 0u) << k;
+            }
+            hit |= lanes & live;
+        }
+    }
+    return hit;
+}
+
+float rst::bvh::ambient_occlusion(const Eigen::Vector3f& p, const Eigen::Vector3f& n, float radius,
+                                  int samples, std::uint32_t seed) const
+{
+    if (nodes.empty() || samples <= 0)
+        return 1.0f;
+
+    Eigen::Vector3f t, b;
+    basis(n, t, b);
+    Eigen::Vector3f origin = p + n * ray_bias;
+    random_sequence rng{seed};
+
+    int open = 0, cast = 0;
+    while (cast < samples)
+    {
+        ray_packet rays;
+        int lanes = std::min(8, samples - cast);
+        rays.active = (1u << lanes) - 1;
+        for (int k = 0; k < 8; ++k)
+        {
+            // Cosine-weighted hemisphere around n
+            float r = std::sqrt(rng.next()), phi = 2.0f * (float)M_PI * rng.next();
+            Eigen::Vector3f d = t * (r * std::cos(phi)) + b * (r * std::sin(phi)) +
+                                n * std::sqrt(std::max(0.0f, 1.0f - r * r));
+            rays.ox[k] = origin.x();
+            rays.oy[k] = origin.y();
+            rays.oz[k] = origin.z();
+            rays.dx[k] = d.x();
+            rays.dy[k] = d.y();
+            rays.dz[k] = d.z();
+            rays.t_max[k] = radius;
+        }
+        std::uint32_t hit = occluded(rays);
+        open += lanes - __builtin_popcount(hit);
+        cast += lanes;
+    }
+    return (float)open / samples;
+}
+
+float rst::bvh::light_visibility(const Eigen::Vector3f& p, const Eigen::Vector3f& n, const Eigen::Vector3f& light,
+                                 float light_radius, int samples, std::uint32_t seed) const
+{
+    if (nodes.empty())
+        return 1.0f;
+
+    Eigen::Vector3f origin = p + n * ray_bias;
+    Eigen::Vector3f to_light = light - origin;
+    float distance = to_light.norm();
+    if (light_radius <= 0.0f || samples <= 1)
+        return occluded(origin, to_light / distance, distance) ? 0.0f : 1.0f;
+
+    // Points on the disc the light presents to p
+    Eigen::Vector3f axis = to_light / distance, t, b;
+    basis(axis, t, b);
+    random_sequence rng{seed};
+
+    int lit = 0, cast = 0;
+    while (cast < samples)
+    {
+        ray_packet rays;
+        int lanes = std::min(8, samples - cast);
+        rays.active = (1u << lanes) - 1;
+        for (int k = 0; k < 8; ++k)
+        {
+            float r = light_radius * std::sqrt(rng.next()), phi = 2.0f * (float)M_PI * rng.next();
+            Eigen::Vector3f d = light + t * (r * std::cos(phi)) + b * (r * std::sin(phi)) - origin;
+            float length = d.norm();
+            d /= length;
+            rays.ox[k] = origin.x();
+            rays.oy[k] = origin.y();
+            rays.oz[k] = origin.z();
+            rays.dx[k] = d.x();
+            rays.dy[k] = d.y();
+            rays.dz[k] = d.z();
+            rays.t_max[k] = length;
+        }
+        std::uint32_t hit = occluded(rays);
+        lit += lanes - __builtin_popcount(hit);
+        cast += lanes;
+    }
+    return (float)lit / samples;
+}
@@ -0,0 +1,97 @@
+#ifndef RASTERIZER_BVH_H
+#define RASTERIZER_BVH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+#include "VertexStage.hpp"
+
+namespace rst
+{
+    // Eight rays traced together. Lanes whose bit is clear in `active` are ignored.
+    struct ray_packet
+    {
+        float ox[8], oy[8], oz[8];
+        float dx[8], dy[8], dz[8];
+        float t_max[8];
+        std::uint32_t active = 0xff;
+    };
+
+    // Bounding volume hierarchy over the triangles of a mesh, for shadow and
+    // ambient occlusion rays cast from fragment shaders. Queries are any-hit and
+    // safe to call from several threads at once.
+    //
+    // build() splits with a 16-bin surface area heuristic; the top levels are split
+    // serially and the subtrees below them are built in parallel on the global
+    // thread pool. Below a fixed depth nodes are split at the median instead, so
+    // no tree outgrows the stack the queries keep. When only the vertices move,
+    // refit() updates the bounds in place for a fraction of the cost, at the price
+    // of a slowly degrading tree.
+    class bvh
+    {
+    public:
+        // Triangles are placed in the space `transform` maps the mesh into, which
+        // is the space rays must be given in.
+        void build(const mesh& m, const Eigen::Matrix4f& transform = Eigen::Matrix4f::Identity());
+        void refit(const mesh& m, const Eigen::Matrix4f& transform = Eigen::Matrix4f::Identity());
+
+        bool empty() const { return nodes.empty(); }
+        std::size_t node_count() const { return nodes.size(); }
+        std::size_t triangle_count() const { return tris.size(); }
+
+        // Is anything hit along origin + t * dir for t in (0, t_max)?
+        bool occluded(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float t_max) const;
+        // Packet version; returns the mask of occluded lanes.
+        std::uint32_t occluded(const ray_packet& rays) const;
+
+        // Fraction of `samples` cosine-distributed rays within `radius` of p that
+        // escape, in [0, 1]. Rays go out as packets of eight.
+        float ambient_occlusion(const Eigen::Vector3f& p, const Eigen::Vector3f& n, float radius,
+                                int samples, std::uint32_t seed) const;
+        // Visible fraction of a spherical light; radius 0 gives a hard shadow.
+        float light_visibility(const Eigen::Vector3f& p, const Eigen::Vector3f& n, const Eigen::Vector3f& light,
+                               float light_radius, int samples, std::uint32_t seed) const;
+
+    private:
+        // A new node is an empty box until split() bounds it
+        struct node
+        {
+            Eigen::Vector3f lower = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+            std::uint32_t first = 0;    // left child, or first triangle of a leaf
+            Eigen::Vector3f upper = Eigen::Vector3f::Constant(-std::numeric_limits<float>::infinity());
+            std::uint32_t count = 0;    // 0 for inner nodes
+        };
+
+        // Triangle in the form the intersection test wants
+        struct triangle
+        {
+            Eigen::Vector3f v0, e1, e2;
+        };
+
+        struct build_range
+        {
+            std::uint32_t node, begin, end;
+            int depth;
+        };
+
+        void gather(const mesh& m, const Eigen::Matrix4f& transform);
+        void update_bounds(node& n) const;
+        // Puts tris in the order of order
+        void reorder();
+        bool split(std::vector<node>& out, std::uint32_t index, std::uint32_t begin, std::uint32_t end, int depth);
+        void build_subtree(std::vector<node>& out, const build_range& root);
+
+        std::vector<node> nodes;
+        std::vector<triangle> tris;
+        // Where tris is put in leaf order, kept so refits do not allocate
+        std::vector<triangle> reordered;
+        // Source triangle of each slot in tris, so refit can reorder new positions
+        std::vector<std::uint32_t> order;
+        std::vector<Eigen::Vector3f> centroids;
+        std::vector<Eigen::Vector3f> lower_bounds, upper_bounds;
+    };
+}
+
+#endif //RASTERIZER_BVH_H
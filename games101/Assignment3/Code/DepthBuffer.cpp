@@ -0,0 +1,101 @@
+#include "DepthBuffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+    float from_bits(std::uint32_t b)
+    {
+        float f;
+        std::memcpy(&f, &b, sizeof(f));
+        return f;
+    }
+
+    // Screen depth of NDC z, as the viewport transform maps it
+    float screen_depth(float ndc)
+    {
+        float f1 = (rst::depth_buffer::far_depth - rst::depth_buffer::near_depth) / 2;
+        float f2 = (rst::depth_buffer::far_depth + rst::depth_buffer::near_depth) / 2;
+        return ndc * f1 + f2;
+    }
+}
+
+const char* rst::to_string(depth_format format)
+{
+    switch (format)
+    {
+        case depth_format::float32: return "float32";
+        case depth_format::reversed_float32: return "reversed";
+        case depth_format::unorm24: return "unorm24";
+        case depth_format::unorm16: return "unorm16";
+    }
+    return "unknown";
+}
+
+size_t rst::depth_buffer::bytes_per_pixel(depth_format format)
+{
+    switch (format)
+    {
+        case depth_format::float32:
+        case depth_format::reversed_float32: return 4;
+        case depth_format::unorm24: return 3;
+        case depth_format::unorm16: return 2;
+    }
+    return 4;
+}
+
+void rst::depth_buffer::configure(depth_format format, size_t pixels)
+{
+    fmt = format;
+    storage.resize(footprint(format, pixels) / sizeof(std::uint32_t));
+    storage.shrink_to_fit();
+    switch (format)
+    {
+        case depth_format::float32: far = ordered(std::numeric_limits<float>::infinity()); break;
+        case depth_format::reversed_float32: far = ~bits(0.0f); break;
+        case depth_format::unorm24: far = 0xffffff; break;
+        case depth_format::unorm16: far = 0xffff; break;
+    }
+}
+
+void rst::depth_buffer::set_projection(const Eigen::Matrix4f& projection)
+{
+    // Clip z and w are both linear in view z, so z/w is affine in 1/w
+    ndc_offset = projection(2, 2) / projection(3, 2);
+    ndc_per_q = projection(2, 3);
+}
+
+uint32_t rst::depth_buffer::key(float z) const
+{
+    if (fmt != depth_format::reversed_float32)
+        return key(z, 0.0f);
+    float ndc = (z - screen_depth(0.0f)) / ((far_depth - near_depth) / 2);
+    return key(z, std::max(0.0f, (ndc - ndc_offset) / ndc_per_q));
+}
+
+float rst::depth_buffer::depth(uint32_t key) const
+{
+    if (key == far)
+        return std::numeric_limits<float>::infinity();
+    switch (fmt)
+    {
+        case depth_format::float32: return from_bits(key & 0x80000000u ? key & 0x7fffffffu : ~key);
+        case depth_format::reversed_float32: return screen_depth(ndc_offset + ndc_per_q * from_bits(~key));
+        case depth_format::unorm24: return near_depth + (far_depth - near_depth) * key / 0xffffff;
+        case depth_format::unorm16: return near_depth + (far_depth - near_depth) * key / 0xffff;
+    }
+    return std::numeric_limits<float>::infinity();
+}
+
+void rst::depth_buffer::fill(size_t first, size_t count, uint32_t key)
+{
+    if (bytes_per_pixel(fmt) == 4)
+    {
+        std::fill_n(storage.begin() + first, count, key);
+        return;
+    }
+    for (size_t i = first; i < first + count; ++i)
+        store(i, key);
+}
@@ -0,0 +1,150 @@
+#ifndef RASTERIZER_DEPTH_BUFFER_H
+#define RASTERIZER_DEPTH_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+
+namespace rst
+{
+    enum class depth_format : std::uint8_t
+    {
+        float32,            // screen depth as a float
+        reversed_float32,   // 1/w as a float: far is 0, where floats are densest
+        unorm24,            // screen depth over the depth range in 24 bits, packed in 3 bytes
+        unorm16             // the same in 16 bits
+    };
+
+    const char* to_string(depth_format format);
+
+    // Per-pixel depth in any of the formats. Depths go in and out as keys: unsigned
+    // values that order like the depths they stand for, nearer being smaller, so a
+    // depth test compares keys whatever the format and only key() and depth() know
+    // how a format encodes.
+    //
+    // Screen depth is what the viewport transform makes of NDC z: near_depth at the
+    // near plane to far_depth at the far plane.
+    class depth_buffer
+    {
+    public:
+        static constexpr float near_depth = 0.1f;
+        static constexpr float far_depth = 50.0f;
+
+        static std::size_t bytes_per_pixel(depth_format format);
+        // Bytes configure() allocates
+        static std::size_t footprint(depth_format format, std::size_t pixels)
+        {
+            return (pixels * bytes_per_pixel(format) + 3) / 4 * 4;
+        }
+
+        // Leaves the contents undefined; fill them before testing against them
+        void configure(depth_format format, std::size_t pixels);
+        depth_format format() const { return fmt; }
+        std::size_t bytes() const { return storage.size() * sizeof(std::uint32_t); }
+
+        // Reversed depth is computed from 1/w, which needs the projection to go
+        // back to screen depth
+        void set_projection(const Eigen::Matrix4f& projection);
+
+        // Key of a fragment at screen depth z and clip-space 1/w of q
+        std::uint32_t key(float z, float q) const
+        {
+            switch (fmt)
+            {
+                case depth_format::float32: return ordered(z);
+                case depth_format::reversed_float32: return ~bits(q);
+                case depth_format::unorm24: return quantize(z, 0xffffff);
+                case depth_format::unorm16: return quantize(z, 0xffff);
+            }
+            return far_key();
+        }
+        // Key of screen depth z alone, with q derived from it
+        std::uint32_t key(float z) const;
+        // Screen depth of a key; the far key is infinitely far
+        float depth(std::uint32_t key) const;
+        // What a cleared pixel holds
+        std::uint32_t far_key() const { return far; }
+
+        std::uint32_t load(std::size_t i) const
+        {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(storage.data());
+            switch (fmt)
+            {
+                case depth_format::float32:
+                case depth_format::reversed_float32: return storage[i];
+                case depth_format::unorm24:
+                {
+                    // Exactly 3 bytes: the next pixel may be another tile's, written concurrently
+                    std::uint32_t key = 0;
+                    std::memcpy(&key, p + i * 3, 3);
+                    return key;
+                }
+                case depth_format::unorm16: return read<std::uint16_t>(p + i * 2);
+            }
+            return far;
+        }
+
+        void store(std::size_t i, std::uint32_t key)
+        {
+            unsigned char* p = reinterpret_cast<unsigned char*>(storage.data());
+            switch (fmt)
+            {
+                case depth_format::float32:
+                case depth_format::reversed_float32: storage[i] = key; break;
+                case depth_format::unorm24: std::memcpy(p + i * 3, &key, 3); break;
+                case depth_format::unorm16: write<std::uint16_t>(p + i * 2, (std::uint16_t)key); break;
+            }
+        }
+
+        void fill(std::size_t first, std::size_t count, std::uint32_t key);
+
+    private:
+        template <typename T>
+        static T read(const unsigned char* p)
+        {
+            T value;
+            std::memcpy(&value, p, sizeof(T));
+            return value;
+        }
+
+        template <typename T>
+        static void write(unsigned char* p, T value)
+        {
+            std::memcpy(p, &value, sizeof(T));
+        }
+
+        static std::uint32_t bits(float f)
+        {
+            std::uint32_t b;
+            std::memcpy(&b, &f, sizeof(b));
+            return b;
+        }
+
+        // Float bits flipped so that unsigned order is numeric order
+        static std::uint32_t ordered(float f)
+        {
+            std::uint32_t b = bits(f);
+            return b & 0x80000000u ? ~b : b | 0x80000000u;
+        }
+
+        static std::uint32_t quantize(float z, std::uint32_t max)
+        {
+            float d = (z - near_depth) / (far_depth - near_depth);
+            d = d > 0.0f ? (d < 1.0f ? d : 1.0f) : 0.0f;
+            // The far key itself is kept for cleared pixels
+            return std::min((std::uint32_t)(d * max + 0.5f), max - 1);
+        }
+
+        depth_format fmt = depth_format::float32;
+        // Words for alignment; the narrow formats pack their pixels byte by byte
+        std::vector<std::uint32_t> storage;
+        std::uint32_t far = 0;
+        // NDC z = ndc_offset + ndc_per_q / w
+        float ndc_offset = 1.0f, ndc_per_q = 0.0f;
+    };
+}
+
+#endif //RASTERIZER_DEPTH_BUFFER_H
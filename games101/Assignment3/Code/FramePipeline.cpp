@@ -0,0 +1,87 @@
+#include "FramePipeline.hpp"
+
+rst::frame_pipeline::frame_pipeline(rasterizer& t) : target(t)
+{
+    for (auto& s : slots)
+        s.frame.memory.track(&target.memory_usage(), memory_kind::bins);
+    front_end = std::thread([this] { front_end_loop(); });
+}
+
+rst::frame_pipeline::~frame_pipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    front_end.join();
+}
+
+void rst::frame_pipeline::record(slot& s)
+{
+    target.begin_recording(s.frame);
+    s.record(target);
+    target.end_recording();
+}
+
+void rst::frame_pipeline::front_end_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        changed.wait(lock, [&] { return stopping || recorded < submitted; });
+        if (stopping)
+            return;
+        slot& s = slots[recorded % 2];
+        lock.unlock();
+        record(s);
+        lock.lock();
+        ++recorded;
+        changed.notify_all();
+    }
+}
+
+void rst::frame_pipeline::submit(record_fn record)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return submitted - presented < 2; });
+    slots[submitted % 2].record = std::move(record);
+    ++submitted;
+    changed.notify_all();
+}
+
+bool rst::frame_pipeline::present(unsigned char* bgr)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (presented == submitted)
+        return false;
+    changed.wait(lock, [&] { return recorded > presented; });
+    slot& s = slots[presented % 2];
+    lock.unlock();
+
+    // The front end is busy with the other slot meanwhile
+    target.clear(Buffers::Color | Buffers::Depth);
+    target.replay(s.frame);
+    target.resolve(bgr);
+
+    lock.lock();
+    ++presented;
+    changed.notify_all();
+    return true;
+}
+
+void rst::frame_pipeline::end_frame(float frame_ms)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return recorded == submitted; });
+    // The front end idles until the next submit, which only this thread makes
+    lock.unlock();
+
+    float before = target.render_scale();
+    target.end_frame(frame_ms);
+    if (target.render_scale() == before)
+        return;
+    // Binned for tiles that no longer cover the same pixels
+    for (unsigned long i = presented; i < submitted; ++i)
+        record(slots[i % 2]);
+}
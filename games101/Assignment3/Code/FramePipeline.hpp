@@ -0,0 +1,65 @@
+#ifndef RASTERIZER_FRAME_PIPELINE_H
+#define RASTERIZER_FRAME_PIPELINE_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "rasterizer.hpp"
+
+namespace rst
+{
+    // Two-stage frame pipeline over one rasterizer. A front-end thread runs the
+    // geometry of frame N + 1 (vertex stage, setup, binning) into one of two
+    // recorded frames while the caller rasterizes, shades and resolves frame N from
+    // the other, so a frame costs about the slower of the two rather than their sum.
+    //
+    // Every frame brings its own camera: the record function sets model, view and
+    // projection and issues the draws, on the front-end thread. Nothing else about
+    // the target (shaders, textures, scene, resolution) may change while frames are
+    // in flight; dynamic resolution takes effect in end_frame().
+    class frame_pipeline
+    {
+    public:
+        using record_fn = std::function<void(rasterizer&)>;
+
+        explicit frame_pipeline(rasterizer& target);
+        ~frame_pipeline();
+
+        frame_pipeline(const frame_pipeline&) = delete;
+        frame_pipeline& operator=(const frame_pipeline&) = delete;
+
+        // Queues a frame. Waits while two frames are already waiting to be presented.
+        void submit(record_fn record);
+
+        // Rasterizes the oldest submitted frame, waiting for its geometry if need
+        // be, and writes it like rasterizer::resolve(). False if none is queued.
+        bool present(unsigned char* bgr);
+
+        // Fence for rasterizer::end_frame(): waits until no geometry is being
+        // recorded, and records the queued frames again if the resolution changed.
+        void end_frame(float frame_ms);
+
+    private:
+        struct slot
+        {
+            recorded_frame frame;
+            record_fn record;
+        };
+
+        void front_end_loop();
+        void record(slot& s);
+
+        rasterizer& target;
+        slot slots[2];
+        // Frames [presented, recorded) are ready, [recorded, submitted) still queued
+        unsigned long submitted = 0, recorded = 0, presented = 0;
+
+        std::thread front_end;
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool stopping = false;
+    };
+}
+
+#endif //RASTERIZER_FRAME_PIPELINE_H
@@ -0,0 +1,20 @@
+#ifndef RASTERIZER_JITTER_H
+#define RASTERIZER_JITTER_H
+
+namespace rst
+{
+    // Low-discrepancy sub-pixel offsets, in [-0.5, 0.5): element `index` of the
+    // Halton sequence in `base`, centred on the pixel
+    inline float halton(int index, int base)
+    {
+        float f = 1.0f, result = 0.0f;
+        for (; index > 0; index /= base)
+        {
+            f /= base;
+            result += f * (index % base);
+        }
+        return result - 0.5f;
+    }
+}
+
+#endif //RASTERIZER_JITTER_H
@@ -0,0 +1,209 @@
+#include "MemoryAccount.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    std::atomic<std::size_t> process_current{0};
+    std::atomic<std::size_t> process_peak{0};
+    std::atomic<std::size_t> process_budget{0};
+
+    struct registry
+    {
+        std::mutex mutex;
+        std::vector<rst::memory_account*> accounts;
+    };
+
+    // Never destroyed: accounts of thread-local and static objects go away during
+    // exit, in no particular order relative to this
+    registry& accounts()
+    {
+        static registry* r = new registry;
+        return *r;
+    }
+
+    void raise_peak(std::atomic<std::size_t>& peak, std::size_t value)
+    {
+        std::size_t seen = peak.load(std::memory_order_relaxed);
+        while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+            ;
+    }
+
+    double mib(std::size_t bytes)
+    {
+        return bytes / (1024.0 * 1024.0);
+    }
+
+    std::string json_string(const std::string& s)
+    {
+        std::string out = "\"";
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+                out += c;
+        }
+        return out + "\"";
+    }
+}
+
+const char* rst::to_string(memory_kind kind)
+{
+    switch (kind)
+    {
+        case memory_kind::framebuffer: return "framebuffer";
+        case memory_kind::depth: return "depth";
+        case memory_kind::bins: return "bins";
+        case memory_kind::textures: return "textures";
+        case memory_kind::meshes: return "meshes";
+        case memory_kind::arenas: return "arenas";
+        case memory_kind::count: break;
+    }
+    return "unknown";
+}
+
+rst::memory_account::memory_account(std::string name, std::size_t budget) : label(std::move(name)), limit(budget)
+{
+    auto& r = accounts();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.accounts.push_back(this);
+}
+
+rst::memory_account::~memory_account()
+{
+    process_current.fetch_sub(current(), std::memory_order_relaxed);
+    auto& r = accounts();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.accounts.erase(std::find(r.accounts.begin(), r.accounts.end(), this));
+}
+
+bool rst::memory_account::charge(memory_kind kind, std::size_t bytes)
+{
+    std::size_t process = process_current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    std::size_t process_limit = process_budget.load(std::memory_order_relaxed);
+    if (process_limit && process > process_limit)
+    {
+        process_current.fetch_sub(bytes, std::memory_order_relaxed);
+        return false;
+    }
+    std::size_t mine = total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    std::size_t own_limit = limit.load(std::memory_order_relaxed);
+    if (own_limit && mine > own_limit)
+    {
+        total.fetch_sub(bytes, std::memory_order_relaxed);
+        process_current.fetch_sub(bytes, std::memory_order_relaxed);
+        return false;
+    }
+    by_kind[(int)kind].fetch_add(bytes, std::memory_order_relaxed);
+    raise_peak(total_peak, mine);
+    raise_peak(process_peak, process);
+    return true;
+}
+
+void rst::memory_account::add(memory_kind kind, std::size_t bytes)
+{
+    raise_peak(process_peak, process_current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    raise_peak(total_peak, total.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    by_kind[(int)kind].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void rst::memory_account::release(memory_kind kind, std::size_t bytes)
+{
+    by_kind[(int)kind].fetch_sub(bytes, std::memory_order_relaxed);
+    total.fetch_sub(bytes, std::memory_order_relaxed);
+    process_current.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+std::size_t rst::memory_account::current(memory_kind kind) const
+{
+    return by_kind[(int)kind].load(std::memory_order_relaxed);
+}
+
+void rst::set_memory_budget(std::size_t bytes)
+{
+    process_budget.store(bytes, std::memory_order_relaxed);
+}
+
+std::size_t rst::memory_budget()
+{
+    return process_budget.load(std::memory_order_relaxed);
+}
+
+std::size_t rst::memory_current()
+{
+    return process_current.load(std::memory_order_relaxed);
+}
+
+std::size_t rst::memory_peak()
+{
+    return process_peak.load(std::memory_order_relaxed);
+}
+
+bool rst::memory_fits(std::size_t bytes)
+{
+    std::size_t limit = memory_budget();
+    return !limit || memory_current() + bytes <= limit;
+}
+
+std::string rst::memory_report()
+{
+    constexpr int kinds = (int)memory_kind::count;
+    char line[512];
+    std::snprintf(line, sizeof(line), "memory: %.1f MiB current, %.1f MiB peak, budget %s\n",
+                  mib(memory_current()), mib(memory_peak()),
+                  memory_budget() ? (std::to_string(memory_budget() >> 20) + " MiB").c_str() : "none");
+    std::string out = line;
+
+    int n = std::snprintf(line, sizeof(line), "  %-32s %9s %9s", "account", "current", "peak");
+    for (int k = 0; k < kinds; ++k)
+        n += std::snprintf(line + n, sizeof(line) - n, " %11s", to_string((memory_kind)k));
+    out += line;
+    out += '\n';
+
+    auto& r = accounts();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const memory_account* a : r.accounts)
+    {
+        n = std::snprintf(line, sizeof(line), "  %-32.32s %9.2f %9.2f", a->name().c_str(), mib(a->current()),
+                          mib(a->peak()));
+        for (int k = 0; k < kinds; ++k)
+            n += std::snprintf(line + n, sizeof(line) - n, " %11.2f", mib(a->current((memory_kind)k)));
+        out += line;
+        out += '\n';
+    }
+    return out;
+}
+
+std::string rst::memory_report_json()
+{
+    std::string out = "{\"current\":" + std::to_string(memory_current()) +
+                      ",\"peak\":" + std::to_string(memory_peak()) +
+                      ",\"budget\":" + std::to_string(memory_budget()) + ",\"accounts\":[";
+    auto& r = accounts();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (std::size_t i = 0; i < r.accounts.size(); ++i)
+    {
+        const memory_account* a = r.accounts[i];
+        out += i ? ",{" : "{";
+        out += "\"name\":" + json_string(a->name()) + ",\"current\":" + std::to_string(a->current()) +
+               ",\"peak\":" + std::to_string(a->peak()) + ",\"budget\":" + std::to_string(a->budget());
+        for (int k = 0; k < (int)memory_kind::count; ++k)
+            out += ",\"" + std::string(to_string((memory_kind)k)) + "\":" +
+                   std::to_string(a->current((memory_kind)k));
+        out += "}";
+    }
+    return out + "]}";
+}
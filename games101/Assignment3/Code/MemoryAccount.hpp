@@ -0,0 +1,76 @@
+#ifndef RASTERIZER_MEMORY_ACCOUNT_H
+#define RASTERIZER_MEMORY_ACCOUNT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace rst
+{
+    enum class memory_kind : std::uint8_t
+    {
+        framebuffer,    // colour, plus the transparency, SSAO and statistics buffers
+        depth,          // depth buffer and anything built over it
+        bins,           // frame arenas and recorded frames: setup triangles and tile bins
+        textures,       // every mip level
+        meshes,
+        arenas,         // scratch arenas of the worker threads
+        count
+    };
+
+    const char* to_string(memory_kind kind);
+
+    // Bytes held by one owner (a rasterizer, a texture, a mesh), split by kind.
+    // Every live account is listed in the process-wide report, and all of them add
+    // up to the process total that memory_budget() limits. Accounts may be charged
+    // from any thread.
+    class memory_account
+    {
+    public:
+        explicit memory_account(std::string name, std::size_t budget = 0);
+        ~memory_account();
+
+        memory_account(const memory_account&) = delete;
+        memory_account& operator=(const memory_account&) = delete;
+
+        // Counts bytes about to be allocated. If that would take this account or
+        // the process past its budget nothing is counted and false is returned;
+        // the caller is expected to leave the allocation out.
+        bool charge(memory_kind kind, std::size_t bytes);
+        // Counts bytes whatever the budgets, for memory that has to exist anyway
+        void add(memory_kind kind, std::size_t bytes);
+        void release(memory_kind kind, std::size_t bytes);
+
+        // 0 is unlimited
+        void set_budget(std::size_t bytes) { limit = bytes; }
+        std::size_t budget() const { return limit; }
+        std::size_t current() const { return total.load(std::memory_order_relaxed); }
+        std::size_t current(memory_kind kind) const;
+        std::size_t peak() const { return total_peak.load(std::memory_order_relaxed); }
+
+        const std::string& name() const { return label; }
+
+    private:
+        std::string label;
+        std::atomic<std::size_t> limit;
+        std::atomic<std::size_t> total{0};
+        std::atomic<std::size_t> total_peak{0};
+        std::atomic<std::size_t> by_kind[(int)memory_kind::count] = {};
+    };
+
+    // Process-wide totals over all accounts
+    void set_memory_budget(std::size_t bytes);
+    std::size_t memory_budget();
+    std::size_t memory_current();
+    std::size_t memory_peak();
+    // Whether `bytes` more would still be within the process budget
+    bool memory_fits(std::size_t bytes);
+
+    // Snapshots of the totals and every live account, as an aligned table in MiB
+    // or as one line of JSON in bytes
+    std::string memory_report();
+    std::string memory_report_json();
+}
+
+#endif //RASTERIZER_MEMORY_ACCOUNT_H
@@ -0,0 +1,312 @@
+#include "Occlusion.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include "ThreadPool.hpp"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    constexpr int tile_width = 32, tile_height = 8;
+    // Geometry closer than this to the eye plane is never projected
+    constexpr float min_depth = 1e-4f;
+
+    // Bits l..h of a tile row, both ends clamped to the row
+    std::uint32_t span_bits(int l, int h)
+    {
+        l = std::max(l, 0);
+        h = std::min(h, tile_width - 1);
+        if (l > h)
+            return 0;
+        return (0xffffffffu >> (31 - (h - l))) << l;
+    }
+
+    // The 256-bit tile mask operations; eight rows of 32 pixels
+    bool mask_empty(const std::uint32_t* m)
+    {
+#if defined(__AVX2__)
+        __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(m));
+        return _mm256_testz_si256(v, v);
+#else
+        for (int r = 0; r < tile_height; ++r)
+            if (m[r])
+                return false;
+        return true;
+#endif
+    }
+
+    // mask |= bits; returns whether the mask is now full
+    bool mask_merge(std::uint32_t* mask, const std::uint32_t* bits)
+    {
+#if defined(__AVX2__)
+        __m256i m = _mm256_or_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(mask)),
+                                    _mm256_load_si256(reinterpret_cast<const __m256i*>(bits)));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(mask), m);
+        return _mm256_testc_si256(m, _mm256_set1_epi32(-1));
+#else
+        bool full = true;
+        for (int r = 0; r < tile_height; ++r)
+        {
+            mask[r] |= bits[r];
+            full &= mask[r] == 0xffffffffu;
+        }
+        return full;
+#endif
+    }
+
+    // Whether every bit of rect is set in mask
+    bool mask_covers(const std::uint32_t* mask, const std::uint32_t* rect)
+    {
+#if defined(__AVX2__)
+        return _mm256_testc_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(mask)),
+                                  _mm256_load_si256(reinterpret_cast<const __m256i*>(rect)));
+#else
+        for (int r = 0; r < tile_height; ++r)
+            if (rect[r] & ~mask[r])
+                return false;
+        return true;
+#endif
+    }
+
+    double elapsed_ms(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+}
+
+rst::occlusion_culler::occlusion_culler(int w, int h) : width(w), height(h)
+{
+    tiles_x = (w + tile_width - 1) / tile_width;
+    tiles_y = (h + tile_height - 1) / tile_height;
+    tiles.resize(tiles_x * tiles_y);
+    memory_use.add(memory_kind::depth, tiles.size() * sizeof(tile));
+    begin_frame(Eigen::Matrix4f::Identity());
+}
+
+void rst::occlusion_culler::begin_frame(const Eigen::Matrix4f& vp)
+{
+    view_projection = vp;
+    occluders.clear();
+    for (auto& t : tiles)
+    {
+        std::fill(std::begin(t.mask), std::end(t.mask), 0);
+        t.reference_depth = std::numeric_limits<float>::infinity();
+        t.layer_depth = 0.0f;
+    }
+}
+
+void rst::occlusion_culler::add_occluder(const mesh& m, const Eigen::Matrix4f& model)
+{
+    Eigen::Matrix4f mvp = view_projection * model;
+    projected.resize(m.vertices.count);
+    for (std::size_t i = 0; i < m.vertices.count; ++i)
+        projected[i] = mvp * Eigen::Vector4f(m.vertices.px[i], m.vertices.py[i], m.vertices.pz[i], 1.0f);
+
+    for (std::size_t k = 0; k < m.triangle_count; ++k)
+    {
+        Eigen::Vector4f v[3];
+        for (int j = 0; j < 3; ++j)
+            v[j] = projected[m.indices ? m.indices[k * 3 + j] : k * 3 + j];
+        // Without clipping, a triangle reaching behind the eye cannot be placed;
+        // leaving it out only loses occlusion
+        if (v[0].w() < min_depth || v[1].w() < min_depth || v[2].w() < min_depth)
+            continue;
+
+        float x[3], y[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            x[j] = 0.5f * width * (v[j].x() / v[j].w() + 1.0f);
+            y[j] = 0.5f * height * (v[j].y() / v[j].w() + 1.0f);
+        }
+
+        occluder_triangle tri;
+        tri.min_x = std::max(0, (int)std::ceil(std::max(std::min({x[0], x[1], x[2]}), -1.0f) - 0.5f));
+        tri.max_x = std::min(width - 1, (int)std::floor(std::min(std::max({x[0], x[1], x[2]}), width + 1.0f) - 0.5f));
+        tri.min_y = std::max(0, (int)std::ceil(std::max(std::min({y[0], y[1], y[2]}), -1.0f) - 0.5f));
+        tri.max_y = std::min(height - 1, (int)std::floor(std::min(std::max({y[0], y[1], y[2]}), height + 1.0f) - 0.5f));
+        if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+            continue;
+
+        // Edge i runs between the other two corners; flip all three so that the
+        // inside is positive whatever the winding
+        for (int i = 0; i < 3; ++i)
+        {
+            int j = (i + 1) % 3, l = (i + 2) % 3;
+            tri.a[i] = y[j] - y[l];
+            tri.b[i] = x[l] - x[j];
+            tri.c[i] = x[j] * y[l] - x[l] * y[j];
+        }
+        float area = tri.a[0] * x[0] + tri.b[0] * y[0] + tri.c[0];
+        if (area == 0.0f || !std::isfinite(area))
+            continue;
+        if (area < 0.0f)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                tri.a[i] = -tri.a[i];
+                tri.b[i] = -tri.b[i];
+                tri.c[i] = -tri.c[i];
+            }
+        }
+        // Pull every edge in by half a pixel's extent along its normal: a pixel
+        // then counts as covered only if all of it is, which the object test relies on
+        for (int i = 0; i < 3; ++i)
+            tri.c[i] -= 0.5f * (std::abs(tri.a[i]) + std::abs(tri.b[i]));
+        tri.max_depth = std::max({v[0].w(), v[1].w(), v[2].w()});
+        occluders.push_back(tri);
+    }
+}
+
+// Every band of tile rows belongs to one worker, which walks all occluders that
+// reach into it
+void rst::occlusion_culler::rasterize_band(int ty)
+{
+    int y0 = ty * tile_height;
+    for (const occluder_triangle& tri : occluders)
+    {
+        if (tri.max_y < y0 || tri.min_y >= y0 + tile_height)
+            continue;
+
+        // Covered pixels of each row: centres strictly inside all three (pulled in) edges
+        int row_lo[tile_height], row_hi[tile_height];
+        for (int r = 0; r < tile_height; ++r)
+        {
+            int y = y0 + r;
+            row_lo[r] = 1;
+            row_hi[r] = 0;
+            if (y < tri.min_y || y > tri.max_y)
+                continue;
+            float py = y + 0.5f;
+            float lo = -1.0f, hi = width + 1.0f;
+            bool empty = false;
+            for (int e = 0; e < 3; ++e)
+            {
+                float rest = tri.b[e] * py + tri.c[e];
+                if (tri.a[e] > 0.0f)
+                    lo = std::max(lo, -rest / tri.a[e]);
+                else if (tri.a[e] < 0.0f)
+                    hi = std::min(hi, -rest / tri.a[e]);
+                else
+                    empty |= rest <= 0.0f;
+            }
+            if (empty || !(lo < hi))
+                continue;
+            row_lo[r] = std::max(tri.min_x, (int)std::floor(lo - 0.5f) + 1);
+            row_hi[r] = std::min(tri.max_x, (int)std::ceil(hi - 0.5f) - 1);
+        }
+
+        for (int tx = tri.min_x / tile_width; tx <= tri.max_x / tile_width; ++tx)
+            draw_into(tiles[ty * tiles_x + tx], tx, tri, row_lo, row_hi);
+    }
+}
+
+void rst::occlusion_culler::draw_into(tile& t, int tx, const occluder_triangle& tri, const int* row_lo, const int* row_hi)
+{
+    // Entirely behind what already hides the tile
+    if (tri.max_depth >= t.reference_depth)
+        return;
+
+    alignas(32) std::uint32_t bits[tile_height];
+    int x0 = tx * tile_width;
+    for (int r = 0; r < tile_height; ++r)
+        bits[r] = span_bits(row_lo[r] - x0, row_hi[r] - x0);
+    if (mask_empty(bits))
+        return;
+
+    t.layer_depth = mask_empty(t.mask) ? tri.max_depth : std::max(t.layer_depth, tri.max_depth);
+    if (mask_merge(t.mask, bits))
+    {
+        // The layer hides the whole tile now: it becomes the reference, and the
+        // mask starts over for whatever comes in front of it
+        t.reference_depth = t.layer_depth;
+        std::fill(std::begin(t.mask), std::end(t.mask), 0);
+        t.layer_depth = 0.0f;
+    }
+}
+
+int rst::occlusion_culler::test(const object_bounds& object) const
+{
+    Eigen::Matrix4f mvp = view_projection * object.model;
+    float min_x = std::numeric_limits<float>::infinity(), max_x = -min_x;
+    float min_y = min_x, max_y = -min_x;
+    float nearest = min_x;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        Eigen::Vector4f p(corner & 1 ? object.max.x() : object.min.x(),
+                          corner & 2 ? object.max.y() : object.min.y(),
+                          corner & 4 ? object.max.z() : object.min.z(), 1.0f);
+        Eigen::Vector4f clip = mvp * p;
+        // Reaches the eye: cannot be bounded on screen
+        if (clip.w() < min_depth)
+            return 1;
+        float x = 0.5f * width * (clip.x() / clip.w() + 1.0f);
+        float y = 0.5f * height * (clip.y() / clip.w() + 1.0f);
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+        min_y = std::min(min_y, y);
+        max_y = std::max(max_y, y);
+        nearest = std::min(nearest, clip.w());
+    }
+
+    // Every pixel the rectangle touches, not just those whose centre it holds
+    int x0 = std::max(0, (int)std::floor(std::max(min_x, -1.0f)));
+    int x1 = std::min(width - 1, (int)std::floor(std::min(max_x, width + 1.0f)));
+    int y0 = std::max(0, (int)std::floor(std::max(min_y, -1.0f)));
+    int y1 = std::min(height - 1, (int)std::floor(std::min(max_y, height + 1.0f)));
+    if (x0 > x1 || y0 > y1)
+        return 2;
+
+    alignas(32) std::uint32_t rect[tile_height];
+    for (int ty = y0 / tile_height; ty <= y1 / tile_height; ++ty)
+    {
+        for (int tx = x0 / tile_width; tx <= x1 / tile_width; ++tx)
+        {
+            const tile& t = tiles[ty * tiles_x + tx];
+            if (nearest > t.reference_depth)
+                continue;
+            if (!(nearest > t.layer_depth))
+                return 1;
+            for (int r = 0; r < tile_height; ++r)
+            {
+                int y = ty * tile_height + r;
+                rect[r] = y >= y0 && y <= y1 ? span_bits(x0 - tx * tile_width, x1 - tx * tile_width) : 0;
+            }
+            if (!mask_covers(t.mask, rect))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+void rst::occlusion_culler::cull(const object_bounds* objects, std::size_t count, bool* visible)
+{
+    auto start = std::chrono::steady_clock::now();
+    thread_pool::global().parallel_for(tiles_y, 1, [&](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t ty = begin; ty < end; ++ty)
+            rasterize_band((int)ty);
+    });
+    last_stats = {};
+    last_stats.occluder_triangles = occluders.size();
+    last_stats.raster_ms = (float)elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    results.resize(count);
+    thread_pool::global().parallel_for(count, 64, [&](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t i = begin; i < end; ++i)
+            results[i] = (std::uint8_t)test(objects[i]);
+    });
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        visible[i] = results[i] == 1;
+        last_stats.objects_outside += results[i] == 2;
+        last_stats.objects_occluded += results[i] == 0;
+    }
+    last_stats.objects_tested = count;
+    last_stats.test_ms = (float)elapsed_ms(start);
+}
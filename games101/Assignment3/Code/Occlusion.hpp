@@ -0,0 +1,96 @@
+#ifndef RASTERIZER_OCCLUSION_H
+#define RASTERIZER_OCCLUSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+#include "MemoryAccount.hpp"
+#include "VertexStage.hpp"
+
+namespace rst
+{
+    // An object to be tested: its model-space bounding box and where it is placed.
+    struct object_bounds
+    {
+        Eigen::Vector3f min, max;
+        Eigen::Matrix4f model;
+    };
+
+    struct occlusion_stats
+    {
+        std::size_t occluder_triangles = 0;
+        std::size_t objects_tested = 0;
+        std::size_t objects_outside = 0;    // entirely off screen
+        std::size_t objects_occluded = 0;
+        float raster_ms = 0.0f;
+        float test_ms = 0.0f;
+    };
+
+    // Masked software occlusion culling. A few large occluders are rasterized into
+    // a low-resolution buffer of 32x8-pixel tiles, each holding a 256-bit coverage
+    // mask and two depths: a reference depth behind which the whole tile is hidden,
+    // and the farthest depth of the partly covered layer the mask describes. Once a
+    // layer covers its tile completely it becomes the new reference.
+    //
+    // Objects are then tested with their screen rectangle and nearest depth, so a
+    // draw can skip everything hidden behind walls and floors before any of its
+    // triangles are transformed. Depths are view distances (clip w). The test is
+    // conservative: only objects that are certainly hidden are reported invisible.
+    class occlusion_culler
+    {
+    public:
+        // Mask resolution, rounded up to whole tiles. A quarter of the target's
+        // resolution each way is usually enough.
+        occlusion_culler(int width, int height);
+
+        // Clears the mask and sets the camera for the following calls.
+        void begin_frame(const Eigen::Matrix4f& view_projection);
+        // Queues a mesh as an occluder. Only use geometry that really is opaque and
+        // solid; simplified stand-ins work as long as they lie inside the real thing.
+        void add_occluder(const mesh& m, const Eigen::Matrix4f& model);
+
+        // Rasterizes the queued occluders on the global thread pool, then tests every
+        // object in parallel. visible[i] is false when objects[i] is off screen or
+        // hidden behind the occluders.
+        void cull(const object_bounds* objects, std::size_t count, bool* visible);
+
+        const occlusion_stats& stats() const { return last_stats; }
+        // The mask, as depth: it is a conservative hierarchy over the occluders' depth
+        const memory_account& memory_usage() const { return memory_use; }
+
+    private:
+        struct occluder_triangle
+        {
+            // Edge functions a * x + b * y + c, positive inside, at pixel centres
+            float a[3], b[3], c[3];
+            float max_depth;
+            int min_x, max_x, min_y, max_y;
+        };
+
+        struct tile
+        {
+            alignas(32) std::uint32_t mask[8];  // bit i of row r: pixel (32 * tx + i, 8 * ty + r)
+            float reference_depth;
+            float layer_depth;
+        };
+
+        void rasterize_band(int ty);
+        void draw_into(tile& t, int tx, const occluder_triangle& tri, const int* row_lo, const int* row_hi);
+        // 0: hidden, 1: visible, 2: off screen
+        int test(const object_bounds& object) const;
+
+        memory_account memory_use{"occlusion culler"};
+        int width, height;
+        int tiles_x, tiles_y;
+        std::vector<tile> tiles;
+        std::vector<occluder_triangle> occluders;
+        // Reused between calls so a steady frame does not allocate
+        std::vector<Eigen::Vector4f> projected;
+        std::vector<std::uint8_t> results;
+        Eigen::Matrix4f view_projection = Eigen::Matrix4f::Identity();
+        occlusion_stats last_stats;
+    };
+}
+
+#endif //RASTERIZER_OCCLUSION_H
@@ -0,0 +1,79 @@
+#include "PixelStats.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+void rst::pixel_stats::reserve(int max_width, int max_height)
+{
+    size_t n = (size_t)max_width * max_height;
+    depth_tests.resize(n);
+    fragments.resize(n);
+    cycles.resize(n);
+}
+
+void rst::pixel_stats::reset(int w, int h)
+{
+    width = w;
+    height = h;
+    size_t n = (size_t)w * h;
+    std::fill_n(depth_tests.begin(), n, 0);
+    std::fill_n(fragments.begin(), n, 0);
+    std::fill_n(cycles.begin(), n, 0);
+}
+
+namespace
+{
+    template <typename T>
+    double full_scale(const std::vector<T>& values, size_t n)
+    {
+        std::vector<T> nonzero;
+        for (size_t i = 0; i < n; ++i)
+            if (values[i])
+                nonzero.push_back(values[i]);
+        if (nonzero.empty())
+            return 0.0;
+        auto at = nonzero.begin() + (nonzero.size() - 1) * 99 / 100;
+        std::nth_element(nonzero.begin(), at, nonzero.end());
+        return (double)*at;
+    }
+
+    // Blue, cyan, green, yellow, red at t = 0, 1/4, 1/2, 3/4, 1
+    void ramp(double t, unsigned char* bgr)
+    {
+        static const float stops[5][3] = {{0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}};
+        t = std::clamp(t, 0.0, 1.0) * 4;
+        int i = std::min((int)t, 3);
+        float f = (float)(t - i);
+        for (int c = 0; c < 3; ++c)
+            bgr[2 - c] = (unsigned char)std::lround(255 * (stops[i][c] + (stops[i + 1][c] - stops[i][c]) * f));
+    }
+
+    template <typename T>
+    double write(const std::vector<T>& values, size_t n, unsigned char* bgr)
+    {
+        double scale = full_scale(values, n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!values[i])
+                std::fill_n(bgr + i * 3, 3, 0);
+            else
+                ramp(values[i] / scale, bgr + i * 3);
+        }
+        return scale;
+    }
+}
+
+double rst::write_heatmap(const pixel_stats& stats, heatmap which, unsigned char* bgr)
+{
+    size_t n = (size_t)stats.width * stats.height;
+    switch (which)
+    {
+        case heatmap::depth_tests:
+            return write(stats.depth_tests, n, bgr);
+        case heatmap::fragments:
+            return write(stats.fragments, n, bgr);
+        case heatmap::cycles:
+            return write(stats.cycles, n, bgr);
+    }
+    return 0.0;
+}
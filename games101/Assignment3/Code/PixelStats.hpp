@@ -0,0 +1,58 @@
+#ifndef RASTERIZER_PIXEL_STATS_H
+#define RASTERIZER_PIXEL_STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace rst
+{
+    // Time stamp counter; nanoseconds where there is none.
+    inline std::uint64_t cycle_count()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // Per-pixel cost of everything drawn since the last colour clear. Rows are laid
+    // out like the frame buffer: top row first, render_width() pixels each.
+    struct pixel_stats
+    {
+        int width = 0, height = 0;
+        std::vector<std::uint32_t> depth_tests;     // covered samples tested, overdraw included
+        std::vector<std::uint32_t> fragments;       // fragment shader invocations
+        std::vector<std::uint64_t> cycles;          // spent inside those invocations
+
+        void reserve(int max_width, int max_height);
+        void reset(int w, int h);
+
+        // Bytes reserve() allocates
+        static std::size_t footprint(int max_width, int max_height)
+        {
+            return (std::size_t)max_width * max_height * (2 * sizeof(std::uint32_t) + sizeof(std::uint64_t));
+        }
+    };
+
+    enum class heatmap
+    {
+        depth_tests,
+        fragments,
+        cycles
+    };
+
+    // Renders one counter as a false-colour image in packed 8-bit BGR rows: black
+    // for nothing, then blue through green and yellow to red. Red is the 99th
+    // percentile of the non-zero pixels, so a shader call interrupted by the OS does
+    // not flatten the rest of the map; that value is returned.
+    double write_heatmap(const pixel_stats& stats, heatmap which, unsigned char* bgr);
+}
+
+#endif //RASTERIZER_PIXEL_STATS_H
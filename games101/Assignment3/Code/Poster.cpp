@@ -0,0 +1,328 @@
+#include "Poster.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include "rasterizer.hpp"
+
+namespace
+{
+    std::uint32_t crc32(std::uint32_t crc, const unsigned char* data, std::size_t size)
+    {
+        static const auto table = []
+        {
+            std::array<std::uint32_t, 256> t{};
+            for (std::uint32_t n = 0; n < 256; ++n)
+            {
+                std::uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (std::size_t i = 0; i < size; ++i)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    void put_be32(std::vector<unsigned char>& out, std::uint32_t v)
+    {
+        unsigned char b[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v};
+        out.insert(out.end(), b, b + 4);
+    }
+
+    void put_le16(std::vector<unsigned char>& out, std::uint16_t v)
+    {
+        out.push_back((unsigned char)v);
+        out.push_back((unsigned char)(v >> 8));
+    }
+
+    void put_le32(std::vector<unsigned char>& out, std::uint32_t v)
+    {
+        put_le16(out, (std::uint16_t)v);
+        put_le16(out, (std::uint16_t)(v >> 16));
+    }
+
+    void bgr_to_rgb(unsigned char* rgb, const unsigned char* bgr, int pixels)
+    {
+        for (int i = 0; i < pixels; ++i, rgb += 3, bgr += 3)
+        {
+            rgb[0] = bgr[2];
+            rgb[1] = bgr[1];
+            rgb[2] = bgr[0];
+        }
+    }
+}
+
+rst::image_row_writer::~image_row_writer()
+{
+    if (file)
+        std::fclose(file);
+}
+
+bool rst::image_row_writer::open(const std::string& path, int w, int h)
+{
+    if (file)
+        std::fclose(file);
+    width = w;
+    height = h;
+    rows_written = 0;
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    return write_header();
+}
+
+bool rst::image_row_writer::write_rows(const unsigned char* bgr, int rows)
+{
+    if (!file || rows_written + rows > height)
+        return false;
+    rows_written += rows;
+    return write_pixels(bgr, rows);
+}
+
+bool rst::image_row_writer::finish()
+{
+    if (!file)
+        return false;
+    bool ok = rows_written == height && write_trailer();
+    ok = std::fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+}
+
+bool rst::png_row_writer::write_chunk(const char type[4], const unsigned char* data, std::size_t size)
+{
+    std::vector<unsigned char> head;
+    put_be32(head, (std::uint32_t)size);
+    head.insert(head.end(), type, type + 4);
+    std::uint32_t crc = crc32(crc32(0, head.data() + 4, 4), data, size);
+    std::vector<unsigned char> tail;
+    put_be32(tail, crc);
+    return std::fwrite(head.data(), 1, head.size(), file) == head.size() &&
+           std::fwrite(data, 1, size, file) == size &&
+           std::fwrite(tail.data(), 1, tail.size(), file) == tail.size();
+}
+
+bool rst::png_row_writer::write_header()
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (std::fwrite(signature, 1, 8, file) != 8)
+        return false;
+
+    std::vector<unsigned char> ihdr;
+    put_be32(ihdr, width);
+    put_be32(ihdr, height);
+    // 8-bit RGB, deflate, adaptive filtering, no interlace
+    const unsigned char format[5] = {8, 2, 0, 0, 0};
+    ihdr.insert(ihdr.end(), format, format + 5);
+    if (!write_chunk("IHDR", ihdr.data(), ihdr.size()))
+        return false;
+
+    adler_a = 1;
+    adler_b = 0;
+    // zlib stream header: deflate, 32K window, no dictionary
+    const unsigned char zlib[2] = {0x78, 0x01};
+    return write_chunk("IDAT", zlib, 2);
+}
+
+bool rst::png_row_writer::write_pixels(const unsigned char* bgr, int rows)
+{
+    // Filter type 0 per row, then the pixels, split into stored blocks of at most 64K
+    std::size_t row_bytes = 1 + (std::size_t)width * 3;
+    std::size_t raw_size = row_bytes * rows;
+    chunk.clear();
+    chunk.reserve(raw_size + (raw_size / 65535 + 1) * 5);
+
+    std::vector<unsigned char> raw(raw_size);
+    for (int r = 0; r < rows; ++r)
+    {
+        unsigned char* row = raw.data() + r * row_bytes;
+        row[0] = 0;
+        bgr_to_rgb(row + 1, bgr + (std::size_t)r * width * 3, width);
+    }
+
+    for (std::size_t at = 0; at < raw_size;)
+    {
+        std::uint16_t length = (std::uint16_t)std::min<std::size_t>(65535, raw_size - at);
+        chunk.push_back(0);
+        put_le16(chunk, length);
+        put_le16(chunk, (std::uint16_t)~length);
+        chunk.insert(chunk.end(), raw.begin() + at, raw.begin() + at + length);
+        at += length;
+    }
+
+    // Adler-32 over the uncompressed stream, reducing before the sums can overflow
+    for (std::size_t at = 0; at < raw_size;)
+    {
+        std::size_t n = std::min<std::size_t>(5552, raw_size - at);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            adler_a += raw[at + i];
+            adler_b += adler_a;
+        }
+        adler_a %= 65521;
+        adler_b %= 65521;
+        at += n;
+    }
+    return write_chunk("IDAT", chunk.data(), chunk.size());
+}
+
+bool rst::png_row_writer::write_trailer()
+{
+    // Empty final stored block, then the checksum
+    chunk.assign({1, 0, 0, 0xff, 0xff});
+    put_be32(chunk, (adler_b << 16) | adler_a);
+    return write_chunk("IDAT", chunk.data(), chunk.size()) && write_chunk("IEND", nullptr, 0);
+}
+
+bool rst::tiff_row_writer::write_header()
+{
+    // Little endian; the directory offset is patched in by write_trailer()
+    const unsigned char header[8] = {'I', 'I', 42, 0, 0, 0, 0, 0};
+    line.resize((std::size_t)width * 3);
+    data_end = 8;
+    return std::fwrite(header, 1, 8, file) == 8;
+}
+
+bool rst::tiff_row_writer::write_pixels(const unsigned char* bgr, int rows)
+{
+    for (int r = 0; r < rows; ++r)
+    {
+        bgr_to_rgb(line.data(), bgr + (std::size_t)r * width * 3, width);
+        if (std::fwrite(line.data(), 1, line.size(), file) != line.size())
+            return false;
+        data_end += line.size();
+    }
+    return true;
+}
+
+bool rst::tiff_row_writer::write_trailer()
+{
+    std::uint64_t row_bytes = (std::uint64_t)width * 3;
+    std::uint64_t ifd = data_end + (data_end & 1);
+    const int entries = 10;
+    std::uint64_t bits_at = ifd + 2 + entries * 12 + 4;
+    std::uint64_t offsets_at = bits_at + 6;
+    std::uint64_t counts_at = offsets_at + 4 * (std::uint64_t)height;
+    if (counts_at + 4 * (std::uint64_t)height > 0xffffffffu)
+        return false;
+
+    std::vector<unsigned char> out;
+    if (data_end & 1)
+        out.push_back(0);
+    put_le16(out, entries);
+    auto entry = [&](std::uint16_t tag, std::uint16_t type, std::uint32_t count, std::uint32_t value)
+    {
+        put_le16(out, tag);
+        put_le16(out, type);
+        put_le32(out, count);
+        if (type == 3 && count == 1)
+        {
+            put_le16(out, (std::uint16_t)value);
+            put_le16(out, 0);
+        }
+        else
+        {
+            put_le32(out, value);
+        }
+    };
+    const std::uint16_t SHORT = 3, LONG = 4;
+    // A single strip is stored inline rather than through an offset
+    bool inline_strips = height == 1;
+    entry(256, LONG, 1, width);
+    entry(257, LONG, 1, height);
+    entry(258, SHORT, 3, (std::uint32_t)bits_at);
+    entry(259, SHORT, 1, 1);                 // no compression
+    entry(262, SHORT, 1, 2);                 // RGB
+    entry(273, LONG, height, inline_strips ? 8 : (std::uint32_t)offsets_at);
+    entry(277, SHORT, 1, 3);
+    entry(278, LONG, 1, 1);                  // rows per strip
+    entry(279, LONG, height, inline_strips ? (std::uint32_t)row_bytes : (std::uint32_t)counts_at);
+    entry(284, SHORT, 1, 1);                 // chunky
+    put_le32(out, 0);
+    put_le16(out, 8);
+    put_le16(out, 8);
+    put_le16(out, 8);
+    if (std::fwrite(out.data(), 1, out.size(), file) != out.size())
+        return false;
+
+    if (!inline_strips)
+    {
+        out.clear();
+        for (int r = 0; r < height; ++r)
+            put_le32(out, (std::uint32_t)(8 + r * row_bytes));
+        for (int r = 0; r < height; ++r)
+            put_le32(out, (std::uint32_t)row_bytes);
+        if (std::fwrite(out.data(), 1, out.size(), file) != out.size())
+            return false;
+    }
+
+    unsigned char offset[4];
+    for (int i = 0; i < 4; ++i)
+        offset[i] = (unsigned char)(ifd >> (8 * i));
+    return std::fseek(file, 4, SEEK_SET) == 0 && std::fwrite(offset, 1, 4, file) == 4;
+}
+
+std::unique_ptr<rst::image_row_writer> rst::make_row_writer(const std::string& path)
+{
+    std::string ext = path.substr(std::min(path.size(), path.find_last_of('.')));
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    if (ext == ".tif" || ext == ".tiff")
+        return std::make_unique<tiff_row_writer>();
+    return std::make_unique<png_row_writer>();
+}
+
+Eigen::Matrix4f rst::region_projection(const Eigen::Matrix4f& projection, int width, int height,
+                                      int x0, int y0, int region_width, int region_height)
+{
+    // The region's window in the full image's NDC
+    float l = 2.0f * x0 / width - 1, r = 2.0f * (x0 + region_width) / width - 1;
+    float t = 1 - 2.0f * y0 / height, b = 1 - 2.0f * (y0 + region_height) / height;
+    Eigen::Matrix4f narrow = Eigen::Matrix4f::Identity();
+    narrow(0, 0) = 2 / (r - l);
+    narrow(0, 3) = -(r + l) / (r - l);
+    narrow(1, 1) = 2 / (t - b);
+    narrow(1, 3) = -(t + b) / (t - b);
+    return narrow * projection;
+}
+
+bool rst::render_poster(rasterizer& target, const Eigen::Matrix4f& projection, int width, int height,
+                        const std::function<void(rasterizer&)>& draw, image_row_writer& out)
+{
+    // resolve() writes at output size, so regions have to be rendered at it too
+    target.set_render_scale(1.0f);
+    // Each region would otherwise be drawn with its own jitter and blended with the
+    // history of the region before it, or shaded at rates picked from the image of
+    // the region before it, leaving seams along the region borders
+    target.set_taa(false);
+    target.set_jitter(0.0f, 0.0f);
+    target.set_adaptive_shading(false);
+    int region_width = target.render_width(), region_height = target.render_height();
+    std::vector<unsigned char> region((std::size_t)region_width * region_height * 3);
+    std::vector<unsigned char> band((std::size_t)width * region_height * 3);
+
+    for (int y0 = 0; y0 < height; y0 += region_height)
+    {
+        int rows = std::min(region_height, height - y0);
+        for (int x0 = 0; x0 < width; x0 += region_width)
+        {
+            // Regions on the right and bottom edge reach past the image and are cropped
+            target.set_projection(region_projection(projection, width, height, x0, y0, region_width, region_height));
+            target.clear(Buffers::Color | Buffers::Depth);
+            draw(target);
+            target.resolve(region.data());
+
+            int columns = std::min(region_width, width - x0);
+            for (int y = 0; y < rows; ++y)
+                std::memcpy(&band[((std::size_t)y * width + x0) * 3], &region[(std::size_t)y * region_width * 3],
+                            (std::size_t)columns * 3);
+        }
+        if (!out.write_rows(band.data(), rows))
+            return false;
+    }
+    return out.finish();
+}
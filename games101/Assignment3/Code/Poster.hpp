@@ -0,0 +1,91 @@
+#ifndef RASTERIZER_POSTER_H
+#define RASTERIZER_POSTER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+
+namespace rst
+{
+    class rasterizer;
+
+    // Image encoders fed top to bottom a few rows at a time, so an image never has
+    // to exist in memory as a whole. Rows are packed 8-bit BGR, as resolve() writes.
+    class image_row_writer
+    {
+    public:
+        virtual ~image_row_writer();
+
+        bool open(const std::string& path, int width, int height);
+        bool write_rows(const unsigned char* bgr, int rows);
+        // Completes the file; fails if fewer rows than the height were written.
+        bool finish();
+
+    protected:
+        virtual bool write_header() = 0;
+        virtual bool write_pixels(const unsigned char* bgr, int rows) = 0;
+        virtual bool write_trailer() = 0;
+
+        std::FILE* file = nullptr;
+        int width = 0, height = 0;
+        int rows_written = 0;
+    };
+
+    // PNG with stored (uncompressed) deflate blocks: no zlib needed, and every row
+    // can be written the moment it is finished.
+    class png_row_writer : public image_row_writer
+    {
+    protected:
+        bool write_header() override;
+        bool write_pixels(const unsigned char* bgr, int rows) override;
+        bool write_trailer() override;
+
+    private:
+        bool write_chunk(const char type[4], const unsigned char* data, std::size_t size);
+
+        std::uint32_t adler_a = 1, adler_b = 0;
+        std::vector<unsigned char> chunk;
+    };
+
+    // Baseline uncompressed TIFF, one strip per row. The directory goes at the end
+    // once all strip offsets are known; files are limited to 4 GB.
+    class tiff_row_writer : public image_row_writer
+    {
+    protected:
+        bool write_header() override;
+        bool write_pixels(const unsigned char* bgr, int rows) override;
+        bool write_trailer() override;
+
+    private:
+        std::vector<unsigned char> line;
+        std::uint64_t data_end = 0;
+    };
+
+    // Picks the encoder from the extension: .tif/.tiff, anything else is PNG.
+    std::unique_ptr<image_row_writer> make_row_writer(const std::string& path);
+
+    // Narrows `projection`, made for a width x height image, to the region_width x
+    // region_height part at (x0, y0), image rows top down, for a target of the
+    // region's size. Regions reaching past the image simply see empty space.
+    Eigen::Matrix4f region_projection(const Eigen::Matrix4f& projection, int width, int height,
+                                      int x0, int y0, int region_width, int region_height);
+
+    // Renders a width x height image through `target`, one target-sized region at
+    // a time, by narrowing the projection to each region's part of the frustum.
+    // Every band of regions is written out as soon as it is complete, so memory
+    // stays at the target plus one band of 8-bit rows regardless of the image size.
+    //
+    // `draw` issues the frame's draws; model, view, shaders and textures are left
+    // as the caller set them up on the target. A target scaled down by dynamic
+    // resolution is set back to full scale first, and temporal anti-aliasing, any
+    // jitter and adaptive shading rates are switched off on it, as regions share
+    // no history. A fixed shading rate is kept.
+    bool render_poster(rasterizer& target, const Eigen::Matrix4f& projection, int width, int height,
+                       const std::function<void(rasterizer&)>& draw, image_row_writer& out);
+}
+
+#endif //RASTERIZER_POSTER_H
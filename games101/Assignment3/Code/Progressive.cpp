@@ -0,0 +1,122 @@
+#include "Progressive.hpp"
+
+#include <algorithm>
+#include "Jitter.hpp"
+#include "rasterizer.hpp"
+
+rst::progressive_renderer::progressive_renderer(rasterizer& r, int w, int h, int samples, float preview)
+    : target(r), width(w), height(h), max_samples(std::max(1, samples)), preview_scale(preview)
+{
+    pass.resize((size_t)w * h * 3);
+    accumulation.resize(pass.size());
+    display.resize(pass.size());
+    target.set_cancel_flag(&cancel);
+    worker = std::thread([this] { worker_loop(); });
+}
+
+rst::progressive_renderer::~progressive_renderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        cancel = true;
+    }
+    wake.notify_one();
+    worker.join();
+    target.set_cancel_flag(nullptr);
+}
+
+void rst::progressive_renderer::restart(scene_fn setup, scene_fn draw)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        setup_fn = std::move(setup);
+        draw_fn = std::move(draw);
+        ++generation;
+        cancel = true;
+    }
+    wake.notify_one();
+}
+
+int rst::progressive_renderer::latest(unsigned char* bgr)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (display_samples >= 0)
+        std::copy(display.begin(), display.end(), bgr);
+    return display_samples;
+}
+
+void rst::progressive_renderer::worker_loop()
+{
+    unsigned long seen = 0;
+    int sample = -1;
+    scene_fn setup, draw;
+    for (;;)
+    {
+        unsigned long current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen || (seen != 0 && sample < max_samples); });
+            if (stopping)
+                return;
+            if (generation != seen)
+            {
+                seen = generation;
+                sample = -1;
+                setup = setup_fn;
+                draw = draw_fn;
+                cancel = false;
+            }
+            current = seen;
+        }
+
+        if (!render_pass(setup, draw, sample))
+            continue;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        // A restart that came in after the last tile still wins
+        if (generation != current)
+            continue;
+        if (sample < 0)
+        {
+            std::copy(pass.begin(), pass.end(), display.begin());
+        }
+        else
+        {
+            float normalize = 1.0f / (sample + 1);
+            for (size_t i = 0; i < display.size(); ++i)
+                display[i] = (unsigned char)std::min(255.0f, accumulation[i] * normalize + 0.5f);
+        }
+        display_samples = sample + 1;
+        ++sample;
+    }
+}
+
+// Returns false when the pass was cancelled part way
+bool rst::progressive_renderer::render_pass(const scene_fn& setup, const scene_fn& draw, int sample)
+{
+    if (sample < 0)
+    {
+        target.set_render_scale(preview_scale);
+        target.set_jitter(0, 0);
+    }
+    else
+    {
+        target.set_render_scale(1.0f);
+        target.set_jitter(halton(sample + 1, 2), halton(sample + 1, 3));
+    }
+
+    setup(target);
+    target.clear(Buffers::Color | Buffers::Depth);
+    draw(target);
+    if (target.cancelled())
+        return false;
+    target.resolve(pass.data());
+
+    if (sample == 0)
+        std::copy(pass.begin(), pass.end(), accumulation.begin());
+    else if (sample > 0)
+        for (size_t i = 0; i < pass.size(); ++i)
+            accumulation[i] += pass[i];
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef RASTERIZER_PROGRESSIVE_H
+#define RASTERIZER_PROGRESSIVE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rst
+{
+    class rasterizer;
+
+    // Progressive refinement on a background thread. After restart() the target
+    // first renders a cheap preview at a reduced scale; every idle pass after that
+    // adds one full-resolution sample at a new sub-pixel offset to an accumulation
+    // buffer, until max_samples are in. A restart cancels the pass in flight at its
+    // next tile, so the caller never waits longer than one tile for the previous
+    // camera to get out of the way.
+    //
+    // The target belongs to the worker from construction on; configure it fully
+    // (shaders, textures, buffers) before handing it over.
+    class progressive_renderer
+    {
+    public:
+        using scene_fn = std::function<void(rasterizer&)>;
+
+        progressive_renderer(rasterizer& target, int output_width, int output_height,
+                             int max_samples = 16, float preview_scale = 0.25f);
+        ~progressive_renderer();
+
+        progressive_renderer(const progressive_renderer&) = delete;
+        progressive_renderer& operator=(const progressive_renderer&) = delete;
+
+        // setup() places the camera and clears nothing; draw() issues the draws.
+        // Both run on the worker thread.
+        void restart(scene_fn setup, scene_fn draw);
+
+        // Copies the newest image as packed BGR rows at output size. Returns the
+        // number of accumulated samples it holds: 0 for the preview, -1 before the
+        // first image. Until the preview after a restart is in, this is still the
+        // previous camera's image.
+        int latest(unsigned char* bgr);
+
+    private:
+        void worker_loop();
+        bool render_pass(const scene_fn& setup, const scene_fn& draw, int sample);
+
+        rasterizer& target;
+        int width, height;
+        int max_samples;
+        float preview_scale;
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        unsigned long generation = 0;
+        scene_fn setup_fn, draw_fn;
+        std::atomic<bool> cancel{false};
+
+        std::vector<unsigned char> pass;
+        std::vector<float> accumulation;
+
+        // Guarded by mutex
+        std::vector<unsigned char> display;
+        int display_samples = -1;
+    };
+}
+
+#endif //RASTERIZER_PROGRESSIVE_H
@@ -0,0 +1,350 @@
+#include "RenderDaemon.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+
+bool rst::parse_render_request(const std::string& line, render_request& request, std::string& error)
+{
+    std::istringstream in(line);
+    std::string token;
+    try
+    {
+        while (in >> token)
+        {
+            auto eq = token.find('=');
+            if (eq == std::string::npos)
+            {
+                error = "expected key=value, got " + token;
+                return false;
+            }
+            std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+            if (key == "model") request.model = value;
+            else if (key == "texture") request.texture = value;
+            else if (key == "shader") request.shader = value;
+            else if (key == "angle") request.angle = std::stof(value);
+            else if (key == "eye_x") request.eye_pos.x() = std::stof(value);
+            else if (key == "eye_y") request.eye_pos.y() = std::stof(value);
+            else if (key == "eye_z") request.eye_pos.z() = std::stof(value);
+            else if (key == "fov") request.fov = std::stof(value);
+            else if (key == "width") request.width = std::stoi(value);
+            else if (key == "height") request.height = std::stoi(value);
+            else if (key == "out") request.output = value;
+            else
+            {
+                error = "unknown key " + key;
+                return false;
+            }
+        }
+    }
+    catch (const std::exception&)
+    {
+        error = "bad number in " + token;
+        return false;
+    }
+
+    if (request.model.empty() || request.output.empty())
+    {
+        error = "model and out are required";
+        return false;
+    }
+    if (request.width <= 0 || request.height <= 0 || request.width > 16384 || request.height > 16384)
+    {
+        error = "resolution out of range";
+        return false;
+    }
+    return true;
+}
+
+rst::render_daemon::render_daemon(config c) : cfg(std::move(c))
+{
+}
+
+rst::render_daemon::~render_daemon()
+{
+    stop();
+    queue_ready.notify_all();
+    for (auto& w : workers)
+        w.join();
+}
+
+std::shared_ptr<rst::render_daemon::cached_model> rst::render_daemon::model(const std::string& path)
+{
+    std::shared_ptr<cached_model> entry;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto& slot = models[path];
+        if (!slot)
+            slot = std::make_shared<cached_model>(path);
+        entry = slot;
+    }
+    // Loading happens outside the cache lock so other models stay available; a
+    // second request for the same file waits here instead of parsing it again
+    std::lock_guard<std::mutex> lock(entry->load_mutex);
+    if (!entry->loaded)
+    {
+        // A failure is not remembered, so a file that shows up later can still be used
+        entry->ok = cfg.load_model(path, entry->storage, entry->data);
+        entry->loaded = entry->ok;
+        // Arena growth is never refused, so the budget is checked once it is loaded
+        if (entry->ok && !memory_fits(0))
+        {
+            entry->ok = false;
+            entry->over_budget = true;
+        }
+    }
+    if (entry->over_budget)
+    {
+        // Freed with the last request holding it; a later one loads it afresh
+        std::lock_guard<std::mutex> cache_lock(cache_mutex);
+        auto it = models.find(path);
+        if (it != models.end() && it->second == entry)
+            models.erase(it);
+    }
+    return entry;
+}
+
+std::shared_ptr<Texture> rst::render_daemon::texture(const std::string& path)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = textures.find(path);
+        if (it != textures.end())
+            return it->second;
+    }
+    std::shared_ptr<Texture> tex;
+    try
+    {
+        tex = std::make_shared<Texture>(path);
+    }
+    catch (const std::exception&)
+    {
+        // cv::cvtColor throws on the empty image imread returns for a bad path
+        return nullptr;
+    }
+    if (tex->width == 0)
+        return tex;
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return textures.emplace(path, tex).first->second;
+}
+
+std::unique_ptr<rst::rasterizer> rst::render_daemon::checkout(int width, int height)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto& free_list = idle[{width, height}];
+        if (!free_list.empty())
+        {
+            auto r = std::move(free_list.back());
+            free_list.pop_back();
+            return r;
+        }
+        // Idle targets of other sizes are only a cache
+        size_t needed = rasterizer::footprint(width, height);
+        for (auto& entry : idle)
+            while (!memory_fits(needed) && !entry.second.empty())
+                entry.second.pop_back();
+        if (!memory_fits(needed))
+            return nullptr;
+    }
+    return std::make_unique<rasterizer>(width, height);
+}
+
+void rst::render_daemon::checkin(std::unique_ptr<rasterizer> r)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    idle[{r->render_width(), r->render_height()}].push_back(std::move(r));
+}
+
+bool rst::render_daemon::write_output(const std::string& output, const unsigned char* bgr, int width, int height)
+{
+    std::size_t bytes = (std::size_t)width * height * 3;
+    if (output.compare(0, 4, "shm:") == 0)
+    {
+        int fd = shm_open(output.c_str() + 4, O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            return false;
+        bool ok = ftruncate(fd, bytes) == 0;
+        void* p = ok ? mmap(nullptr, bytes, PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        std::memcpy(p, bgr, bytes);
+        munmap(p, bytes);
+        return true;
+    }
+    cv::Mat image(height, width, CV_8UC3, const_cast<unsigned char*>(bgr));
+    return cv::imwrite(output, image);
+}
+
+std::string rst::render_daemon::handle(const std::string& line)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (line == "memory")
+        return "ok " + memory_report_json();
+
+    render_request request;
+    std::string error;
+    if (!parse_render_request(line, request, error))
+        return "error " + error;
+
+    auto shader = cfg.shaders.find(request.shader);
+    if (shader == cfg.shaders.end())
+        return "error unknown shader " + request.shader;
+
+    auto m = model(request.model);
+    if (m->over_budget)
+        return "error memory budget exceeded by " + request.model;
+    if (!m->ok)
+        return "error cannot load " + request.model;
+
+    std::shared_ptr<Texture> tex;
+    if (!request.texture.empty())
+    {
+        tex = texture(request.texture);
+        if (!tex)
+            return "error cannot load " + request.texture;
+        if (tex->width == 0)
+            return "error memory budget exceeded by " + request.texture;
+    }
+
+    auto r = checkout(request.width, request.height);
+    if (!r)
+        return "error memory budget exceeded by the render target";
+    if (tex)
+        r->set_texture(*tex);
+    else
+        r->clear_texture();
+    r->set_fragment_shader(shader->second);
+    r->set_opacity(1.0f);
+    cfg.set_camera(request, *r);
+
+    r->clear(Buffers::Color | Buffers::Depth);
+    r->draw(m->data);
+
+    // Resolved into the rasterizer's frame arena: the image is dead once written out
+    auto* bgr = r->frame_memory().alloc_array<unsigned char>((std::size_t)request.width * request.height * 3);
+    r->resolve(bgr);
+    bool written = write_output(request.output, bgr, request.width, request.height);
+    checkin(std::move(r));
+    if (!written)
+        return "error cannot write " + request.output;
+
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return "ok " + std::to_string(ms);
+}
+
+void rst::render_daemon::serve(int connection)
+{
+    std::string line;
+    char buf[1024];
+    while (line.find('\n') == std::string::npos && line.size() < 64 * 1024)
+    {
+        ssize_t n = read(connection, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        line.append(buf, n);
+    }
+    line = line.substr(0, line.find('\n'));
+
+    std::string reply = handle(line) + "\n";
+    for (std::size_t sent = 0; sent < reply.size();)
+    {
+        ssize_t n = write(connection, reply.data() + sent, reply.size() - sent);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    ::close(connection);
+}
+
+void rst::render_daemon::worker_loop()
+{
+    for (;;)
+    {
+        int connection;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_ready.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            connection = queue.front();
+            queue.pop_front();
+        }
+        serve(connection);
+    }
+}
+
+bool rst::render_daemon::run()
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        return false;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (cfg.socket_path.size() >= sizeof(addr.sun_path))
+    {
+        ::close(listener);
+        return false;
+    }
+    std::strcpy(addr.sun_path, cfg.socket_path.c_str());
+    unlink(cfg.socket_path.c_str());
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0)
+    {
+        ::close(listener);
+        return false;
+    }
+
+    for (unsigned i = 0; i < cfg.workers; ++i)
+        workers.emplace_back([this] { worker_loop(); });
+
+    auto last_report = std::chrono::steady_clock::now();
+    while (!stopping)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (cfg.memory_report_seconds > 0 &&
+            std::chrono::duration<float>(now - last_report).count() >= cfg.memory_report_seconds)
+        {
+            last_report = now;
+            std::string report = cfg.memory_report_json ? memory_report_json() + "\n" : memory_report();
+            (void)!write(STDERR_FILENO, report.data(), report.size());
+        }
+
+        // Wake up now and then to notice stop()
+        pollfd pfd{listener, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+            continue;
+
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (queue.size() >= cfg.queue_limit)
+        {
+            lock.unlock();
+            static const char busy[] = "error busy\n";
+            (void)!write(connection, busy, sizeof(busy) - 1);
+            ::close(connection);
+            continue;
+        }
+        queue.push_back(connection);
+        lock.unlock();
+        queue_ready.notify_one();
+    }
+
+    ::close(listener);
+    unlink(cfg.socket_path.c_str());
+    queue_ready.notify_all();
+    for (auto& w : workers)
+        w.join();
+    workers.clear();
+    return true;
+}
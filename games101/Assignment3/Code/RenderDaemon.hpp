@@ -0,0 +1,114 @@
+#ifndef RASTERIZER_RENDER_DAEMON_H
+#define RASTERIZER_RENDER_DAEMON_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "rasterizer.hpp"
+
+namespace rst
+{
+    // One line on the socket, whitespace separated key=value pairs, e.g.
+    //   model=../models/spot/spot_triangulated_good.obj shader=texture
+    //   texture=../models/spot/spot_texture.png angle=140 width=256 height=256 out=thumb.png
+    // "out" is an image path, or shm:/name to get packed BGR bytes in a POSIX
+    // shared-memory object. The reply is "ok <milliseconds>" or "error <reason>".
+    // The line "memory" instead replies "ok " and memory_report_json().
+    struct render_request
+    {
+        std::string model;
+        std::string texture;
+        std::string shader = "phong";
+        float angle = 140.0f;
+        Eigen::Vector3f eye_pos = {0, 0, 10};
+        float fov = 45.0f;
+        int width = 700;
+        int height = 700;
+        std::string output;
+    };
+
+    bool parse_render_request(const std::string& line, render_request& request, std::string& error);
+
+    using fragment_shader_fn = std::function<Eigen::Vector3f(fragment_shader_payload)>;
+
+    // Keeps meshes, textures and rasterizers warm between requests and serves them
+    // from a bounded pool of worker threads.
+    class render_daemon
+    {
+    public:
+        struct config
+        {
+            std::string socket_path;
+            unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+            // Connections waiting for a worker; beyond this new ones are refused
+            std::size_t queue_limit = 64;
+            // Seconds between memory reports on stderr; 0 for none
+            float memory_report_seconds = 0;
+            bool memory_report_json = false;
+
+            std::function<bool(const std::string& path, arena& storage, mesh& result)> load_model;
+            std::map<std::string, fragment_shader_fn> shaders;
+            // Sets model, view and projection for the request
+            std::function<void(const render_request& request, rasterizer& r)> set_camera;
+        };
+
+        explicit render_daemon(config cfg);
+        ~render_daemon();
+
+        // Serves until stop() is called (from a signal handler or another thread).
+        bool run();
+        void stop() { stopping = true; }
+
+        // Executes one request on the calling thread and returns the reply line.
+        std::string handle(const std::string& line);
+
+    private:
+        struct cached_model
+        {
+            explicit cached_model(const std::string& path) : account("mesh " + path) {}
+
+            std::mutex load_mutex;
+            bool loaded = false;
+            bool ok = false;
+            bool over_budget = false;
+            memory_account account;
+            arena storage{1 << 20, &account, memory_kind::meshes};
+            mesh data;
+        };
+
+        std::shared_ptr<cached_model> model(const std::string& path);
+        // Empty (zero width) when it would exceed the memory budget
+        std::shared_ptr<Texture> texture(const std::string& path);
+        // Null when a target of that size would exceed the memory budget even
+        // after dropping idle ones
+        std::unique_ptr<rasterizer> checkout(int width, int height);
+        void checkin(std::unique_ptr<rasterizer> r);
+        bool write_output(const std::string& output, const unsigned char* bgr, int width, int height);
+
+        void worker_loop();
+        void serve(int connection);
+
+        config cfg;
+        std::atomic<bool> stopping{false};
+
+        std::mutex queue_mutex;
+        std::condition_variable queue_ready;
+        std::deque<int> queue;
+        std::vector<std::thread> workers;
+
+        std::mutex cache_mutex;
+        std::map<std::string, std::shared_ptr<cached_model>> models;
+        std::map<std::string, std::shared_ptr<Texture>> textures;
+        std::map<std::pair<int, int>, std::vector<std::unique_ptr<rasterizer>>> idle;
+    };
+}
+
+#endif //RASTERIZER_RENDER_DAEMON_H
@@ -0,0 +1,186 @@
+#include "SSAO.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include "ThreadPool.hpp"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    constexpr int tile = 16;
+
+    // Per-pixel rotation of the kernel, repeating every 4x4 pixels; the blur
+    // removes the pattern
+    Eigen::Vector3f rotation(int x, int row)
+    {
+        static const float angles[16] = {0.0f, 3.5f, 1.6f, 5.1f, 4.3f, 0.8f, 5.9f, 2.4f,
+                                         1.2f, 4.7f, 0.4f, 3.9f, 5.5f, 2.0f, 4.9f, 2.8f};
+        float a = angles[(row & 3) * 4 + (x & 3)];
+        return {std::cos(a), std::sin(a), 0.0f};
+    }
+}
+
+rst::ssao_pass::ssao_pass()
+{
+    // Hemisphere around +z, denser close to the origin
+    std::uint32_t state = 12345;
+    auto next = [&]
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    };
+    for (int i = 0; i < kernel_size; ++i)
+    {
+        Eigen::Vector3f s(next() * 2 - 1, next() * 2 - 1, next());
+        s = s.normalized() * next();
+        float t = (float)i / kernel_size;
+        kernel[i] = s * (0.1f + 0.9f * t * t);
+    }
+}
+
+void rst::ssao_pass::reserve(int max_width, int max_height)
+{
+    size_t count = (size_t)((max_width + 1) / 2) * ((max_height + 1) / 2);
+    ao.resize(count);
+    scratch.resize(count);
+    half_depth.resize(count);
+}
+
+size_t rst::ssao_pass::footprint(int max_width, int max_height)
+{
+    return (size_t)((max_width + 1) / 2) * ((max_height + 1) / 2) * 3 * sizeof(float);
+}
+
+void rst::ssao_pass::run(const ssao_inputs& in, const ssao_settings& settings)
+{
+    half_width = (in.width + 1) / 2;
+    half_height = (in.height + 1) / 2;
+    int tiles_x = (half_width + tile - 1) / tile, tiles_y = (half_height + tile - 1) / tile;
+    auto over_tiles = [&](auto&& fn)
+    {
+        thread_pool::global().parallel_for(tiles_x * tiles_y, 1, [&](size_t begin, size_t end)
+        {
+            for (size_t t = begin; t < end; ++t)
+            {
+                int x0 = (int)(t % tiles_x) * tile, r0 = (int)(t / tiles_x) * tile;
+                fn(x0, std::min(half_width, x0 + tile), r0, std::min(half_height, r0 + tile));
+            }
+        });
+    };
+
+    over_tiles([&](int x0, int x1, int r0, int r1) { evaluate(in, settings, x0, x1, r0, r1); });
+    over_tiles([&](int x0, int x1, int r0, int r1) { blur(ao, scratch, 1, 0, settings.blur_radius, x0, x1, r0, r1); });
+    over_tiles([&](int x0, int x1, int r0, int r1) { blur(scratch, ao, 0, 1, settings.blur_radius, x0, x1, r0, r1); });
+}
+
+void rst::ssao_pass::evaluate(const ssao_inputs& in, const ssao_settings& settings, int x0, int x1, int r0, int r1)
+{
+    const Eigen::Matrix4f& p = in.projection;
+    float p00 = p(0, 0), p02 = p(0, 2), p11 = p(1, 1), p12 = p(1, 2);
+
+    for (int hr = r0; hr < r1; ++hr)
+    {
+        for (int hx = x0; hx < x1; ++hx)
+        {
+            // Each half-resolution pixel takes the top-left of its 2x2 block
+            int x = hx * 2, row = hr * 2;
+            int index = row * in.width + x;
+            float depth = in.view_depth[index];
+            half_depth[hr * half_width + hx] = depth;
+            if (!std::isfinite(depth))
+            {
+                ao[hr * half_width + hx] = 1.0f;
+                continue;
+            }
+
+            // Back to view space through the projection; the view direction is -z
+            float ndc_x = (x + 0.5f) / in.width * 2 - 1;
+            float ndc_y = (in.height - row - 0.5f) / in.height * 2 - 1;
+            Eigen::Vector3f origin(depth * (ndc_x + p02) / p00, depth * (ndc_y + p12) / p11, -depth);
+            const Eigen::Vector3f& n = in.normals[index];
+            Eigen::Vector3f t = rotation(x, row);
+            t = (t - n * n.dot(t)).normalized();
+            if (!t.allFinite())
+                t = n.unitOrthogonal();
+            Eigen::Vector3f b = n.cross(t);
+
+            float occlusion = 0.0f;
+            for (int base = 0; base < kernel_size; base += 8)
+            {
+                alignas(32) float sample_depth[8];
+                alignas(32) int taps[8];
+                for (int k = 0; k < 8; ++k)
+                {
+                    const Eigen::Vector3f& o = kernel[base + k];
+                    Eigen::Vector3f s = origin + (t * o.x() + b * o.y() + n * o.z()) * settings.radius;
+                    float w = std::max(-s.z(), 1e-4f);
+                    float sx = ((p00 * s.x() + p02 * s.z()) / w + 1) * 0.5f * in.width;
+                    float sy = ((p11 * s.y() + p12 * s.z()) / w + 1) * 0.5f * in.height;
+                    int tx = std::clamp((int)sx, 0, in.width - 1);
+                    int trow = std::clamp(in.height - 1 - (int)sy, 0, in.height - 1);
+                    taps[k] = trow * in.width + tx;
+                    sample_depth[k] = -s.z();
+                }
+
+                alignas(32) float scene_depth[8];
+#if defined(__AVX2__)
+                __m256i offsets = _mm256_load_si256(reinterpret_cast<const __m256i*>(taps));
+                _mm256_store_ps(scene_depth, _mm256_i32gather_ps(in.view_depth, offsets, 4));
+#else
+                for (int k = 0; k < 8; ++k)
+                    scene_depth[k] = in.view_depth[taps[k]];
+#endif
+                // Occluded when the surface at the tap is in front of the sample, with
+                // a falloff so geometry far in front does not darken the background
+                for (int k = 0; k < 8; ++k)
+                {
+                    float gap = sample_depth[k] - scene_depth[k];
+                    float range = settings.radius / std::max(std::abs(depth - scene_depth[k]), 1e-4f);
+                    occlusion += (gap > settings.bias ? 1.0f : 0.0f) * std::min(range, 1.0f);
+                }
+            }
+            float visible = 1.0f - settings.strength * occlusion / kernel_size;
+            ao[hr * half_width + hx] = std::clamp(visible, 0.0f, 1.0f);
+        }
+    }
+}
+
+// One direction of the bilateral blur: Gaussian in screen space, with taps that
+// lie across a depth discontinuity weighted down
+void rst::ssao_pass::blur(const std::vector<float>& src, std::vector<float>& dst, int dx, int dy, int radius,
+                          int x0, int x1, int r0, int r1)
+{
+    float sigma = std::max(1.0f, radius * 0.5f);
+    for (int r = r0; r < r1; ++r)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            int center = r * half_width + x;
+            float depth = half_depth[center];
+            if (!std::isfinite(depth))
+            {
+                dst[center] = 1.0f;
+                continue;
+            }
+            float sum = 0.0f, weights = 0.0f;
+            for (int k = -radius; k <= radius; ++k)
+            {
+                int sx = x + k * dx, sr = r + k * dy;
+                if (sx < 0 || sx >= half_width || sr < 0 || sr >= half_height)
+                    continue;
+                int i = sr * half_width + sx;
+                float d = half_depth[i];
+                if (!std::isfinite(d))
+                    continue;
+                float w = std::exp(-(k * k) / (2 * sigma * sigma)) * std::exp(-std::abs(d - depth) * 8.0f / depth);
+                sum += src[i] * w;
+                weights += w;
+            }
+            dst[center] = weights > 0 ? sum / weights : src[center];
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef RASTERIZER_SSAO_H
+#define RASTERIZER_SSAO_H
+
+#include <array>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+
+namespace rst
+{
+    struct ssao_settings
+    {
+        float radius = 0.5f;        // view space
+        float bias = 0.025f;
+        float strength = 1.0f;
+        int blur_radius = 3;        // half-resolution pixels
+    };
+
+    // Full-resolution inputs from a depth/normal prepass. Rows are stored top first,
+    // i.e. buffer row r holds screen row height - 1 - r, like the frame buffer.
+    struct ssao_inputs
+    {
+        const float* view_depth;            // distance along -z, infinity where nothing was drawn
+        const Eigen::Vector3f* normals;     // view space, valid wherever view_depth is finite
+        int width, height;
+        Eigen::Matrix4f projection;
+    };
+
+    // Screen-space ambient occlusion, evaluated at half resolution and smoothed by a
+    // separable depth-aware blur. Both passes run over 16x16 tiles on the global
+    // thread pool; the depth taps of each pixel are gathered eight at a time.
+    class ssao_pass
+    {
+    public:
+        ssao_pass();
+
+        // Sizes the buffers for targets up to max_width x max_height.
+        void reserve(int max_width, int max_height);
+        // Bytes reserve() allocates
+        static size_t footprint(int max_width, int max_height);
+        void run(const ssao_inputs& in, const ssao_settings& settings);
+
+        // Ambient visibility in [0, 1] for a full-resolution pixel of the last run.
+        float at(int x, int row) const { return ao[(row >> 1) * half_width + (x >> 1)]; }
+
+    private:
+        void evaluate(const ssao_inputs& in, const ssao_settings& settings, int x0, int x1, int r0, int r1);
+        void blur(const std::vector<float>& src, std::vector<float>& dst, int dx, int dy, int radius,
+                  int x0, int x1, int r0, int r1);
+
+        static constexpr int kernel_size = 16;
+        std::array<Eigen::Vector3f, kernel_size> kernel;
+
+        int half_width = 0, half_height = 0;
+        std::vector<float> ao, scratch;
+        std::vector<float> half_depth;
+    };
+}
+
+#endif //RASTERIZER_SSAO_H
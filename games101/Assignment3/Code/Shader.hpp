@@ -7,6 +7,10 @@
 #include <eigen3/Eigen/Eigen>
 #include "Texture.hpp"
 
+namespace rst
+{
+    class bvh;
+}
 
 struct fragment_shader_payload
 {
@@ -24,6 +28,16 @@ struct fragment_shader_payload
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
     Texture* texture;
+    // Screen-space derivatives (per pixel along +x and +y) from the 2x2 quad the
+    // fragment was shaded in
+    Eigen::Vector2f tex_coords_ddx = Eigen::Vector2f::Zero(), tex_coords_ddy = Eigen::Vector2f::Zero();
+    Eigen::Vector3f view_pos_ddx = Eigen::Vector3f::Zero(), view_pos_ddy = Eigen::Vector3f::Zero();
+    Eigen::Vector3f normal_ddx = Eigen::Vector3f::Zero(), normal_ddy = Eigen::Vector3f::Zero();
+    Eigen::Vector3f color_ddx = Eigen::Vector3f::Zero(), color_ddy = Eigen::Vector3f::Zero();
+    // Scene geometry for shadow and occlusion rays, in view space; may be null
+    const rst::bvh* scene = nullptr;
+    // Screen-space ambient visibility from the SSAO pass, 1 without one
+    float ambient_occlusion = 1.0f;
 };
 
 struct vertex_shader_payload
@@ -0,0 +1,272 @@
+#include "SortFirst.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Poster.hpp"
+#include "StreamMesh.hpp"
+#include "rasterizer.hpp"
+
+// Lives at the start of the shared-memory object, followed by the pixels. The
+// socket round trip of every frame orders the accesses of both sides.
+struct rst::sort_first_renderer::shared_state
+{
+    static constexpr unsigned max_workers = 64;
+
+    struct band_slot
+    {
+        int y0, rows;
+        float ms;
+        bool ok;
+    };
+
+    float model[16], view[16], projection[16];
+    band_slot bands[max_workers];
+};
+
+namespace
+{
+    constexpr std::size_t pixels_offset = 4096;
+
+    // The index-th of count equal, contiguous slices of the CPUs this process may use
+    void pin_to_slice(unsigned index, unsigned count)
+    {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return;
+        std::vector<int> cpus;
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &allowed))
+                cpus.push_back(c);
+        // Fewer CPUs than workers: better left to the scheduler
+        if (cpus.size() < count)
+            return;
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        for (std::size_t i = cpus.size() * index / count; i < cpus.size() * (index + 1) / count; ++i)
+            CPU_SET(cpus[i], &mine);
+        sched_setaffinity(0, sizeof(mine), &mine);
+    }
+}
+
+rst::sort_first_renderer::sort_first_renderer(config c) : cfg(std::move(c))
+{
+}
+
+rst::sort_first_renderer::~sort_first_renderer()
+{
+    stop();
+}
+
+bool rst::sort_first_renderer::start()
+{
+    static_assert(sizeof(shared_state) <= pixels_offset, "the shared header must fit in front of the pixels");
+    if (!pids.empty())
+        return true;
+    if (cfg.workers == 0 || cfg.workers > shared_state::max_workers || cfg.width <= 0 ||
+        cfg.height < (int)cfg.workers)
+        return false;
+
+    name = cfg.shm_name.empty() ? "/rst-sort-first-" + std::to_string(getpid()) : cfg.shm_name;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return false;
+    shared_bytes = pixels_offset + (std::size_t)cfg.width * cfg.height * 3;
+    bool ok = ftruncate(fd, shared_bytes) == 0;
+    void* p = ok ? mmap(nullptr, shared_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    shared = new (p) shared_state{};
+
+    // Even split to begin with; the first frame's timings refine it
+    for (unsigned i = 0; i < cfg.workers; ++i)
+    {
+        auto& b = shared->bands[i];
+        b.y0 = (int)((long)cfg.height * i / cfg.workers);
+        b.rows = (int)((long)cfg.height * (i + 1) / cfg.workers) - b.y0;
+    }
+
+    for (unsigned i = 0; i < cfg.workers; ++i)
+    {
+        int ends[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) != 0)
+        {
+            stop();
+            return false;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // Only this worker's end stays open, so a worker sees the coordinator go
+            for (int other : channels)
+                ::close(other);
+            ::close(ends[0]);
+            worker_main(i, ends[1]);
+        }
+        ::close(ends[1]);
+        if (pid < 0)
+        {
+            ::close(ends[0]);
+            stop();
+            return false;
+        }
+        pids.push_back(pid);
+        channels.push_back(ends[0]);
+    }
+    return true;
+}
+
+void rst::sort_first_renderer::stop()
+{
+    // A closed channel is the workers' signal to exit
+    for (int channel : channels)
+        ::close(channel);
+    for (pid_t pid : pids)
+        waitpid(pid, nullptr, 0);
+    channels.clear();
+    pids.clear();
+    if (shared)
+    {
+        munmap(shared, shared_bytes);
+        shm_unlink(name.c_str());
+        shared = nullptr;
+    }
+}
+
+const unsigned char* rst::sort_first_renderer::image() const
+{
+    return shared ? reinterpret_cast<const unsigned char*>(shared) + pixels_offset : nullptr;
+}
+
+bool rst::sort_first_renderer::render(const Eigen::Matrix4f& model, const Eigen::Matrix4f& view,
+                                      const Eigen::Matrix4f& projection)
+{
+    if (pids.empty())
+        return false;
+    std::copy_n(model.data(), 16, shared->model);
+    std::copy_n(view.data(), 16, shared->view);
+    std::copy_n(projection.data(), 16, shared->projection);
+
+    // One byte out starts a frame, one byte back ends it. A worker that cannot
+    // be reached leaves the others out of step, so the whole set is shut down.
+    const char frame = 'f';
+    bool ok = true;
+    for (int channel : channels)
+        ok &= send(channel, &frame, 1, MSG_NOSIGNAL) == 1;
+    for (int channel : channels)
+    {
+        char reply;
+        ok &= recv(channel, &reply, 1, 0) == 1;
+    }
+    if (!ok)
+    {
+        stop();
+        return false;
+    }
+
+    last_bands.resize(cfg.workers);
+    for (unsigned i = 0; i < cfg.workers; ++i)
+    {
+        const auto& slot = shared->bands[i];
+        last_bands[i] = {slot.y0, slot.rows, slot.ms};
+        ok &= slot.ok;
+    }
+    rebalance();
+    return ok;
+}
+
+// Takes each band's time as spread evenly over its rows and puts boundary k where
+// the rows above it cost k / n of the frame. Boundaries move half way there, in
+// steps of 8 rows, so timing noise does not keep the bands (and the workers'
+// targets, which are sized to them) changing.
+void rst::sort_first_renderer::rebalance()
+{
+    unsigned n = cfg.workers;
+    if (n < 2)
+        return;
+    float cost[shared_state::max_workers];
+    double total = 0;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        cost[i] = std::max(shared->bands[i].ms, 1e-3f);
+        total += cost[i];
+    }
+
+    int bounds[shared_state::max_workers + 1];
+    bounds[0] = 0;
+    bounds[n] = cfg.height;
+    unsigned j = 0;
+    double above = 0;
+    for (unsigned k = 1; k < n; ++k)
+    {
+        double wanted = total * k / n;
+        while (j + 1 < n && above + cost[j] < wanted)
+            above += cost[j++];
+        const auto& b = shared->bands[j];
+        double y = b.y0 + b.rows * std::clamp((wanted - above) / cost[j], 0.0, 1.0);
+        int current = shared->bands[k].y0;
+        bounds[k] = current + 8 * (int)std::lround((y - current) / 16);
+    }
+
+    int min_rows = std::max(1, std::min(8, cfg.height / (int)n));
+    for (unsigned k = 1; k < n; ++k)
+        bounds[k] = std::clamp(bounds[k], bounds[k - 1] + min_rows, cfg.height - (int)(n - k) * min_rows);
+    for (unsigned k = 0; k < n; ++k)
+    {
+        shared->bands[k].y0 = bounds[k];
+        shared->bands[k].rows = bounds[k + 1] - bounds[k];
+    }
+}
+
+void rst::sort_first_renderer::worker_main(unsigned index, int channel)
+{
+    if (cfg.pin_workers)
+        pin_to_slice(index, cfg.workers);
+
+    // Opened here, not inherited: the mapping is shared through the page cache, and
+    // the prefetch thread has to be this process's own
+    stream_mesh geometry;
+    bool ok = geometry.open(cfg.mesh_path);
+    unsigned char* pixels = reinterpret_cast<unsigned char*>(shared) + pixels_offset;
+    std::unique_ptr<rasterizer> target;
+
+    char command;
+    while (recv(channel, &command, 1, 0) == 1)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto& slot = shared->bands[index];
+        if (ok)
+        {
+            if (!target || target->render_height() != slot.rows)
+            {
+                target = std::make_unique<rasterizer>(cfg.width, slot.rows);
+                if (cfg.configure)
+                    cfg.configure(*target);
+            }
+            target->set_model(Eigen::Map<const Eigen::Matrix4f>(shared->model));
+            target->set_view(Eigen::Map<const Eigen::Matrix4f>(shared->view));
+            target->set_projection(region_projection(Eigen::Map<const Eigen::Matrix4f>(shared->projection),
+                                                     cfg.width, cfg.height, 0, slot.y0, cfg.width, slot.rows));
+            target->clear(Buffers::Color | Buffers::Depth);
+            target->draw(geometry);
+            target->resolve(pixels + (std::size_t)slot.y0 * cfg.width * 3);
+        }
+        slot.ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        slot.ok = ok;
+        if (send(channel, &command, 1, MSG_NOSIGNAL) != 1)
+            break;
+    }
+    // Nothing of the coordinator's may run here: no destructors, no atexit handlers
+    _exit(0);
+}
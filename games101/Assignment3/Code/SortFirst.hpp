@@ -0,0 +1,85 @@
+#ifndef RASTERIZER_SORT_FIRST_H
+#define RASTERIZER_SORT_FIRST_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <eigen3/Eigen/Eigen>
+
+namespace rst
+{
+    class rasterizer;
+
+    // Sort-first rendering across processes. The image is cut into horizontal bands,
+    // one per worker process; each worker renders its band with its own rasterizer
+    // through the band's part of the view frustum and resolves it straight into a
+    // POSIX shared-memory framebuffer. Geometry comes from a preprocessed stream
+    // mesh that every worker maps, so the page cache holds one copy of it however
+    // many workers read it.
+    //
+    // After every frame the coordinator moves the band boundaries so the measured
+    // time is shared out evenly for the next one.
+    class sort_first_renderer
+    {
+    public:
+        struct config
+        {
+            int width = 700, height = 700;
+            unsigned workers = 2;
+            std::string mesh_path;      // as written by write_stream_mesh
+            // Name of the framebuffer object, e.g. "/frame"; empty derives one from
+            // the process id. Other processes may map it while the renderer runs.
+            std::string shm_name;
+            // Gives every worker an equal, contiguous slice of the CPUs this process
+            // may use, e.g. one NUMA node each when the counts line up
+            bool pin_workers = false;
+            // Shaders, texture and the like, applied to each worker's rasterizer
+            std::function<void(rasterizer&)> configure;
+        };
+
+        // Where a band was and how long it took, per worker
+        struct band
+        {
+            int y0, rows;
+            float ms;
+        };
+
+        explicit sort_first_renderer(config cfg);
+        ~sort_first_renderer();
+
+        sort_first_renderer(const sort_first_renderer&) = delete;
+        sort_first_renderer& operator=(const sort_first_renderer&) = delete;
+
+        // Creates the framebuffer and forks the workers. Call it before this process
+        // first uses the global thread pool: threads do not survive fork(), and each
+        // worker starts a pool of its own, sized to its CPUs.
+        bool start();
+        void stop();
+
+        // Renders one frame; false when a worker failed or has gone away.
+        bool render(const Eigen::Matrix4f& model, const Eigen::Matrix4f& view, const Eigen::Matrix4f& projection);
+
+        // Packed 8-bit BGR rows, top row first, as resolve() writes them
+        const unsigned char* image() const;
+        // The bands of the last frame
+        const std::vector<band>& bands() const { return last_bands; }
+
+    private:
+        struct shared_state;
+
+        [[noreturn]] void worker_main(unsigned index, int channel);
+        void rebalance();
+
+        config cfg;
+        std::string name;
+        shared_state* shared = nullptr;
+        std::size_t shared_bytes = 0;
+        std::vector<pid_t> pids;
+        std::vector<int> channels;
+        std::vector<band> last_bands;
+    };
+}
+
+#endif //RASTERIZER_SORT_FIRST_H
@@ -0,0 +1,273 @@
+#include "StreamMesh.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char stream_magic[4] = {'R', 'S', 'T', 'M'};
+static const std::uint32_t stream_version = 1;
+static const std::uint64_t page_size = 4096;
+
+static std::uint64_t align_up(std::uint64_t v, std::uint64_t a)
+{
+    return (v + a - 1) / a * a;
+}
+
+// Byte size of one attribute array inside a chunk
+static std::uint64_t array_bytes(std::uint32_t vertex_count)
+{
+    return align_up(sizeof(float) * vertex_count, 32);
+}
+
+// Bytes a chunk's arrays and indices take up
+static std::uint64_t chunk_bytes(std::uint32_t vertex_count, std::uint32_t triangle_count)
+{
+    return 8 * array_bytes(vertex_count) + 3 * sizeof(std::uint32_t) * (std::uint64_t)triangle_count;
+}
+
+rst::stream_mesh_writer::~stream_mesh_writer()
+{
+    if (file)
+        std::fclose(file);
+}
+
+bool rst::stream_mesh_writer::write_at(std::uint64_t offset, const void* data, std::size_t bytes)
+{
+    return std::fseek(file, (long)offset, SEEK_SET) == 0 && std::fwrite(data, 1, bytes, file) == bytes;
+}
+
+bool rst::stream_mesh_writer::open(const std::string& path)
+{
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    end = page_size;
+    triangles = vertices = 0;
+    table.clear();
+    stream_mesh_header header{};
+    return write_at(0, &header, sizeof(header));
+}
+
+bool rst::stream_mesh_writer::add_chunk(const mesh& m, std::size_t first_triangle, std::size_t triangle_count)
+{
+    // Gather the vertices this range references, in first-use order
+    if (remap.size() < m.vertices.count)
+        remap.assign(m.vertices.count, -1);
+    used.clear();
+    std::vector<std::uint32_t> local(triangle_count * 3);
+    for (std::size_t i = 0; i < triangle_count * 3; ++i)
+    {
+        std::uint32_t g = m.indices ? m.indices[first_triangle * 3 + i] : (std::uint32_t)(first_triangle * 3 + i);
+        if (remap[g] < 0)
+        {
+            remap[g] = (std::int64_t)used.size();
+            used.push_back(g);
+        }
+        local[i] = (std::uint32_t)remap[g];
+    }
+    for (auto g : used)
+        remap[g] = -1;
+
+    stream_chunk_info info{};
+    info.offset = end;
+    info.vertex_count = (std::uint32_t)used.size();
+    info.triangle_count = (std::uint32_t)triangle_count;
+
+    std::vector<float> column(array_bytes(info.vertex_count) / sizeof(float), 0.0f);
+    std::uint64_t offset = info.offset;
+    for (const float* src : {m.vertices.px, m.vertices.py, m.vertices.pz, m.vertices.nx, m.vertices.ny, m.vertices.nz, m.vertices.u, m.vertices.v})
+    {
+        for (std::size_t i = 0; i < used.size(); ++i)
+            column[i] = src[used[i]];
+        if (!write_at(offset, column.data(), column.size() * sizeof(float)))
+            return false;
+        offset += column.size() * sizeof(float);
+    }
+    if (!write_at(offset, local.data(), local.size() * sizeof(std::uint32_t)))
+        return false;
+    offset += local.size() * sizeof(std::uint32_t);
+
+    info.bytes = offset - info.offset;
+    end = align_up(offset, page_size);
+    triangles += triangle_count;
+    vertices += info.vertex_count;
+    table.push_back(info);
+    return true;
+}
+
+bool rst::stream_mesh_writer::finish()
+{
+    stream_mesh_header header{};
+    std::memcpy(header.magic, stream_magic, sizeof(stream_magic));
+    header.version = stream_version;
+    header.chunk_count = (std::uint32_t)table.size();
+    header.triangle_count = triangles;
+    header.vertex_count = vertices;
+    header.table_offset = end;
+
+    bool ok = write_at(end, table.data(), table.size() * sizeof(stream_chunk_info)) &&
+              write_at(0, &header, sizeof(header));
+    ok = std::fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+}
+
+bool rst::write_stream_mesh(const std::string& path, const mesh& m, std::size_t chunk_triangles)
+{
+    stream_mesh_writer writer;
+    if (!writer.open(path))
+        return false;
+    for (std::size_t first = 0; first < m.triangle_count; first += chunk_triangles)
+    {
+        if (!writer.add_chunk(m, first, std::min(chunk_triangles, m.triangle_count - first)))
+            return false;
+    }
+    return writer.finish();
+}
+
+rst::stream_mesh::~stream_mesh()
+{
+    close();
+}
+
+bool rst::stream_mesh::open(const std::string& path)
+{
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(stream_mesh_header))
+    {
+        close();
+        return false;
+    }
+    size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    base = static_cast<char*>(mapping);
+    // Chunks are consumed front to back, exactly once per draw
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    // Every bound is checked as a difference from size so a corrupt offset cannot wrap
+    std::memcpy(&header, base, sizeof(header));
+    bool ok = std::memcmp(header.magic, stream_magic, sizeof(stream_magic)) == 0 && header.version == stream_version &&
+              header.table_offset <= size &&
+              (std::uint64_t)header.chunk_count * sizeof(stream_chunk_info) <= size - header.table_offset;
+    if (ok)
+    {
+        table.resize(header.chunk_count);
+        std::memcpy(table.data(), base + header.table_offset, table.size() * sizeof(stream_chunk_info));
+    }
+    for (std::size_t i = 0; ok && i < table.size(); ++i)
+    {
+        const stream_chunk_info& info = table[i];
+        ok = info.offset % page_size == 0 && info.offset <= size && info.bytes <= size - info.offset &&
+             info.bytes >= chunk_bytes(info.vertex_count, info.triangle_count);
+    }
+    if (!ok)
+    {
+        close();
+        return false;
+    }
+
+    pending.reserve(table.size());
+    stopping = false;
+    prefetcher = std::thread([this] { prefetch_loop(); });
+    return true;
+}
+
+void rst::stream_mesh::close()
+{
+    if (prefetcher.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        prefetcher.join();
+    }
+    pending.clear();
+    if (base)
+        munmap(base, size);
+    if (fd >= 0)
+        ::close(fd);
+    base = nullptr;
+    fd = -1;
+    size = 0;
+    table.clear();
+}
+
+bool rst::stream_mesh::chunk(std::size_t i, mesh& m) const
+{
+    const stream_chunk_info& info = table[i];
+    // The arrays are laid out exactly as vertex_arrays expects, so no copy is made
+    float* p = reinterpret_cast<float*>(base + info.offset);
+    std::size_t stride = array_bytes(info.vertex_count) / sizeof(float);
+
+    m = mesh{};
+    m.vertices.count = info.vertex_count;
+    for (float** dst : {&m.vertices.px, &m.vertices.py, &m.vertices.pz, &m.vertices.nx, &m.vertices.ny, &m.vertices.nz, &m.vertices.u, &m.vertices.v})
+    {
+        *dst = p;
+        p += stride;
+    }
+    m.indices = reinterpret_cast<std::uint32_t*>(p);
+    m.triangle_count = info.triangle_count;
+
+    // Checked here rather than in open(), which would have to read the whole file
+    std::uint32_t highest = 0;
+    for (std::size_t k = 0; k < m.triangle_count * 3; ++k)
+        highest = std::max(highest, m.indices[k]);
+    return m.triangle_count == 0 || highest < info.vertex_count;
+}
+
+void rst::stream_mesh::prefetch(std::size_t i)
+{
+    const stream_chunk_info& info = table[i];
+    madvise(base + info.offset, info.bytes, MADV_WILLNEED);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(i);
+    }
+    wake.notify_one();
+}
+
+void rst::stream_mesh::release(std::size_t i)
+{
+    // Clean file-backed pages: dropping them costs nothing but a re-read next draw
+    const stream_chunk_info& info = table[i];
+    madvise(base + info.offset, info.bytes, MADV_DONTNEED);
+}
+
+void rst::stream_mesh::prefetch_loop()
+{
+    for (;;)
+    {
+        std::size_t i;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || !pending.empty(); });
+            if (stopping)
+                return;
+            i = pending.front();
+            pending.erase(pending.begin());
+        }
+
+        // WILLNEED only queues readahead; touching each page makes sure the chunk is
+        // resident before the raster stage gets to it
+        const stream_chunk_info& info = table[i];
+        volatile char sink = 0;
+        for (std::uint64_t off = 0; off < info.bytes; off += page_size)
+            sink = sink + base[info.offset + off];
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef RASTERIZER_STREAM_MESH_H
+#define RASTERIZER_STREAM_MESH_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "VertexStage.hpp"
+
+namespace rst
+{
+    // On-disk layout of a preprocessed streaming mesh (native endianness):
+    //
+    //   stream_mesh_header
+    //   chunk 0, chunk 1, ...        each page aligned and self-contained:
+    //                                px py pz nx ny nz u v (32-byte aligned float
+    //                                arrays) followed by chunk-local uint32 indices
+    //   stream_chunk_info[chunk_count] at header.table_offset
+    //
+    // The table goes last so chunks can be appended as a converter produces them.
+    struct stream_mesh_header
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t chunk_count;
+        std::uint32_t reserved;
+        std::uint64_t triangle_count;
+        std::uint64_t vertex_count;
+        std::uint64_t table_offset;
+    };
+
+    struct stream_chunk_info
+    {
+        std::uint64_t offset;
+        std::uint64_t bytes;
+        std::uint32_t vertex_count;
+        std::uint32_t triangle_count;
+    };
+
+    class stream_mesh_writer
+    {
+    public:
+        ~stream_mesh_writer();
+
+        bool open(const std::string& path);
+        // Appends m as one chunk; indices are rebased so the chunk only carries the
+        // vertices its triangles reference.
+        bool add_chunk(const mesh& m, std::size_t first_triangle, std::size_t triangle_count);
+        bool finish();
+
+    private:
+        bool write_at(std::uint64_t offset, const void* data, std::size_t bytes);
+
+        std::FILE* file = nullptr;
+        std::uint64_t end = 0;
+        std::uint64_t triangles = 0, vertices = 0;
+        std::vector<stream_chunk_info> table;
+        std::vector<std::int64_t> remap;
+        std::vector<std::uint32_t> used;
+    };
+
+    // Converts an in-memory mesh in one go, chunk_triangles triangles per chunk.
+    bool write_stream_mesh(const std::string& path, const mesh& m, std::size_t chunk_triangles = 1 << 16);
+
+    // Read side. The file is memory-mapped, so only the chunks being worked on are
+    // resident: prefetch() pulls the next chunk in on a background thread while the
+    // current one is rasterized, and release() hands a finished chunk's pages back.
+    class stream_mesh
+    {
+    public:
+        stream_mesh() = default;
+        ~stream_mesh();
+
+        stream_mesh(const stream_mesh&) = delete;
+        stream_mesh& operator=(const stream_mesh&) = delete;
+
+        // Fails on a file whose table or chunks do not fit in it.
+        bool open(const std::string& path);
+        void close();
+
+        std::size_t chunk_count() const { return table.size(); }
+        std::uint64_t triangle_count() const { return header.triangle_count; }
+
+        // The arrays point into the read-only mapping and must not be written.
+        // False if the chunk's indices reach past its vertices.
+        bool chunk(std::size_t i, mesh& m) const;
+        const stream_chunk_info& chunk_info(std::size_t i) const { return table[i]; }
+
+        void prefetch(std::size_t i);
+        void release(std::size_t i);
+
+    private:
+        void prefetch_loop();
+
+        int fd = -1;
+        char* base = nullptr;
+        std::size_t size = 0;
+        stream_mesh_header header{};
+        std::vector<stream_chunk_info> table;
+
+        std::thread prefetcher;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<std::size_t> pending;
+        bool stopping = false;
+    };
+}
+
+#endif //RASTERIZER_STREAM_MESH_H
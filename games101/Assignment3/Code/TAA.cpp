@@ -0,0 +1,96 @@
+#include "TAA.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include "Jitter.hpp"
+#include "ThreadPool.hpp"
+
+void rst::taa_pass::reserve(int max_width, int max_height)
+{
+    size_t count = (size_t)max_width * max_height;
+    history.resize(count);
+    next_history.resize(count);
+    motion_buf.resize(count);
+}
+
+size_t rst::taa_pass::footprint(int max_width, int max_height)
+{
+    return (size_t)max_width * max_height * (2 * sizeof(Eigen::Vector3f) + sizeof(Eigen::Vector2f));
+}
+
+Eigen::Vector2f rst::taa_pass::jitter(const taa_settings& settings) const
+{
+    int index = frame % std::max(1, settings.jitter_period) + 1;
+    return {halton(index, 2), halton(index, 3)};
+}
+
+void rst::taa_pass::run(const taa_inputs& in, const taa_settings& settings)
+{
+    ++frame;
+    int w = in.width, h = in.height;
+    Eigen::Vector3f* color = in.color;
+    if (!history_valid || history_width != w || history_height != h)
+    {
+        std::copy_n(color, (size_t)w * h, history.begin());
+        history_width = w;
+        history_height = h;
+        history_valid = true;
+        return;
+    }
+
+    // Bilinear, at a position in pixels with centres at +0.5; false off the image
+    auto fetch = [&](float x, float row, Eigen::Vector3f& out)
+    {
+        x -= 0.5f;
+        row -= 0.5f;
+        if (!(x > -0.5f && x < w - 0.5f && row > -0.5f && row < h - 0.5f))
+            return false;
+        x = std::clamp(x, 0.0f, w - 1.0f);
+        row = std::clamp(row, 0.0f, h - 1.0f);
+        int x0 = (int)x, r0 = (int)row;
+        int x1 = std::min(x0 + 1, w - 1), r1 = std::min(r0 + 1, h - 1);
+        float fx = x - x0, fr = row - r0;
+        const Eigen::Vector3f* top = &history[(size_t)r0 * w];
+        const Eigen::Vector3f* bottom = &history[(size_t)r1 * w];
+        out = (top[x0] * (1 - fx) + top[x1] * fx) * (1 - fr) + (bottom[x0] * (1 - fx) + bottom[x1] * fx) * fr;
+        return true;
+    };
+
+    float feedback = std::clamp(settings.feedback, 0.0f, 1.0f);
+    thread_pool::global().parallel_for(h, 16, [&](size_t begin, size_t end)
+    {
+        for (int row = (int)begin; row < (int)end; ++row)
+        {
+            const Eigen::Vector3f* above = color + (size_t)std::max(row - 1, 0) * w;
+            const Eigen::Vector3f* middle = color + (size_t)row * w;
+            const Eigen::Vector3f* below = color + (size_t)std::min(row + 1, h - 1) * w;
+            // Bounds of the 3x3 neighbourhood, slid along the row one column at a time
+            auto column_low = [&](int x) { return above[x].cwiseMin(middle[x]).cwiseMin(below[x]); };
+            auto column_high = [&](int x) { return above[x].cwiseMax(middle[x]).cwiseMax(below[x]); };
+            Eigen::Vector3f low_left = column_low(0), low_centre = low_left;
+            Eigen::Vector3f high_left = column_high(0), high_centre = high_left;
+            for (int x = 0; x < w; ++x)
+            {
+                int right = std::min(x + 1, w - 1);
+                Eigen::Vector3f low_right = column_low(right), high_right = column_high(right);
+                Eigen::Vector3f low = low_left.cwiseMin(low_centre).cwiseMin(low_right);
+                Eigen::Vector3f high = high_left.cwiseMax(high_centre).cwiseMax(high_right);
+                low_left = low_centre;
+                low_centre = low_right;
+                high_left = high_centre;
+                high_centre = high_right;
+
+                size_t i = (size_t)row * w + x;
+                const Eigen::Vector3f& current = middle[x];
+                Eigen::Vector3f previous;
+                const Eigen::Vector2f& m = in.motion[i];
+                if (fetch(x + 0.5f + m.x(), row + 0.5f + m.y(), previous))
+                    next_history[i] = current + feedback * (previous.cwiseMax(low).cwiseMin(high) - current);
+                else
+                    next_history[i] = current;
+            }
+        }
+    });
+    history.swap(next_history);
+    std::copy_n(history.begin(), (size_t)w * h, color);
+}
@@ -0,0 +1,62 @@
+#ifndef RASTERIZER_TAA_H
+#define RASTERIZER_TAA_H
+
+#include <cstddef>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+
+namespace rst
+{
+    struct taa_settings
+    {
+        float feedback = 0.9f;      // share of the reprojected history in each output pixel
+        int jitter_period = 8;      // sub-pixel offsets cycled through
+    };
+
+    // One frame's inputs. Rows are stored top first, like the frame buffer.
+    struct taa_inputs
+    {
+        Eigen::Vector3f* color;             // the new frame; replaced by the anti-aliased one
+        const Eigen::Vector2f* motion;      // per pixel, where its surface was a frame ago
+                                            // relative to it, in pixels: x right, rows down
+        int width, height;
+    };
+
+    // Temporal anti-aliasing. Every frame is rendered with the projection shifted
+    // by a different sub-pixel jitter() and blended into a history of the frames
+    // before it, each pixel fetching its history from where motion says its surface
+    // was. The history is clamped to the colours around the pixel in the new frame
+    // first, so what reprojection gets wrong (disocclusions, shading changes) fades
+    // in a frame or two instead of ghosting. Runs over rows on the global thread
+    // pool.
+    class taa_pass
+    {
+    public:
+        // Sizes the buffers for targets up to max_width x max_height.
+        void reserve(int max_width, int max_height);
+        // Bytes reserve() allocates
+        static size_t footprint(int max_width, int max_height);
+        bool reserved() const { return !motion_buf.empty(); }
+
+        // Offset, in pixels within [-0.5, 0.5), to render the next frame with
+        Eigen::Vector2f jitter(const taa_settings& settings) const;
+        // Motion vectors the caller fills in before run(), width * height of them
+        Eigen::Vector2f* motion() { return motion_buf.data(); }
+
+        // Blends in.color with the history and moves on to the next jitter. The
+        // first frame after reset(), or after the size changes, starts the history.
+        void run(const taa_inputs& in, const taa_settings& settings);
+        // Forgets the history, for camera cuts and anything else that makes the
+        // previous frame useless
+        void reset() { history_valid = false; }
+
+    private:
+        std::vector<Eigen::Vector3f> history, next_history;
+        std::vector<Eigen::Vector2f> motion_buf;
+        int history_width = 0, history_height = 0;
+        bool history_valid = false;
+        int frame = 0;
+    };
+}
+
+#endif //RASTERIZER_TAA_H
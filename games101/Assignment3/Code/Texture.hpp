@@ -7,28 +7,140 @@
 #include "global.hpp"
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "MemoryAccount.hpp"
+#include "VirtualTexture.hpp"
 class Texture{
 private:
     cv::Mat image_data;
+    // Box-filtered mip chain down to 1x1; levels[0] shares the image
+    std::vector<cv::Mat> levels;
+    // Shared by copies, which share the pixels too
+    std::shared_ptr<rst::memory_account> account;
+    // Set for a virtual texture, which takes the place of the image and mips
+    std::shared_ptr<rst::virtual_texture> pages;
+
+    static std::size_t chain_bytes(int w, int h)
+    {
+        std::size_t bytes = (std::size_t)w * h * 3;
+        while (w > 1 || h > 1)
+        {
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+            bytes += (std::size_t)w * h * 3;
+        }
+        return bytes;
+    }
+
+    void build_mips()
+    {
+        levels.assign(1, image_data);
+        while (levels.back().cols > 1 || levels.back().rows > 1)
+            levels.push_back(half_size(levels.back()));
+    }
+
+    Eigen::Vector3f bilinear(int level, float u, float v) const
+    {
+        const cv::Mat& img = levels[level];
+        float x = std::clamp(u, 0.0f, 1.0f) * img.cols - 0.5f;
+        float y = (1 - std::clamp(v, 0.0f, 1.0f)) * img.rows - 0.5f;
+        int x0 = std::clamp((int)std::floor(x), 0, img.cols - 1), x1 = std::min(x0 + 1, img.cols - 1);
+        int y0 = std::clamp((int)std::floor(y), 0, img.rows - 1), y1 = std::min(y0 + 1, img.rows - 1);
+        float fx = std::clamp(x - x0, 0.0f, 1.0f), fy = std::clamp(y - y0, 0.0f, 1.0f);
+        auto texel = [&](int r, int c)
+        {
+            const cv::Vec3b& p = img.at<cv::Vec3b>(r, c);
+            return Eigen::Vector3f(p[0], p[1], p[2]);
+        };
+        return (texel(y0, x0) * (1 - fx) + texel(y0, x1) * fx) * (1 - fy) +
+               (texel(y1, x0) * (1 - fx) + texel(y1, x1) * fx) * fy;
+    }
 
 public:
     Texture(const std::string& name)
     {
         image_data = cv::imread(name);
         cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+        account = std::make_shared<rst::memory_account>("texture " + name);
+        // Over budget it is left empty, like a file that failed to load
+        if (!account->charge(rst::memory_kind::textures, chain_bytes(image_data.cols, image_data.rows)))
+            image_data = cv::Mat();
         width = image_data.cols;
         height = image_data.rows;
+        build_mips();
+    }
+
+    // Pages come from the virtual texture as samples need them
+    explicit Texture(std::shared_ptr<rst::virtual_texture> virtual_pages) : pages(std::move(virtual_pages))
+    {
+        width = pages->width();
+        height = pages->height();
     }
 
     int width, height;
 
+    // The next mip level: a 2x2 box filter, halving each side down to 1
+    static cv::Mat half_size(const cv::Mat& src)
+    {
+        int w = std::max(1, src.cols / 2), h = std::max(1, src.rows / 2);
+        cv::Mat dst(h, w, CV_8UC3);
+        for (int y = 0; y < h; ++y)
+        {
+            int y0 = std::min(2 * y, src.rows - 1), y1 = std::min(2 * y + 1, src.rows - 1);
+            for (int x = 0; x < w; ++x)
+            {
+                int x0 = std::min(2 * x, src.cols - 1), x1 = std::min(2 * x + 1, src.cols - 1);
+                const cv::Vec3b& a = src.at<cv::Vec3b>(y0, x0);
+                const cv::Vec3b& b = src.at<cv::Vec3b>(y0, x1);
+                const cv::Vec3b& c = src.at<cv::Vec3b>(y1, x0);
+                const cv::Vec3b& d = src.at<cv::Vec3b>(y1, x1);
+                cv::Vec3b& out = dst.at<cv::Vec3b>(y, x);
+                for (int k = 0; k < 3; ++k)
+                    out[k] = (unsigned char)((a[k] + b[k] + c[k] + d[k] + 2) / 4);
+            }
+        }
+        return dst;
+    }
+
     Eigen::Vector3f getColor(float u, float v)
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
+        if (pages)
+            return pages->sample(u, v);
+        u = std::clamp(u, 0.0f, 1.0f);
+        v = std::clamp(v, 0.0f, 1.0f);
+        auto u_img = std::min(u * width, width - 1.0f);
+        auto v_img = std::min((1 - v) * height, height - 1.0f);
         auto color = image_data.at<cv::Vec3b>(v_img, u_img);
         return Eigen::Vector3f(color[0], color[1], color[2]);
     }
 
+    // Filtered lookup for a pixel whose footprint in uv space spans duv_dx by
+    // duv_dy. Magnified lookups stay nearest-texel like getColor(u, v); minified
+    // ones blend bilinear samples of the two closest mip levels, which also keeps
+    // far-away surfaces reading from small, cache-resident levels.
+    Eigen::Vector3f getColor(float u, float v, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy)
+    {
+        Eigen::Vector2f size((float)width, (float)height);
+        float footprint = std::max(duv_dx.cwiseProduct(size).norm(), duv_dy.cwiseProduct(size).norm());
+        if (!(footprint > 1.0f))
+            return getColor(u, v);
+
+        float lod = std::min(std::log2(footprint), (float)(mip_levels() - 1));
+        if (pages)
+            return pages->sample(u, v, lod);
+        int level = (int)lod;
+        float blend = lod - level;
+        Eigen::Vector3f color = bilinear(level, u, v);
+        if (blend > 0.0f && level + 1 < (int)levels.size())
+            color = color * (1 - blend) + bilinear(level + 1, u, v) * blend;
+        return color;
+    }
+
+    int mip_levels() const { return pages ? pages->level_count() : (int)levels.size(); }
+    const rst::memory_account& memory_usage() const { return pages ? pages->memory_usage() : *account; }
+
 };
 #endif //RASTERIZER_TEXTURE_H
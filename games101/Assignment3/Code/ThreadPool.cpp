@@ -0,0 +1,444 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Deques are small fixed rings: splitting is logarithmic in a loop's chunk count,
+// and a piece that does not fit is run where it is instead of pushed
+struct alignas(64) rst::thread_pool::work_queue
+{
+    static constexpr std::size_t capacity = 256;
+
+    std::mutex mutex;
+    work_item items[capacity];
+    std::size_t head = 0, count = 0;
+
+    std::atomic<std::uint64_t> busy_ns{0};
+    std::atomic<std::uint64_t> chunks{0};
+    std::atomic<std::uint64_t> tasks{0};
+    std::atomic<std::uint64_t> steals{0};
+
+    work_item& at(std::size_t i) { return items[(head + i) % capacity]; }
+
+    // Removes item i, keeping the order of the rest
+    work_item remove(std::size_t i)
+    {
+        work_item item = at(i);
+        for (; i + 1 < count; ++i)
+            at(i) = at(i + 1);
+        --count;
+        return item;
+    }
+};
+
+namespace
+{
+    struct worker_identity
+    {
+        const rst::thread_pool* pool = nullptr;
+        unsigned index = 0;
+    };
+
+    thread_local worker_identity current_worker;
+    // Pieces run inside a piece, by a thread waiting on a nested loop, are timed
+    // as part of the outer one
+    thread_local int execute_depth = 0;
+
+    unsigned next_random()
+    {
+        thread_local unsigned state = (unsigned)(std::hash<std::thread::id>()(std::this_thread::get_id()) | 1);
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+#if defined(__linux__)
+    // CPUs of each NUMA node, as the kernel lists them; one node when it does not
+    std::vector<std::vector<int>> numa_nodes()
+    {
+        std::vector<std::vector<int>> nodes;
+        for (int n = 0;; ++n)
+        {
+            std::ifstream list("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+            std::string ranges;
+            if (!(list >> ranges))
+                break;
+            std::vector<int> cpus;
+            size_t pos = 0;
+            while (pos < ranges.size())
+            {
+                size_t comma = ranges.find(',', pos);
+                std::string range = ranges.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+                int first = 0, last = 0;
+                size_t dash = range.find('-');
+                first = std::stoi(range.substr(0, dash));
+                last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int c = first; c <= last; ++c)
+                    cpus.push_back(c);
+                pos = comma == std::string::npos ? ranges.size() : comma + 1;
+            }
+            nodes.push_back(cpus);
+        }
+        if (nodes.empty())
+        {
+            nodes.emplace_back();
+            for (int c = 0; c < CPU_SETSIZE; ++c)
+                nodes.back().push_back(c);
+        }
+        return nodes;
+    }
+#endif
+}
+
+unsigned rst::thread_pool::default_workers()
+{
+    unsigned n = std::thread::hardware_concurrency();
+#if defined(__linux__)
+    // Only the CPUs this process may run on, so pinned processes do not oversubscribe
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        n = (unsigned)CPU_COUNT(&allowed);
+#endif
+    return n > 1 ? n - 1 : 0;
+}
+
+rst::thread_pool& rst::thread_pool::global()
+{
+    static thread_pool pool;
+    return pool;
+}
+
+rst::thread_pool::thread_pool(unsigned count)
+    : queues(new work_queue[count + 1]), queue_count(count + 1), stats_since(std::chrono::steady_clock::now())
+{
+    workers.reserve(count);
+    for (unsigned i = 0; i < count; ++i)
+        workers.emplace_back([this, i] { worker_loop(i); });
+}
+
+rst::thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    signal.notify_all();
+    for (auto& w : workers)
+        w.join();
+}
+
+rst::thread_pool::work_queue& rst::thread_pool::home_queue()
+{
+    if (current_worker.pool == this)
+        return queues[current_worker.index];
+    return queues[queue_count - 1];
+}
+
+bool rst::thread_pool::push(work_queue& queue, const work_item& item)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.count == work_queue::capacity)
+            return false;
+        queue.at(queue.count++) = item;
+    }
+    pushes.fetch_add(1);
+    if (sleepers.load() > 0)
+    {
+        // Taken so that the notification cannot fall between a sleeper's last
+        // look at the queues and its wait
+        { std::lock_guard<std::mutex> lock(mutex); }
+        signal.notify_all();
+    }
+    return true;
+}
+
+bool rst::thread_pool::take(work_queue& home, const loop_state* only, work_item& item)
+{
+    {
+        std::lock_guard<std::mutex> lock(home.mutex);
+        if (home.count > 0 && (!only || home.at(home.count - 1).loop == only))
+        {
+            item = home.remove(home.count - 1);
+            return true;
+        }
+    }
+    unsigned start = next_random() % queue_count;
+    for (unsigned k = 0; k < queue_count; ++k)
+    {
+        work_queue& victim = queues[(start + k) % queue_count];
+        if (&victim == &home)
+            continue;
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        for (std::size_t i = 0; i < victim.count; ++i)
+        {
+            if (only && victim.at(i).loop != only)
+                continue;
+            item = victim.remove(i);
+            home.steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // A waiting thread may have pieces of its loop under other work in its own deque
+    if (only)
+    {
+        std::lock_guard<std::mutex> lock(home.mutex);
+        for (std::size_t i = home.count; i-- > 0;)
+        {
+            if (home.at(i).loop == only)
+            {
+                item = home.remove(i);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void rst::thread_pool::execute(work_item item, work_queue& home)
+{
+    bool outermost = execute_depth++ == 0;
+    auto start = outermost ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    loop_state& loop = *item.loop;
+    while (item.end - item.begin > loop.grain)
+    {
+        std::size_t chunks = (item.end - item.begin + loop.grain - 1) / loop.grain;
+        std::size_t mid = item.begin + chunks / 2 * loop.grain;
+        if (!push(home, {&loop, mid, item.end}))
+            break;
+        item.end = mid;
+    }
+    std::size_t ran = 0;
+    for (std::size_t b = item.begin; b < item.end; b += loop.grain, ++ran)
+        loop.fn(loop.ctx, b, std::min(item.end, b + loop.grain));
+
+    if (outermost)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        home.busy_ns.fetch_add((std::uint64_t)ns.count(), std::memory_order_relaxed);
+    }
+    --execute_depth;
+    (loop.owner ? home.tasks : home.chunks).fetch_add(ran, std::memory_order_relaxed);
+    finish(loop, item.end - item.begin);
+}
+
+void rst::thread_pool::finish(loop_state& loop, std::size_t elements)
+{
+    task_node* owner = loop.owner;
+    if (loop.remaining.fetch_sub(elements, std::memory_order_acq_rel) != elements)
+        return;
+    // The loop's waiter may return, and its state go away, from here on
+    if (owner)
+        complete(owner);
+    { std::lock_guard<std::mutex> lock(mutex); }
+    signal.notify_all();
+}
+
+template <typename Done>
+bool rst::thread_pool::idle(unsigned long seen, Done&& done)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    sleepers.fetch_add(1);
+    signal.wait(lock, [&] { return stopping || done() || pushes.load() != seen; });
+    sleepers.fetch_sub(1);
+    return !stopping;
+}
+
+void rst::thread_pool::worker_loop(unsigned index)
+{
+    current_worker = {this, index};
+    work_queue& home = queues[index];
+    for (;;)
+    {
+        unsigned long seen = pushes.load();
+        work_item item;
+        if (take(home, nullptr, item))
+        {
+            execute(item, home);
+            continue;
+        }
+        if (!idle(seen, [] { return false; }))
+            return;
+    }
+}
+
+void rst::thread_pool::run(std::size_t count, std::size_t grain, chunk_fn fn, void* ctx)
+{
+    if (count == 0)
+        return;
+    grain = std::max<std::size_t>(grain, 1);
+    if (workers.empty() || count <= grain)
+    {
+        for (std::size_t b = 0; b < count; b += grain)
+            fn(ctx, b, std::min(count, b + grain));
+        return;
+    }
+
+    loop_state loop{fn, ctx, grain, {count}, nullptr};
+    work_queue& home = home_queue();
+    execute({&loop, 0, count}, home);
+    while (loop.remaining.load(std::memory_order_acquire) != 0)
+    {
+        unsigned long seen = pushes.load();
+        work_item item;
+        if (take(home, &loop, item))
+        {
+            execute(item, home);
+            continue;
+        }
+        // The rest is running elsewhere, or split further where it runs
+        idle(seen, [&] { return loop.remaining.load(std::memory_order_acquire) == 0; });
+    }
+}
+
+rst::thread_pool::task rst::thread_pool::submit(std::function<void()> fn, std::initializer_list<task> after)
+{
+    task node = std::make_shared<task_node>();
+    node->fn = std::move(fn);
+    node->loop.fn = [](void* ctx, std::size_t, std::size_t) { static_cast<task_node*>(ctx)->fn(); };
+    node->loop.ctx = node.get();
+    node->loop.grain = 1;
+    node->loop.remaining.store(1, std::memory_order_relaxed);
+    node->loop.owner = node.get();
+    for (const task& before : after)
+    {
+        if (!before)
+            continue;
+        std::lock_guard<std::mutex> lock(before->mutex);
+        if (before->done.load(std::memory_order_acquire))
+            continue;
+        node->blocked.fetch_add(1, std::memory_order_relaxed);
+        before->successors.push_back(node);
+    }
+    release(node);
+    return node;
+}
+
+void rst::thread_pool::release(const task& node)
+{
+    if (node->blocked.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    node->self = node;
+    schedule(node.get());
+}
+
+void rst::thread_pool::schedule(task_node* node)
+{
+    if (workers.empty() || !push(home_queue(), {&node->loop, 0, 1}))
+        execute({&node->loop, 0, 1}, home_queue());
+}
+
+void rst::thread_pool::complete(task_node* node)
+{
+    task keep = std::move(node->self);
+    std::vector<task> ready;
+    {
+        std::lock_guard<std::mutex> lock(node->mutex);
+        node->done.store(true, std::memory_order_release);
+        ready.swap(node->successors);
+    }
+    for (const task& next : ready)
+        release(next);
+}
+
+void rst::thread_pool::wait(const task& t)
+{
+    if (!t)
+        return;
+    work_queue& home = home_queue();
+    while (!t->done.load(std::memory_order_acquire))
+    {
+        unsigned long seen = pushes.load();
+        work_item item;
+        if (take(home, nullptr, item))
+        {
+            execute(item, home);
+            continue;
+        }
+        idle(seen, [&] { return t->done.load(std::memory_order_acquire); });
+    }
+}
+
+bool rst::thread_pool::pin(placement where)
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return false;
+    std::vector<std::vector<int>> nodes = numa_nodes();
+    for (auto& cpus : nodes)
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](int c) { return !CPU_ISSET(c, &allowed); }),
+                   cpus.end());
+
+    std::vector<int> order;
+    if (where == placement::compact)
+    {
+        for (const auto& cpus : nodes)
+            order.insert(order.end(), cpus.begin(), cpus.end());
+    }
+    else if (where == placement::spread)
+    {
+        for (size_t i = 0;; ++i)
+        {
+            size_t before = order.size();
+            for (const auto& cpus : nodes)
+                if (i < cpus.size())
+                    order.push_back(cpus[i]);
+            if (order.size() == before)
+                break;
+        }
+    }
+    bool ok = true;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        cpu_set_t set = allowed;
+        if (!order.empty())
+        {
+            // The first CPU is left to the thread that created the pool
+            CPU_ZERO(&set);
+            CPU_SET(order[(i + 1) % order.size()], &set);
+        }
+        ok &= pthread_setaffinity_np(workers[i].native_handle(), sizeof(set), &set) == 0;
+    }
+    return ok;
+#else
+    return where == placement::none;
+#endif
+}
+
+std::vector<rst::thread_pool::worker_stats> rst::thread_pool::stats() const
+{
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - stats_since).count();
+    std::vector<worker_stats> result;
+    for (unsigned i = 0; i < queue_count; ++i)
+    {
+        const work_queue& q = queues[i];
+        worker_stats s;
+        s.busy_ns = q.busy_ns.load(std::memory_order_relaxed);
+        s.chunks = q.chunks.load(std::memory_order_relaxed);
+        s.tasks = q.tasks.load(std::memory_order_relaxed);
+        s.steals = q.steals.load(std::memory_order_relaxed);
+        s.utilization = elapsed > 0 ? s.busy_ns / elapsed : 0.0;
+        result.push_back(s);
+    }
+    return result;
+}
+
+void rst::thread_pool::reset_stats()
+{
+    for (unsigned i = 0; i < queue_count; ++i)
+    {
+        work_queue& q = queues[i];
+        q.busy_ns.store(0, std::memory_order_relaxed);
+        q.chunks.store(0, std::memory_order_relaxed);
+        q.tasks.store(0, std::memory_order_relaxed);
+        q.steals.store(0, std::memory_order_relaxed);
+    }
+    stats_since = std::chrono::steady_clock::now();
+}
@@ -0,0 +1,160 @@
+#ifndef RASTERIZER_THREAD_POOL_H
+#define RASTERIZER_THREAD_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace rst
+{
+    // Work-stealing scheduler shared by the loaders, texture decoding and the
+    // rasterizer. Each worker keeps a deque of work: it takes from the back of its
+    // own and, when that is empty, steals from the front of the others', where the
+    // largest pieces are. Threads outside the pool share one more deque.
+    //
+    // Loops are split lazily: a range too big for one chunk has its upper half
+    // pushed for others to steal and its lower half split again, so idle workers
+    // find work in proportion to what is left. Loops are dispatched through a plain
+    // function pointer and their state lives on the caller's stack, so issuing one
+    // never allocates.
+    class thread_pool
+    {
+    public:
+        enum class placement
+        {
+            none,       // wherever the OS puts them
+            compact,    // one CPU each, filling a NUMA node before the next
+            spread      // one CPU each, taking the nodes in turn
+        };
+
+        struct worker_stats
+        {
+            std::uint64_t busy_ns;      // running chunks and tasks
+            std::uint64_t chunks;
+            std::uint64_t tasks;
+            std::uint64_t steals;       // pieces taken from another deque
+            double utilization;         // busy share of the time since reset_stats()
+        };
+
+        class task_node;
+        // Handle to work started by submit()
+        using task = std::shared_ptr<task_node>;
+
+        explicit thread_pool(unsigned workers = default_workers());
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        // Calls fn(begin, end) over [0, count) in chunks of at most `grain`, each
+        // starting at a multiple of it, and returns once every chunk has finished.
+        // The calling thread runs chunks too, and while it waits it only runs
+        // chunks of this loop, so thread-local state it holds is left alone. Loops
+        // may nest.
+        template <typename F>
+        void parallel_for(std::size_t count, std::size_t grain, F&& fn)
+        {
+            using fn_type = std::remove_reference_t<F>;
+            run(count, grain, [](void* ctx, std::size_t b, std::size_t e) { (*static_cast<fn_type*>(ctx))(b, e); },
+                const_cast<void*>(static_cast<const void*>(&fn)));
+        }
+
+        // Runs fn on the pool once every task in `after` has finished. With no
+        // workers it runs on the thread that makes it ready.
+        task submit(std::function<void()> fn, std::initializer_list<task> after = {});
+        // Returns once t has finished, running queued work of any kind meanwhile
+        void wait(const task& t);
+
+        unsigned size() const { return (unsigned)workers.size(); }
+
+        // Pins the workers to CPUs the process may run on. False where threads
+        // cannot be pinned.
+        bool pin(placement where);
+
+        // One entry per worker, then one for the threads outside the pool, summed
+        // over them
+        std::vector<worker_stats> stats() const;
+        void reset_stats();
+
+        // One per CPU the process may run on, less the calling thread
+        static unsigned default_workers();
+
+        // Process-wide pool shared by the pipeline stages.
+        static thread_pool& global();
+
+    private:
+        using chunk_fn = void (*)(void*, std::size_t, std::size_t);
+
+        struct loop_state
+        {
+            chunk_fn fn;
+            void* ctx;
+            std::size_t grain;
+            // Elements not yet run; the loop is done at 0
+            std::atomic<std::size_t> remaining;
+            task_node* owner;
+        };
+
+        struct work_item
+        {
+            loop_state* loop;
+            std::size_t begin, end;
+        };
+
+        struct work_queue;
+
+        void run(std::size_t count, std::size_t grain, chunk_fn fn, void* ctx);
+        void worker_loop(unsigned index);
+        work_queue& home_queue();
+        bool push(work_queue& queue, const work_item& item);
+        // From the back of home, else stolen; only items of `only` unless null
+        bool take(work_queue& home, const loop_state* only, work_item& item);
+        void execute(work_item item, work_queue& home);
+        void finish(loop_state& loop, std::size_t elements);
+        void schedule(task_node* node);
+        void release(const task& node);
+        void complete(task_node* node);
+        // Sleeps until `done` holds or more work was pushed after `seen`; false
+        // once the pool is stopping
+        template <typename Done>
+        bool idle(unsigned long seen, Done&& done);
+
+        std::vector<std::thread> workers;
+        // workers.size() + 1 deques, the last one for outside threads
+        std::unique_ptr<work_queue[]> queues;
+        unsigned queue_count = 0;
+
+        std::mutex mutex;
+        std::condition_variable signal;
+        std::atomic<unsigned long> pushes{0};
+        std::atomic<unsigned> sleepers{0};
+        bool stopping = false;
+        std::chrono::steady_clock::time_point stats_since;
+    };
+
+    class thread_pool::task_node
+    {
+        friend class thread_pool;
+
+        std::function<void()> fn;
+        loop_state loop;
+        // Unfinished dependencies, plus one until submit() is through with them
+        std::atomic<int> blocked{1};
+        std::mutex mutex;
+        std::vector<task> successors;
+        std::atomic<bool> done{false};
+        // Held while queued or running, so the caller may drop its handle
+        task self;
+    };
+}
+
+#endif //RASTERIZER_THREAD_POOL_H
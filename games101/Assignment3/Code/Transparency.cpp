@@ -0,0 +1,164 @@
+#include "Transparency.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+void rst::oit_buffer::configure(transparency mode, int tile_count, int tile_pixels, std::size_t node_budget)
+{
+    blend_mode = mode;
+    pixels_per_tile = tile_pixels;
+    tiles.assign(mode == transparency::none ? 0 : tile_count, tile_info{});
+
+    std::size_t pixels = tiles.size() * tile_pixels;
+    nodes_per_tile = mode == transparency::fragment_lists ? node_budget / std::max(1, tile_count) : 0;
+    nodes.resize(nodes_per_tile * tiles.size());
+    heads.resize(mode == transparency::fragment_lists ? pixels : 0);
+    // Both modes need these: lists spill into them on overflow
+    accum.resize(pixels);
+    revealage.resize(pixels);
+    nearest.resize(pixels);
+    // A smaller configuration gives the memory back
+    nodes.shrink_to_fit();
+    heads.shrink_to_fit();
+    accum.shrink_to_fit();
+    revealage.shrink_to_fit();
+    nearest.shrink_to_fit();
+    tiles.shrink_to_fit();
+}
+
+std::size_t rst::oit_buffer::footprint(transparency mode, int tile_count, int tile_pixels, std::size_t node_budget)
+{
+    if (mode == transparency::none)
+        return 0;
+    std::size_t tile_total = tile_count, pixels = tile_total * tile_pixels;
+    std::size_t bytes = tile_total * sizeof(tile_info) + pixels * (sizeof(Eigen::Vector4f) + 2 * sizeof(float));
+    if (mode == transparency::fragment_lists)
+        bytes += node_budget / std::max(1, tile_count) * tile_total * sizeof(node) + pixels * sizeof(std::uint32_t);
+    return bytes;
+}
+
+std::size_t rst::oit_buffer::bytes() const
+{
+    return nodes.size() * sizeof(node) + heads.size() * sizeof(std::uint32_t) +
+           accum.size() * sizeof(Eigen::Vector4f) + (revealage.size() + nearest.size()) * sizeof(float) +
+           tiles.size() * sizeof(tile_info);
+}
+
+void rst::oit_buffer::reset()
+{
+    for (auto& t : tiles)
+        t = tile_info{};
+}
+
+void rst::oit_buffer::touch(int tile)
+{
+    // First transparent fragment in the tile this frame: initialise its pixels
+    tile_info& t = tiles[tile];
+    std::size_t first = (std::size_t)tile * pixels_per_tile;
+    if (!heads.empty())
+        std::fill_n(heads.begin() + first, pixels_per_tile, end_of_list);
+    std::fill_n(accum.begin() + first, pixels_per_tile, Eigen::Vector4f::Zero());
+    std::fill_n(revealage.begin() + first, pixels_per_tile, 1.0f);
+    std::fill_n(nearest.begin() + first, pixels_per_tile, std::numeric_limits<float>::infinity());
+    t.touched = true;
+}
+
+void rst::oit_buffer::blend(int tile, int local, const Eigen::Vector3f& color, float alpha, float depth, float view_depth)
+{
+    // Weight from McGuire & Bavoil, eq. 7: nearer and more opaque fragments dominate
+    float z = view_depth;
+    float w = alpha * std::clamp(10.0f / (1e-5f + std::pow(z / 5, 2.0f) + std::pow(z / 200, 6.0f)), 1e-2f, 3e3f);
+    std::size_t i = (std::size_t)tile * pixels_per_tile + local;
+    accum[i] += Eigen::Vector4f(color.x() * alpha * w, color.y() * alpha * w, color.z() * alpha * w, alpha * w);
+    revealage[i] *= 1 - alpha;
+    nearest[i] = std::min(nearest[i], depth);
+    tiles[tile].blended = true;
+}
+
+void rst::oit_buffer::add(int tile, int local, const Eigen::Vector3f& color, float alpha, float depth, float view_depth)
+{
+    tile_info& t = tiles[tile];
+    if (!t.touched)
+        touch(tile);
+
+    if (blend_mode == transparency::fragment_lists)
+    {
+        if (t.used < nodes_per_tile)
+        {
+            std::uint32_t n = (std::uint32_t)(tile * nodes_per_tile + t.used++);
+            std::uint32_t& head = heads[(std::size_t)tile * pixels_per_tile + local];
+            nodes[n] = {color, alpha, depth, head};
+            head = n;
+            return;
+        }
+        ++t.overflow;
+    }
+    blend(tile, local, color, alpha, depth, view_depth);
+}
+
+void rst::oit_buffer::occlude(int tile, int local, float depth)
+{
+    if (blend_mode == transparency::none || !tiles[tile].blended)
+        return;
+    std::size_t i = (std::size_t)tile * pixels_per_tile + local;
+    if (depth > nearest[i] || std::isinf(nearest[i]))
+        return;
+    accum[i] = Eigen::Vector4f::Zero();
+    revealage[i] = 1.0f;
+    nearest[i] = std::numeric_limits<float>::infinity();
+}
+
+Eigen::Vector3f rst::oit_buffer::composite(int tile, int local, const Eigen::Vector3f& background, float opaque_depth) const
+{
+    const tile_info& t = tiles[tile];
+    if (!t.touched)
+        return background;
+
+    std::size_t i = (std::size_t)tile * pixels_per_tile + local;
+    Eigen::Vector3f c = background;
+
+    if (!heads.empty())
+    {
+        // Insertion sort, nearest first, of the fragments still in front of the opaque surface
+        const node* layers[max_layers];
+        int count = 0;
+        for (std::uint32_t n = heads[i]; n != end_of_list; n = nodes[n].next)
+        {
+            const node& f = nodes[n];
+            if (f.depth >= opaque_depth)
+                continue;
+            if (count == max_layers && f.depth >= layers[count - 1]->depth)
+                continue;
+            int k = std::min(count, max_layers - 1);
+            while (k > 0 && layers[k - 1]->depth > f.depth)
+            {
+                layers[k] = layers[k - 1];
+                --k;
+            }
+            layers[k] = &f;
+            count = std::min(count + 1, max_layers);
+        }
+        // Back to front "over"
+        for (int k = count - 1; k >= 0; --k)
+            c = layers[k]->alpha * layers[k]->color + (1 - layers[k]->alpha) * c;
+    }
+
+    // Already cut down to what is in front of the opaque surface, see occlude()
+    if (t.blended)
+    {
+        const Eigen::Vector4f& a = accum[i];
+        float reveal = revealage[i];
+        Eigen::Vector3f average = a.head<3>() / std::max(a.w(), 1e-5f);
+        c = average * (1 - reveal) + c * reveal;
+    }
+    return c;
+}
+
+std::size_t rst::oit_buffer::overflowed() const
+{
+    std::size_t total = 0;
+    for (auto& t : tiles)
+        total += t.overflow;
+    return total;
+}
@@ -0,0 +1,97 @@
+#ifndef RASTERIZER_TRANSPARENCY_H
+#define RASTERIZER_TRANSPARENCY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+
+namespace rst
+{
+    enum class transparency
+    {
+        none,
+        // Exact: per-pixel fragment lists, sorted and composited at resolve time
+        fragment_lists,
+        // Approximate, no sorting: weighted blended OIT (McGuire & Bavoil 2013)
+        weighted_blended
+    };
+
+    // Storage for order-independent transparency. Everything is laid out tile by tile
+    // (pixel arrays in tile-local order, the node pool split into one fixed slice per
+    // tile) so the worker that owns a tile only touches memory belonging to it, and a
+    // tile's lists stay in cache while it is being shaded and resolved.
+    class oit_buffer
+    {
+    public:
+        // Allocates for tile_count tiles of tile_pixels each. node_budget bounds the
+        // fragment-list pool; a tile that uses up its slice falls back to weighted
+        // blending for the rest of the frame instead of dropping fragments.
+        void configure(transparency mode, int tile_count, int tile_pixels, std::size_t node_budget);
+        // Bytes configure() with these arguments leaves allocated, and bytes held now
+        static std::size_t footprint(transparency mode, int tile_count, int tile_pixels, std::size_t node_budget);
+        std::size_t bytes() const;
+        transparency mode() const { return blend_mode; }
+
+        // Forgets every fragment. Only per-tile flags are touched.
+        void reset();
+
+        void add(int tile, int local, const Eigen::Vector3f& color, float alpha, float depth, float view_depth);
+        bool touched(int tile) const { return tiles[tile].touched; }
+
+        // An opaque fragment at `depth` landed on the pixel. Blended fragments are
+        // one running average per pixel that cannot be taken apart, so it is dropped
+        // when the opaque fragment is in front of all of them and otherwise kept
+        // whole: an opaque surface drawn after, and in between, blended fragments
+        // still shows those behind it. Blended fragments arriving after an opaque
+        // one are depth tested by the rasterizer like any other.
+        void occlude(int tile, int local, float depth);
+
+        // The final colour of one pixel: its transparent fragments in front of
+        // opaque_depth composited over `background`. Blended fragments, and the
+        // layers a full list spilled, go over the sorted ones; see occlude() for
+        // how far they are depth tested.
+        Eigen::Vector3f composite(int tile, int local, const Eigen::Vector3f& background, float opaque_depth) const;
+
+        // Fragments since the last reset that did not fit in their tile's list slice.
+        std::size_t overflowed() const;
+
+    private:
+        static constexpr std::uint32_t end_of_list = 0xffffffffu;
+        // Deeper lists are cut to their nearest fragments when composited
+        static constexpr int max_layers = 32;
+
+        struct node
+        {
+            Eigen::Vector3f color;
+            float alpha;
+            float depth;
+            std::uint32_t next;
+        };
+
+        struct tile_info
+        {
+            bool touched = false;
+            bool blended = false;
+            std::uint32_t used = 0;
+            std::uint32_t overflow = 0;
+        };
+
+        void touch(int tile);
+        void blend(int tile, int local, const Eigen::Vector3f& color, float alpha, float depth, float view_depth);
+
+        transparency blend_mode = transparency::none;
+        int pixels_per_tile = 0;
+        std::size_t nodes_per_tile = 0;
+        std::vector<node> nodes;
+        std::vector<std::uint32_t> heads;
+        // Weighted blended terms: (sum c*a*w, sum a*w) and prod(1 - a)
+        std::vector<Eigen::Vector4f> accum;
+        std::vector<float> revealage;
+        // Nearest depth blended into each pixel
+        std::vector<float> nearest;
+        std::vector<tile_info> tiles;
+    };
+}
+
+#endif //RASTERIZER_TRANSPARENCY_H
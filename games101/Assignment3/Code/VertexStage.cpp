@@ -0,0 +1,177 @@
+#include "VertexStage.hpp"
+
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// Arrays are 32-byte aligned so a whole batch of eight floats sits in one AVX register
+static float* alloc_floats(rst::arena& storage, std::size_t count)
+{
+    return static_cast<float*>(storage.allocate(sizeof(float) * count, 32));
+}
+
+rst::vertex_arrays rst::vertex_arrays::allocate(arena& storage, std::size_t count)
+{
+    vertex_arrays a;
+    a.count = count;
+    for (float** p : {&a.px, &a.py, &a.pz, &a.nx, &a.ny, &a.nz, &a.u, &a.v})
+        *p = alloc_floats(storage, count);
+    return a;
+}
+
+rst::vertex_outputs rst::vertex_outputs::allocate(arena& storage, std::size_t count)
+{
+    vertex_outputs o;
+    o.count = count;
+    for (float** p : {&o.cx, &o.cy, &o.cz, &o.cw, &o.vx, &o.vy, &o.vz, &o.nx, &o.ny, &o.nz, &o.u, &o.v})
+        *p = alloc_floats(storage, count);
+    return o;
+}
+
+namespace
+{
+    // Tail loop for the last count % 8 vertices
+    template <int Rows, typename M>
+    inline void transform_one(const M& m, float x, float y, float z, bool point, float* const* out, std::size_t i)
+    {
+        for (int r = 0; r < Rows; ++r)
+            out[r][i] = m(r, 0) * x + m(r, 1) * y + m(r, 2) * z + (point ? m(r, 3) : 0.0f);
+    }
+
+#if defined(__AVX__)
+    inline __m256 madd(__m256 a, __m256 b, __m256 c)
+    {
+#if defined(__FMA__)
+        return _mm256_fmadd_ps(a, b, c);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+    }
+
+    template <int Rows, typename M>
+    inline void transform8(const M& m, __m256 x, __m256 y, __m256 z, bool point, float* const* out, std::size_t i)
+    {
+        for (int r = 0; r < Rows; ++r)
+        {
+            __m256 acc = point ? _mm256_set1_ps(m(r, 3)) : _mm256_setzero_ps();
+            acc = madd(_mm256_set1_ps(m(r, 2)), z, acc);
+            acc = madd(_mm256_set1_ps(m(r, 1)), y, acc);
+            acc = madd(_mm256_set1_ps(m(r, 0)), x, acc);
+            _mm256_storeu_ps(out[r] + i, acc);
+        }
+    }
+#else
+    // Fixed-width lanes the compiler can keep in vector registers
+    template <int Rows, typename M>
+    inline void transform8(const M& m, const float* x, const float* y, const float* z, bool point, float* const* out, std::size_t i)
+    {
+        for (int r = 0; r < Rows; ++r)
+        {
+            float m0 = m(r, 0), m1 = m(r, 1), m2 = m(r, 2), m3 = point ? m(r, 3) : 0.0f;
+            float* o = out[r] + i;
+            for (int k = 0; k < 8; ++k)
+                o[k] = m0 * x[k] + m1 * y[k] + m2 * z[k] + m3;
+        }
+    }
+#endif
+}
+
+void rst::transform_vertices(const vertex_uniforms& uniforms, const vertex_arrays& in,
+                             const vertex_outputs& out, std::size_t begin, std::size_t end)
+{
+    float* const clip[] = {out.cx, out.cy, out.cz, out.cw};
+    float* const view[] = {out.vx, out.vy, out.vz};
+    float* const normal[] = {out.nx, out.ny, out.nz};
+
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+#if defined(__AVX__)
+        __m256 x = _mm256_loadu_ps(in.px + i), y = _mm256_loadu_ps(in.py + i), z = _mm256_loadu_ps(in.pz + i);
+        transform8<4>(uniforms.mvp, x, y, z, true, clip, i);
+        transform8<3>(uniforms.mv, x, y, z, true, view, i);
+        __m256 nx = _mm256_loadu_ps(in.nx + i), ny = _mm256_loadu_ps(in.ny + i), nz = _mm256_loadu_ps(in.nz + i);
+        transform8<3>(uniforms.normal_matrix, nx, ny, nz, false, normal, i);
+#else
+        transform8<4>(uniforms.mvp, in.px + i, in.py + i, in.pz + i, true, clip, i);
+        transform8<3>(uniforms.mv, in.px + i, in.py + i, in.pz + i, true, view, i);
+        transform8<3>(uniforms.normal_matrix, in.nx + i, in.ny + i, in.nz + i, false, normal, i);
+#endif
+    }
+    for (; i < end; ++i)
+    {
+        transform_one<4>(uniforms.mvp, in.px[i], in.py[i], in.pz[i], true, clip, i);
+        transform_one<3>(uniforms.mv, in.px[i], in.py[i], in.pz[i], true, view, i);
+        transform_one<3>(uniforms.normal_matrix, in.nx[i], in.ny[i], in.nz[i], false, normal, i);
+    }
+
+    std::memcpy(out.u + begin, in.u + begin, sizeof(float) * (end - begin));
+    std::memcpy(out.v + begin, in.v + begin, sizeof(float) * (end - begin));
+}
+
+void rst::transform_vertices_multiview(const Eigen::Matrix4f& model, const Eigen::Matrix3f& model_normal_matrix,
+                                       const vertex_arrays& in, const view_transform* views, const vertex_outputs* outs,
+                                       std::size_t view_count, std::size_t begin, std::size_t end)
+{
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+#if defined(__AVX__)
+        __m256 x = _mm256_loadu_ps(in.px + i), y = _mm256_loadu_ps(in.py + i), z = _mm256_loadu_ps(in.pz + i);
+        __m256 nx = _mm256_loadu_ps(in.nx + i), ny = _mm256_loadu_ps(in.ny + i), nz = _mm256_loadu_ps(in.nz + i);
+        alignas(32) float world[6][8];
+        float* const world_pos[] = {world[0], world[1], world[2]};
+        float* const world_normal[] = {world[3], world[4], world[5]};
+        transform8<3>(model, x, y, z, true, world_pos, 0);
+        transform8<3>(model_normal_matrix, nx, ny, nz, false, world_normal, 0);
+        __m256 wx = _mm256_load_ps(world[0]), wy = _mm256_load_ps(world[1]), wz = _mm256_load_ps(world[2]);
+        __m256 wnx = _mm256_load_ps(world[3]), wny = _mm256_load_ps(world[4]), wnz = _mm256_load_ps(world[5]);
+        for (std::size_t k = 0; k < view_count; ++k)
+        {
+            const vertex_outputs& out = outs[k];
+            float* const clip[] = {out.cx, out.cy, out.cz, out.cw};
+            float* const view[] = {out.vx, out.vy, out.vz};
+            float* const normal[] = {out.nx, out.ny, out.nz};
+            transform8<4>(views[k].view_projection, wx, wy, wz, true, clip, i);
+            transform8<3>(views[k].view, wx, wy, wz, true, view, i);
+            transform8<3>(views[k].normal_matrix, wnx, wny, wnz, false, normal, i);
+        }
+#else
+        float world[6][8];
+        float* const world_pos[] = {world[0], world[1], world[2]};
+        float* const world_normal[] = {world[3], world[4], world[5]};
+        transform8<3>(model, in.px + i, in.py + i, in.pz + i, true, world_pos, 0);
+        transform8<3>(model_normal_matrix, in.nx + i, in.ny + i, in.nz + i, false, world_normal, 0);
+        for (std::size_t k = 0; k < view_count; ++k)
+        {
+            const vertex_outputs& out = outs[k];
+            float* const clip[] = {out.cx, out.cy, out.cz, out.cw};
+            float* const view[] = {out.vx, out.vy, out.vz};
+            float* const normal[] = {out.nx, out.ny, out.nz};
+            transform8<4>(views[k].view_projection, world[0], world[1], world[2], true, clip, i);
+            transform8<3>(views[k].view, world[0], world[1], world[2], true, view, i);
+            transform8<3>(views[k].normal_matrix, world[3], world[4], world[5], false, normal, i);
+        }
+#endif
+    }
+    for (; i < end; ++i)
+    {
+        float world[6];
+        float* const world_pos[] = {&world[0], &world[1], &world[2]};
+        float* const world_normal[] = {&world[3], &world[4], &world[5]};
+        transform_one<3>(model, in.px[i], in.py[i], in.pz[i], true, world_pos, 0);
+        transform_one<3>(model_normal_matrix, in.nx[i], in.ny[i], in.nz[i], false, world_normal, 0);
+        for (std::size_t k = 0; k < view_count; ++k)
+        {
+            const vertex_outputs& out = outs[k];
+            float* const clip[] = {out.cx, out.cy, out.cz, out.cw};
+            float* const view[] = {out.vx, out.vy, out.vz};
+            float* const normal[] = {out.nx, out.ny, out.nz};
+            transform_one<4>(views[k].view_projection, world[0], world[1], world[2], true, clip, i);
+            transform_one<3>(views[k].view, world[0], world[1], world[2], true, view, i);
+            transform_one<3>(views[k].normal_matrix, world[3], world[4], world[5], false, normal, i);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef RASTERIZER_VERTEX_STAGE_H
+#define RASTERIZER_VERTEX_STAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <eigen3/Eigen/Eigen>
+#include "Arena.hpp"
+
+namespace rst
+{
+    // Model-space vertex attributes in structure-of-arrays layout.
+    struct vertex_arrays
+    {
+        std::size_t count = 0;
+        float* px = nullptr, * py = nullptr, * pz = nullptr;
+        float* nx = nullptr, * ny = nullptr, * nz = nullptr;
+        float* u = nullptr, * v = nullptr;
+
+        // Allocates all attribute arrays for `count` vertices from `storage`.
+        static vertex_arrays allocate(arena& storage, std::size_t count);
+    };
+
+    // What the vertex stage hands to clipping and setup: clip-space position plus the
+    // view-space position and normal the fragment stage shades with.
+    struct vertex_outputs
+    {
+        std::size_t count = 0;
+        float* cx = nullptr, * cy = nullptr, * cz = nullptr, * cw = nullptr;
+        float* vx = nullptr, * vy = nullptr, * vz = nullptr;
+        float* nx = nullptr, * ny = nullptr, * nz = nullptr;
+        float* u = nullptr, * v = nullptr;
+
+        static vertex_outputs allocate(arena& storage, std::size_t count);
+    };
+
+    // An indexed triangle mesh. The arrays usually live in a long-lived mesh arena.
+    struct mesh
+    {
+        vertex_arrays vertices;
+        std::uint32_t* indices = nullptr;
+        std::size_t triangle_count = 0;
+    };
+
+    struct vertex_uniforms
+    {
+        Eigen::Matrix4f model;
+        Eigen::Matrix4f view;
+        Eigen::Matrix4f projection;
+        Eigen::Matrix4f mv;
+        Eigen::Matrix4f mvp;
+        Eigen::Matrix3f normal_matrix;
+    };
+
+    // A vertex shader processes the vertex range [begin, end) in one call, so the
+    // per-vertex cost is a loop iteration rather than a std::function dispatch. It
+    // must fill every array of `out` for that range; shaders that only deform the
+    // input usually finish by calling transform_vertices on a modified copy.
+    using batch_vertex_shader = std::function<void(const vertex_uniforms& uniforms, const vertex_arrays& in,
+                                                   const vertex_outputs& out, std::size_t begin, std::size_t end)>;
+
+    // One camera of a multi-view draw, applied to world-space data
+    struct view_transform
+    {
+        Eigen::Matrix4f view_projection;
+        Eigen::Matrix4f view;
+        Eigen::Matrix3f normal_matrix;
+    };
+
+    // Multi-view kernel: each batch of eight vertices goes to world space once and is
+    // then projected into all view_count outputs while still in registers. Texcoords
+    // are not copied; point each output's u/v at the input arrays instead.
+    void transform_vertices_multiview(const Eigen::Matrix4f& model, const Eigen::Matrix3f& model_normal_matrix,
+                                      const vertex_arrays& in, const view_transform* views, const vertex_outputs* outs,
+                                      std::size_t view_count, std::size_t begin, std::size_t end);
+
+    // Built-in kernel: clip = mvp * p, view = mv * p, normal = normal_matrix * n and a
+    // texcoord copy, eight vertices per iteration.
+    void transform_vertices(const vertex_uniforms& uniforms, const vertex_arrays& in,
+                            const vertex_outputs& out, std::size_t begin, std::size_t end);
+}
+
+#endif //RASTERIZER_VERTEX_STAGE_H
@@ -0,0 +1,420 @@
+#include "VirtualTexture.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+#include "Texture.hpp"
+
+static const char virtual_texture_magic[4] = {'R', 'S', 'V', 'T'};
+static const std::uint32_t virtual_texture_version = 1;
+static const std::uint64_t file_page_size = 4096;
+
+static std::uint64_t align_up(std::uint64_t v, std::uint64_t a)
+{
+    return (v + a - 1) / a * a;
+}
+
+// Level dimensions and page counts for a width x height image; returns the total page count
+static std::uint32_t plan_levels(std::uint32_t width, std::uint32_t height, std::uint32_t page_size,
+                                 std::vector<rst::virtual_texture_level>& levels)
+{
+    levels.clear();
+    std::uint32_t pages = 0;
+    for (;;)
+    {
+        rst::virtual_texture_level l{};
+        l.width = width;
+        l.height = height;
+        l.pages_x = (width + page_size - 1) / page_size;
+        l.pages_y = (height + page_size - 1) / page_size;
+        l.first_page = pages;
+        pages += l.pages_x * l.pages_y;
+        levels.push_back(l);
+        if (width == 1 && height == 1)
+            return pages;
+        width = std::max(1u, width / 2);
+        height = std::max(1u, height / 2);
+    }
+}
+
+bool rst::write_virtual_texture(const std::string& image_path, const std::string& path, int page_size)
+{
+    if (page_size < 8 || (page_size & (page_size - 1)) != 0)
+        return false;
+    cv::Mat level = cv::imread(image_path);
+    if (level.empty())
+        return false;
+    // The same channel order Texture ends up with
+    cv::cvtColor(level, level, cv::COLOR_RGB2BGR);
+
+    virtual_texture_header header{};
+    std::memcpy(header.magic, virtual_texture_magic, sizeof(virtual_texture_magic));
+    header.version = virtual_texture_version;
+    header.width = level.cols;
+    header.height = level.rows;
+    header.page_size = page_size;
+    std::vector<virtual_texture_level> levels;
+    plan_levels(header.width, header.height, header.page_size, levels);
+    header.level_count = (std::uint32_t)levels.size();
+    header.pages_offset = align_up(sizeof(header) + levels.size() * sizeof(virtual_texture_level), file_page_size);
+    header.page_stride = align_up((std::uint64_t)page_size * page_size * 3, file_page_size);
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(levels.data(), sizeof(virtual_texture_level), levels.size(), file) == levels.size() &&
+              std::fseek(file, (long)header.pages_offset, SEEK_SET) == 0;
+
+    // One level in memory at a time, so preprocessing needs little more than the image
+    std::vector<unsigned char> page(header.page_stride);
+    for (std::size_t l = 0; ok && l < levels.size(); ++l)
+    {
+        if (l > 0)
+            level = Texture::half_size(level);
+        for (std::uint32_t py = 0; ok && py < levels[l].pages_y; ++py)
+        {
+            for (std::uint32_t px = 0; ok && px < levels[l].pages_x; ++px)
+            {
+                std::fill(page.begin(), page.end(), 0);
+                int x0 = px * page_size, y0 = py * page_size;
+                int cols = std::min(page_size, level.cols - x0), rows = std::min(page_size, level.rows - y0);
+                for (int r = 0; r < rows; ++r)
+                    std::memcpy(&page[(std::size_t)r * page_size * 3], level.ptr<unsigned char>(y0 + r) + x0 * 3,
+                                (std::size_t)cols * 3);
+                ok = std::fwrite(page.data(), 1, page.size(), file) == page.size();
+            }
+        }
+    }
+    ok = std::fclose(file) == 0 && ok;
+    return ok;
+}
+
+rst::virtual_texture::~virtual_texture()
+{
+    close();
+}
+
+bool rst::virtual_texture::open(const std::string& path, std::size_t cache_bytes)
+{
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(header))
+    {
+        close();
+        return false;
+    }
+    size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    base = static_cast<char*>(mapping);
+    // Pages are read wherever samples land, and never twice in a row
+    madvise(base, size, MADV_RANDOM);
+
+    std::memcpy(&header, base, sizeof(header));
+    std::vector<virtual_texture_level> expected;
+    std::uint32_t total = 0;
+    // Pages are madvise()d where they lie in the file, so they have to start on file
+    // pages, and every bound is checked as a difference from size so a corrupt
+    // offset or stride cannot wrap
+    bool ok = std::memcmp(header.magic, virtual_texture_magic, sizeof(virtual_texture_magic)) == 0 &&
+              header.version == virtual_texture_version && header.width > 0 && header.height > 0 &&
+              header.page_size >= 8 && header.page_size <= 1u << 16 &&
+              (header.page_size & (header.page_size - 1)) == 0 &&
+              header.page_stride == align_up((std::uint64_t)header.page_size * header.page_size * 3, file_page_size) &&
+              header.pages_offset % file_page_size == 0 && header.pages_offset <= size;
+    if (ok)
+    {
+        total = plan_levels(header.width, header.height, header.page_size, expected);
+        ok = header.level_count == expected.size() &&
+             sizeof(header) + expected.size() * sizeof(virtual_texture_level) <= header.pages_offset &&
+             header.page_stride <= (size - header.pages_offset) / std::max(total, 1u) &&
+             std::memcmp(base + sizeof(header), expected.data(), expected.size() * sizeof(virtual_texture_level)) == 0;
+    }
+    if (!ok)
+    {
+        close();
+        return false;
+    }
+    levels = std::move(expected);
+    page_shift = 0;
+    while ((1u << page_shift) < header.page_size)
+        ++page_shift;
+    page_bytes = (std::size_t)header.page_size * header.page_size * 3;
+
+    std::size_t first_single = 0;
+    while (levels[first_single].pages_x * levels[first_single].pages_y > 1)
+        ++first_single;
+    pinned = total - levels[first_single].first_page;
+    capacity = cache_bytes / page_bytes;
+    account = std::make_unique<memory_account>("virtual texture " + path);
+    // A few slots beyond the pinned tail, or nothing finer would ever be resident
+    if (capacity < pinned + 4 ||
+        !account->charge(memory_kind::textures, (capacity + staging_pages) * page_bytes))
+    {
+        close();
+        return false;
+    }
+    cache.reset(new unsigned char[capacity * page_bytes]);
+    staging.reset(new unsigned char[staging_pages * page_bytes]);
+
+    page_table.assign(total, -1);
+    requested.reset(new std::atomic<std::uint8_t>[total]);
+    for (std::uint32_t i = 0; i < total; ++i)
+        requested[i].store(0, std::memory_order_relaxed);
+    slot_page.assign(capacity, no_page);
+    last_used.reset(new std::atomic<std::uint32_t>[capacity]);
+    for (std::size_t i = 0; i < capacity; ++i)
+        last_used[i].store(0, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < pinned; ++i)
+    {
+        std::uint32_t page = levels[first_single].first_page + (std::uint32_t)i;
+        std::memcpy(cache.get() + i * page_bytes, file_page(page), page_bytes);
+        page_table[page] = (std::int32_t)i;
+        slot_page[i] = page;
+    }
+    never_used = pinned;
+    epoch = 0;
+    evictions = 0;
+    request_count = 0;
+
+    // Sized for the worst case up front: a frame that misses pages must not allocate
+    requests.clear();
+    requests.reserve(total);
+    request_head = 0;
+    completed.reserve(staging_pages);
+    free_staging.clear();
+    for (int i = 0; i < staging_pages; ++i)
+        free_staging.push_back(i);
+    loading = 0;
+    stopping = false;
+    loader = std::thread([this] { loader_loop(); });
+    return true;
+}
+
+void rst::virtual_texture::close()
+{
+    if (loader.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        loader.join();
+    }
+    if (base)
+        munmap(base, size);
+    if (fd >= 0)
+        ::close(fd);
+    base = nullptr;
+    fd = -1;
+    size = 0;
+    levels.clear();
+    cache.reset();
+    staging.reset();
+    account.reset();
+    capacity = pinned = 0;
+    page_table.clear();
+    slot_page.clear();
+    requests.clear();
+    completed.clear();
+}
+
+const unsigned char* rst::virtual_texture::file_page(std::uint32_t page) const
+{
+    return reinterpret_cast<const unsigned char*>(base + header.pages_offset + page * header.page_stride);
+}
+
+const unsigned char* rst::virtual_texture::texel(int level, int x, int y)
+{
+    const virtual_texture_level& l = levels[level];
+    std::uint32_t page = l.first_page + (std::uint32_t)(y >> page_shift) * l.pages_x + (std::uint32_t)(x >> page_shift);
+    std::int32_t slot = page_table[page];
+    if (slot < 0)
+    {
+        if (!requested[page].exchange(1, std::memory_order_relaxed))
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                requests.push_back(page);
+            }
+            request_count.fetch_add(1, std::memory_order_relaxed);
+            wake.notify_one();
+        }
+        return nullptr;
+    }
+    // Only stored when it changes, so threads sampling the same page do not keep
+    // taking its cache line from each other
+    if (last_used[slot].load(std::memory_order_relaxed) != epoch)
+        last_used[slot].store(epoch, std::memory_order_relaxed);
+    int mask = (int)header.page_size - 1;
+    return cache.get() + slot * page_bytes + ((std::size_t)(y & mask) * header.page_size + (x & mask)) * 3;
+}
+
+// The same filter as Texture's bilinear()
+bool rst::virtual_texture::bilinear(int level, float u, float v, Eigen::Vector3f& color)
+{
+    const virtual_texture_level& l = levels[level];
+    int cols = (int)l.width, rows = (int)l.height;
+    float x = std::clamp(u, 0.0f, 1.0f) * cols - 0.5f;
+    float y = (1 - std::clamp(v, 0.0f, 1.0f)) * rows - 0.5f;
+    int x0 = std::clamp((int)std::floor(x), 0, cols - 1), x1 = std::min(x0 + 1, cols - 1);
+    int y0 = std::clamp((int)std::floor(y), 0, rows - 1), y1 = std::min(y0 + 1, rows - 1);
+    float fx = std::clamp(x - x0, 0.0f, 1.0f), fy = std::clamp(y - y0, 0.0f, 1.0f);
+
+    // All four are looked up, so every missing page is requested at once
+    const unsigned char* p00 = texel(level, x0, y0);
+    const unsigned char* p01 = texel(level, x1, y0);
+    const unsigned char* p10 = texel(level, x0, y1);
+    const unsigned char* p11 = texel(level, x1, y1);
+    if (!p00 || !p01 || !p10 || !p11)
+        return false;
+    auto value = [](const unsigned char* p) { return Eigen::Vector3f(p[0], p[1], p[2]); };
+    color = (value(p00) * (1 - fx) + value(p01) * fx) * (1 - fy) + (value(p10) * (1 - fx) + value(p11) * fx) * fy;
+    return true;
+}
+
+Eigen::Vector3f rst::virtual_texture::fallback(int level, float u, float v)
+{
+    Eigen::Vector3f color;
+    for (level = std::min(level, level_count() - 1); !bilinear(level, u, v, color); ++level)
+        ;
+    return color;
+}
+
+Eigen::Vector3f rst::virtual_texture::sample(float u, float v)
+{
+    u = std::clamp(u, 0.0f, 1.0f);
+    v = std::clamp(v, 0.0f, 1.0f);
+    float x = std::min(u * header.width, header.width - 1.0f);
+    float y = std::min((1 - v) * header.height, header.height - 1.0f);
+    const unsigned char* p = texel(0, (int)x, (int)y);
+    if (!p)
+        return fallback(1, u, v);
+    return Eigen::Vector3f(p[0], p[1], p[2]);
+}
+
+Eigen::Vector3f rst::virtual_texture::sample(float u, float v, float lod)
+{
+    int level = (int)lod;
+    float blend = lod - level;
+    Eigen::Vector3f color, next;
+    if (!bilinear(level, u, v, color))
+        return fallback(level + 1, u, v);
+    // A missing finer neighbour is requested and leaves this sample unblended
+    if (blend > 0.0f && level + 1 < level_count() && bilinear(level + 1, u, v, next))
+        color = color * (1 - blend) + next * blend;
+    return color;
+}
+
+void rst::virtual_texture::loader_loop()
+{
+    for (;;)
+    {
+        std::uint32_t page;
+        int buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || (request_head < requests.size() && !free_staging.empty()); });
+            if (stopping)
+                return;
+            page = requests[request_head++];
+            if (request_head == requests.size())
+            {
+                requests.clear();
+                request_head = 0;
+            }
+            buffer = free_staging.back();
+            free_staging.pop_back();
+            ++loading;
+        }
+
+        // The page faults, and any disk reads, happen here rather than in a shader;
+        // the file's pages are handed back once copied, so only the cache stays resident
+        const unsigned char* src = file_page(page);
+        std::memcpy(staging.get() + buffer * page_bytes, src, page_bytes);
+        madvise(const_cast<unsigned char*>(src), header.page_stride, MADV_DONTNEED);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back({page, buffer});
+            --loading;
+        }
+        loaded.notify_all();
+    }
+}
+
+std::size_t rst::virtual_texture::victim()
+{
+    if (never_used < capacity)
+        return never_used++;
+    std::size_t oldest = pinned;
+    for (std::size_t slot = pinned + 1; slot < capacity; ++slot)
+        if (last_used[slot].load(std::memory_order_relaxed) < last_used[oldest].load(std::memory_order_relaxed))
+            oldest = slot;
+    return oldest;
+}
+
+// Called with the mutex held
+std::size_t rst::virtual_texture::commit_loaded()
+{
+    for (const loaded_page& p : completed)
+    {
+        std::size_t slot = victim();
+        if (slot_page[slot] != no_page)
+        {
+            page_table[slot_page[slot]] = -1;
+            requested[slot_page[slot]].store(0, std::memory_order_relaxed);
+            ++evictions;
+        }
+        std::memcpy(cache.get() + slot * page_bytes, staging.get() + p.staging * page_bytes, page_bytes);
+        page_table[p.page] = (std::int32_t)slot;
+        slot_page[slot] = p.page;
+        requested[p.page].store(0, std::memory_order_relaxed);
+        last_used[slot].store(epoch, std::memory_order_relaxed);
+        free_staging.push_back(p.staging);
+    }
+    std::size_t count = completed.size();
+    completed.clear();
+    if (count)
+        wake.notify_one();
+    return count;
+}
+
+std::size_t rst::virtual_texture::update(bool wait)
+{
+    if (!loader.joinable())
+        return 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    std::size_t committed = 0;
+    for (;;)
+    {
+        committed += commit_loaded();
+        bool idle = request_head == requests.size() && loading == 0;
+        if (!wait || (idle && completed.empty()))
+            break;
+        // The loader stalls once the staging pages are full, so commit as they come
+        loaded.wait(lock, [&] { return !completed.empty() || (request_head == requests.size() && loading == 0); });
+    }
+    ++epoch;
+    return committed;
+}
+
+rst::virtual_texture::statistics rst::virtual_texture::stats() const
+{
+    std::size_t resident = std::min(never_used, capacity);
+    return {capacity, resident, request_count.load(std::memory_order_relaxed), evictions};
+}
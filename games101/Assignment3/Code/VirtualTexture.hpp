@@ -0,0 +1,159 @@
+#ifndef RASTERIZER_VIRTUAL_TEXTURE_H
+#define RASTERIZER_VIRTUAL_TEXTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <eigen3/Eigen/Eigen>
+#include "MemoryAccount.hpp"
+
+namespace rst
+{
+    // On-disk layout of a preprocessed virtual texture (native endianness):
+    //
+    //   virtual_texture_header
+    //   virtual_texture_level[level_count]    full resolution first, down to 1x1
+    //   pages from header.pages_offset        page_size x page_size texels of 3 bytes,
+    //                                         row 0 at the top, each page_stride long
+    //                                         (page aligned), level after level in
+    //                                         row-major page order
+    //
+    // Texels and mips are those Texture would compute from the same image. Pages
+    // hanging over the right or bottom edge of a level are padded with zeros.
+    struct virtual_texture_header
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t width, height;
+        std::uint32_t page_size;
+        std::uint32_t level_count;
+        std::uint64_t pages_offset;
+        std::uint64_t page_stride;
+    };
+
+    struct virtual_texture_level
+    {
+        std::uint32_t width, height;
+        std::uint32_t pages_x, pages_y;
+        std::uint32_t first_page;
+        std::uint32_t reserved;
+    };
+
+    // Converts an image to a virtual texture. page_size must be a power of two.
+    bool write_virtual_texture(const std::string& image_path, const std::string& path, int page_size = 128);
+
+    // Sparse virtual texture. The file is memory-mapped and only the pages that
+    // samples touch are copied into a fixed-size physical page cache, so opening
+    // is immediate and the memory held is the cache size whatever the texture's.
+    //
+    // A sample whose page is not resident requests it and falls back to the finest
+    // coarser mip that is; the levels that fit in a single page always are. A
+    // loader thread copies requested pages out of the mapping, and update(), called
+    // between frames, moves them into the cache in place of the least recently
+    // sampled pages. Sampling may run on any number of threads, but not while
+    // update() does.
+    class virtual_texture
+    {
+    public:
+        struct statistics
+        {
+            std::size_t capacity;       // pages the cache holds
+            std::size_t resident;
+            std::size_t requests;       // misses, each page counted once until loaded
+            std::size_t evictions;
+        };
+
+        virtual_texture() = default;
+        ~virtual_texture();
+
+        virtual_texture(const virtual_texture&) = delete;
+        virtual_texture& operator=(const virtual_texture&) = delete;
+
+        // False when the file is not a virtual texture, when cache_bytes cannot
+        // hold the single-page tail of the mip chain, or when the cache would
+        // exceed the memory budget.
+        bool open(const std::string& path, std::size_t cache_bytes);
+        void close();
+
+        int width() const { return (int)header.width; }
+        int height() const { return (int)header.height; }
+        int level_count() const { return (int)levels.size(); }
+
+        // Nearest texel of level 0, as Texture::getColor(u, v)
+        Eigen::Vector3f sample(float u, float v);
+        // Bilinear samples of levels lod and lod + 1, blended
+        Eigen::Vector3f sample(float u, float v, float lod);
+
+        // Commits the pages loaded since the last call and starts a new LRU epoch.
+        // With wait it first lets every outstanding request finish, so a frame
+        // drawn again afterwards samples what the previous one asked for. Returns
+        // the number of pages committed.
+        std::size_t update(bool wait = false);
+
+        statistics stats() const;
+        const memory_account& memory_usage() const { return *account; }
+
+    private:
+        static constexpr std::uint32_t no_page = ~0u;
+        static constexpr int staging_pages = 8;
+
+        struct loaded_page
+        {
+            std::uint32_t page;
+            int staging;
+        };
+
+        // The texel's 3 bytes, or null after requesting its page
+        const unsigned char* texel(int level, int x, int y);
+        bool bilinear(int level, float u, float v, Eigen::Vector3f& color);
+        Eigen::Vector3f fallback(int level, float u, float v);
+        const unsigned char* file_page(std::uint32_t page) const;
+        std::size_t victim();
+        std::size_t commit_loaded();
+        void loader_loop();
+
+        int fd = -1;
+        char* base = nullptr;
+        std::size_t size = 0;
+        virtual_texture_header header{};
+        std::vector<virtual_texture_level> levels;
+        int page_shift = 0;
+        std::size_t page_bytes = 0;
+
+        std::unique_ptr<memory_account> account;
+        std::unique_ptr<unsigned char[]> cache;
+        std::unique_ptr<unsigned char[]> staging;
+        std::size_t capacity = 0;
+        // Slots [0, pinned) hold the single-page levels and are never evicted
+        std::size_t pinned = 0;
+        std::size_t never_used = 0;
+
+        // Virtual page -> cache slot or -1; only update() and open() write it
+        std::vector<std::int32_t> page_table;
+        std::unique_ptr<std::atomic<std::uint8_t>[]> requested;
+        std::vector<std::uint32_t> slot_page;
+        std::unique_ptr<std::atomic<std::uint32_t>[]> last_used;
+        std::uint32_t epoch = 0;
+        std::size_t evictions = 0;
+        std::atomic<std::size_t> request_count{0};
+
+        std::thread loader;
+        std::mutex mutex;
+        std::condition_variable wake, loaded;
+        // FIFO of requested pages: [request_head, size)
+        std::vector<std::uint32_t> requests;
+        std::size_t request_head = 0;
+        std::vector<int> free_staging;
+        std::vector<loaded_page> completed;
+        int loading = 0;
+        bool stopping = false;
+    };
+}
+
+#endif //RASTERIZER_VIRTUAL_TEXTURE_H
@@ -1,4 +1,10 @@
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -7,6 +13,17 @@
 #include "Shader.hpp"
 #include "Texture.hpp"
 #include "OBJ_Loader.h"
+#include "Arena.hpp"
+#include "AllocHook.hpp"
+#include "StreamMesh.hpp"
+#include "RenderDaemon.hpp"
+#include "Poster.hpp"
+#include "Progressive.hpp"
+#include "Occlusion.hpp"
+#include "SortFirst.hpp"
+#include "FramePipeline.hpp"
+#include "MemoryAccount.hpp"
+#include "VirtualTexture.hpp"
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 {
@@ -23,6 +40,19 @@ Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
     return view;
 }
 
+// Camera circling the origin by orbit degrees, looking at it from eye_pos
+Eigen::Matrix4f get_orbit_view_matrix(Eigen::Vector3f eye_pos, float orbit)
+{
+    orbit = orbit * MY_PI / 180.f;
+    Eigen::Matrix4f rotation;
+    rotation << cos(orbit), 0, -sin(orbit), 0,
+                0, 1, 0, 0,
+                sin(orbit), 0, cos(orbit), 0,
+                0, 0, 0, 1;
+
+    return get_view_matrix(eye_pos) * rotation;
+}
+
 Eigen::Matrix4f get_model_matrix(float angle)
 {
     Eigen::Matrix4f rotation;
@@ -49,13 +79,16 @@ Eigen::Matrix4f get_model_matrix(float angle)
 
 Eigen::Matrix4f get_projection_matrix(float eye_fov, float aspect_ratio, float zNear, float zFar)
 {
-    // TODO: Use the same projection matrix from the previous assignments
+    // Right-handed view space looking down -z; zNear maps to -1 and zFar to 1 in NDC
+    float t = std::tan(eye_fov * MY_PI / 360.f);
 
-}
+    Eigen::Matrix4f projection;
+    projection << 1 / (aspect_ratio * t), 0, 0, 0,
+                  0, 1 / t, 0, 0,
+                  0, 0, (zFar + zNear) / (zNear - zFar), 2 * zFar * zNear / (zNear - zFar),
+                  0, 0, -1, 0;
 
-Eigen::Vector3f vertex_shader(const vertex_shader_payload& payload)
-{
-    return payload.position;
+    return projection;
 }
 
 Eigen::Vector3f normal_fragment_shader(const fragment_shader_payload& payload)
@@ -78,13 +111,75 @@ struct light
     Eigen::Vector3f intensity;
 };
 
+// Shared by every shader; a per-fragment std::vector of these used to be the hottest
+// allocation in the program.
+static const std::array<light, 2> lights = {
+        light{{20, 20, 20}, {500, 500, 500}},
+        light{{-20, 20, 0}, {500, 500, 500}}
+};
+
+// Ray-traced occlusion through payload.scene; off unless asked for on the command line
+struct ray_traced_lighting
+{
+    int shadow_samples = 0;     // 1 casts a hard shadow, more sample an area light
+    float light_radius = 1.0f;
+    int ao_samples = 0;
+    float ao_radius = 0.5f;
+};
+
+static ray_traced_lighting ray_lighting;
+
+static std::uint32_t fragment_seed(const Eigen::Vector3f& point)
+{
+    std::uint32_t bits[3];
+    std::memcpy(bits, point.data(), sizeof(bits));
+    return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+}
+
+static float light_visibility(const fragment_shader_payload& payload, const light& light)
+{
+    if (!payload.scene || ray_lighting.shadow_samples <= 0)
+        return 1.0f;
+    float radius = ray_lighting.shadow_samples > 1 ? ray_lighting.light_radius : 0.0f;
+    return payload.scene->light_visibility(payload.view_pos, payload.normal, light.position, radius,
+                                           ray_lighting.shadow_samples, fragment_seed(payload.view_pos));
+}
+
+// Screen-space AO comes with the payload whenever the rasterizer ran a prepass
+static float ambient_visibility(const fragment_shader_payload& payload)
+{
+    if (!payload.scene || ray_lighting.ao_samples <= 0)
+        return payload.ambient_occlusion;
+    return payload.ambient_occlusion *
+           payload.scene->ambient_occlusion(payload.view_pos, payload.normal, ray_lighting.ao_radius,
+                                            ray_lighting.ao_samples, fragment_seed(payload.view_pos) ^ 0x9e3779b9u);
+}
+
+static Eigen::Vector3f blinn_phong(const light& light, const Eigen::Vector3f& ka, const Eigen::Vector3f& kd,
+                                   const Eigen::Vector3f& ks, const Eigen::Vector3f& amb_light_intensity,
+                                   const Eigen::Vector3f& eye_pos, float p,
+                                   const Eigen::Vector3f& point, const Eigen::Vector3f& normal,
+                                   float visibility = 1.0f, float ambient_visibility = 1.0f)
+{
+    Eigen::Vector3f l = light.position - point;
+    float r2 = l.squaredNorm();
+    l.normalize();
+    Eigen::Vector3f v = (eye_pos - point).normalized();
+    Eigen::Vector3f h = (l + v).normalized();
+
+    Eigen::Vector3f ambient = ka.cwiseProduct(amb_light_intensity) * ambient_visibility;
+    Eigen::Vector3f diffuse = kd.cwiseProduct(light.intensity / r2) * std::max(0.f, normal.dot(l));
+    Eigen::Vector3f specular = ks.cwiseProduct(light.intensity / r2) * std::pow(std::max(0.f, normal.dot(h)), p);
+    return ambient + (diffuse + specular) * visibility;
+}
+
 Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 {
     Eigen::Vector3f return_color = {0, 0, 0};
     if (payload.texture)
     {
-        // TODO: Get the texture value at the texture coordinates of the current fragment
-
+        return_color = payload.texture->getColor(payload.tex_coords.x(), payload.tex_coords.y(),
+                                                 payload.tex_coords_ddx, payload.tex_coords_ddy);
     }
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
@@ -93,10 +188,6 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f kd = texture_color / 255.f;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -108,11 +199,11 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
+    float ao = ambient_visibility(payload);
     for (auto& light : lights)
     {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-
+        result_color += blinn_phong(light, ka, kd, ks, amb_light_intensity, eye_pos, p, point, normal,
+                                    light_visibility(payload, light), ao);
     }
 
     return result_color * 255.f;
@@ -124,10 +215,6 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f kd = payload.color;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -138,11 +225,11 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f normal = payload.normal;
 
     Eigen::Vector3f result_color = {0, 0, 0};
+    float ao = ambient_visibility(payload);
     for (auto& light : lights)
     {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-        
+        result_color += blinn_phong(light, ka, kd, ks, amb_light_intensity, eye_pos, p, point, normal,
+                                    light_visibility(payload, light), ao);
     }
 
     return result_color * 255.f;
@@ -150,6 +237,32 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 
 
 
+// Height map value used by the bump and displacement shaders, filtered over the
+// pixel's footprint
+static float height_at(const fragment_shader_payload& payload, float u, float v)
+{
+    return payload.texture->getColor(u, v, payload.tex_coords_ddx, payload.tex_coords_ddy).norm();
+}
+
+// Finite-difference step along u and v: one texel, or the pixel footprint when
+// that is larger so minified surfaces do not alias into noise
+static Eigen::Vector2f height_step(const fragment_shader_payload& payload)
+{
+    Eigen::Vector2f texel(1.0f / payload.texture->width, 1.0f / payload.texture->height);
+    return texel.cwiseMax(payload.tex_coords_ddx.cwiseAbs()).cwiseMax(payload.tex_coords_ddy.cwiseAbs());
+}
+
+static Eigen::Matrix3f tangent_frame(const Eigen::Vector3f& n)
+{
+    float x = n.x(), y = n.y(), z = n.z();
+    float xz = std::sqrt(x * x + z * z);
+    Eigen::Vector3f t(x * y / xz, xz, z * y / xz);
+    Eigen::Vector3f b = n.cross(t);
+    Eigen::Matrix3f TBN;
+    TBN << t, b, n;
+    return TBN;
+}
+
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
 {
     
@@ -157,10 +270,6 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     Eigen::Vector3f kd = payload.color;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -171,8 +280,7 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     Eigen::Vector3f normal = payload.normal;
 
     float kh = 0.2, kn = 0.1;
-    
-    // TODO: Implement displacement mapping here
+
     // Let n = normal = (x, y, z)
     // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
     // Vector b = n cross product t
@@ -182,16 +290,28 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     // Vector ln = (-dU, -dV, 1)
     // Position p = p + kn * n * h(u,v)
     // Normal n = normalize(TBN * ln)
+    if (payload.texture)
+    {
+        Eigen::Matrix3f TBN = tangent_frame(normal);
+        float u = payload.tex_coords.x(), v = payload.tex_coords.y();
+        float w = payload.texture->width, h = payload.texture->height;
+        // Slopes stay per texel, whatever the step
+        Eigen::Vector2f step = height_step(payload);
+        float huv = height_at(payload, u, v);
+        float dU = kh * kn * (height_at(payload, u + step.x(), v) - huv) / (w * step.x());
+        float dV = kh * kn * (height_at(payload, u, v + step.y()) - huv) / (h * step.y());
+        point += kn * normal * huv;
+        normal = (TBN * Eigen::Vector3f(-dU, -dV, 1)).normalized();
+    }
 
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
+    float ao = ambient_visibility(payload);
     for (auto& light : lights)
     {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-
-
+        result_color += blinn_phong(light, ka, kd, ks, amb_light_intensity, eye_pos, p, point, normal,
+                                    light_visibility(payload, light), ao);
     }
 
     return result_color * 255.f;
@@ -205,10 +325,6 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f kd = payload.color;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -221,7 +337,6 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 
     float kh = 0.2, kn = 0.1;
 
-    // TODO: Implement bump mapping here
     // Let n = normal = (x, y, z)
     // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
     // Vector b = n cross product t
@@ -230,6 +345,18 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     // dV = kh * kn * (h(u,v+1/h)-h(u,v))
     // Vector ln = (-dU, -dV, 1)
     // Normal n = normalize(TBN * ln)
+    if (payload.texture)
+    {
+        Eigen::Matrix3f TBN = tangent_frame(normal);
+        float u = payload.tex_coords.x(), v = payload.tex_coords.y();
+        float w = payload.texture->width, h = payload.texture->height;
+        // Slopes stay per texel, whatever the step
+        Eigen::Vector2f step = height_step(payload);
+        float huv = height_at(payload, u, v);
+        float dU = kh * kn * (height_at(payload, u + step.x(), v) - huv) / (w * step.x());
+        float dV = kh * kn * (height_at(payload, u, v + step.y()) - huv) / (h * step.y());
+        normal = (TBN * Eigen::Vector3f(-dU, -dV, 1)).normalized();
+    }
 
 
     Eigen::Vector3f result_color = {0, 0, 0};
@@ -238,9 +365,402 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
+static rst::render_daemon* running_daemon = nullptr;
+
+static void stop_daemon(int)
+{
+    if (running_daemon)
+        running_daemon->stop();
+}
+
+// Flattens every loaded mesh into one indexed SoA mesh allocated from `storage`
+static rst::mesh load_mesh(const objl::Loader& loader, rst::arena& storage)
+{
+    size_t vertex_count = 0, index_count = 0;
+    for (auto& mesh : loader.LoadedMeshes)
+    {
+        vertex_count += mesh.Vertices.size();
+        index_count += mesh.Indices.size() / 3 * 3;
+    }
+
+    rst::mesh result;
+    result.vertices = rst::vertex_arrays::allocate(storage, vertex_count);
+    result.indices = storage.alloc_array<std::uint32_t>(index_count);
+    result.triangle_count = index_count / 3;
+
+    size_t base = 0, next_index = 0;
+    for (auto& mesh : loader.LoadedMeshes)
+    {
+        for (size_t i = 0; i < mesh.Vertices.size(); ++i)
+        {
+            auto& vert = mesh.Vertices[i];
+            size_t k = base + i;
+            result.vertices.px[k] = vert.Position.X;
+            result.vertices.py[k] = vert.Position.Y;
+            result.vertices.pz[k] = vert.Position.Z;
+            result.vertices.nx[k] = vert.Normal.X;
+            result.vertices.ny[k] = vert.Normal.Y;
+            result.vertices.nz[k] = vert.Normal.Z;
+            result.vertices.u[k] = vert.TextureCoordinate.X;
+            result.vertices.v[k] = vert.TextureCoordinate.Y;
+        }
+        for (size_t i = 0; i < mesh.Indices.size() / 3 * 3; ++i)
+            result.indices[next_index++] = base + mesh.Indices[i];
+        base += mesh.Vertices.size();
+    }
+    return result;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Rasterizer --bench: timings for the pieces that are not a whole frame
+static int run_benchmarks(const rst::mesh& spot)
+{
+    Eigen::Matrix4f transform = get_view_matrix({0, 0, 10}) * get_model_matrix(140);
+
+    rst::bvh scene;
+    double build_ms = 1e30, refit_ms = 1e30;
+    for (int i = 0; i < 5; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        scene.build(spot, transform);
+        build_ms = std::min(build_ms, elapsed_ms(start));
+        start = std::chrono::steady_clock::now();
+        scene.refit(spot, transform);
+        refit_ms = std::min(refit_ms, elapsed_ms(start));
+    }
+    std::cout << "bvh build: " << build_ms << " ms (" << scene.triangle_count() << " triangles, "
+              << scene.node_count() << " nodes)\n";
+    std::cout << "bvh refit: " << refit_ms << " ms\n";
+
+    // Occlusion rays leaving the surface, as the shaders cast them
+    const int points = 20000, samples = 16;
+    std::vector<Eigen::Vector3f> positions, normals;
+    for (int i = 0; i < points; ++i)
+    {
+        size_t t = (size_t)i * 7919 % spot.triangle_count;
+        Eigen::Vector3f v[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            std::uint32_t k = spot.indices[t * 3 + j];
+            Eigen::Vector4f p(spot.vertices.px[k], spot.vertices.py[k], spot.vertices.pz[k], 1.0f);
+            v[j] = (transform * p).head<3>();
+        }
+        positions.push_back((v[0] + v[1] + v[2]) / 3.0f);
+        normals.push_back((v[1] - v[0]).cross(v[2] - v[0]).normalized());
+    }
+
+    float open = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < points; ++i)
+        open += scene.ambient_occlusion(positions[i], normals[i], 0.5f, samples, i);
+    double ao_ms = elapsed_ms(start);
+    std::cout << "ao packets: " << points * samples / ao_ms / 1000.0 << " Mrays/s (" << open / points << " open)\n";
+
+    int lit = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < points; ++i)
+        lit += scene.light_visibility(positions[i], normals[i], {20, 20, 20}, 0.0f, 1, 0) > 0.0f;
+    double shadow_ms = elapsed_ms(start);
+    std::cout << "shadow rays: " << points / shadow_ms / 1000.0 << " Mrays/s (" << lit << " lit)\n";
+
+    // Occlusion culling: a grid of small spots, most of them behind a wall
+    rst::arena storage;
+    rst::mesh wall;
+    wall.vertices = rst::vertex_arrays::allocate(storage, 4);
+    wall.triangle_count = 2;
+    wall.indices = storage.alloc_array<std::uint32_t>(6);
+    const float corners[4][2] = {{-3, -2}, {3, -2}, {3, 2}, {-3, 2}};
+    const float texcoords[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    for (int i = 0; i < 4; ++i)
+    {
+        // Arena memory comes uninitialized; every attribute the draws read is set
+        wall.vertices.px[i] = corners[i][0];
+        wall.vertices.py[i] = corners[i][1];
+        wall.vertices.pz[i] = 2;
+        wall.vertices.nx[i] = 0;
+        wall.vertices.ny[i] = 0;
+        wall.vertices.nz[i] = 1;
+        wall.vertices.u[i] = texcoords[i][0];
+        wall.vertices.v[i] = texcoords[i][1];
+    }
+    const std::uint32_t quad[6] = {0, 1, 2, 0, 2, 3};
+    std::copy_n(quad, 6, wall.indices);
+
+    rst::object_bounds spot_bounds;
+    spot_bounds.min = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+    spot_bounds.max = -spot_bounds.min;
+    for (size_t i = 0; i < spot.vertices.count; ++i)
+    {
+        Eigen::Vector3f p(spot.vertices.px[i], spot.vertices.py[i], spot.vertices.pz[i]);
+        spot_bounds.min = spot_bounds.min.cwiseMin(p);
+        spot_bounds.max = spot_bounds.max.cwiseMax(p);
+    }
+    std::vector<rst::object_bounds> objects;
+    for (int z = 0; z < 4; ++z)
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            for (int x = 0; x < 8; ++x)
+            {
+                rst::object_bounds b = spot_bounds;
+                b.model = Eigen::Matrix4f::Identity();
+                b.model.topLeftCorner<3, 3>() *= 0.6f;
+                b.model.topRightCorner<3, 1>() = Eigen::Vector3f(x * 1.2f - 4.2f, y * 1.1f - 1.65f, -2.0f * z);
+                objects.push_back(b);
+            }
+        }
+    }
+
+    Eigen::Matrix4f view = get_view_matrix({0, 0, 10});
+    Eigen::Matrix4f projection = get_projection_matrix(45.0, 1, 0.1, 50);
+    rst::occlusion_culler culler(176, 176);
+    // vector<bool> is packed, so the flags live in a plain array
+    auto visible = std::make_unique<bool[]>(objects.size());
+    double cull_ms = 1e30;
+    for (int i = 0; i < 5; ++i)
+    {
+        start = std::chrono::steady_clock::now();
+        culler.begin_frame(projection * view);
+        culler.add_occluder(wall, Eigen::Matrix4f::Identity());
+        culler.cull(objects.data(), objects.size(), visible.get());
+        cull_ms = std::min(cull_ms, elapsed_ms(start));
+    }
+    const rst::occlusion_stats& stats = culler.stats();
+
+    rst::rasterizer r(700, 700);
+    r.set_fragment_shader(normal_fragment_shader);
+    r.set_view(view);
+    r.set_projection(projection);
+    auto draw_objects = [&](bool culled)
+    {
+        auto start = std::chrono::steady_clock::now();
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        r.set_model(Eigen::Matrix4f::Identity());
+        r.draw(wall);
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            if (culled && !visible[i])
+                continue;
+            r.set_model(objects[i].model);
+            r.draw(spot);
+        }
+        return elapsed_ms(start);
+    };
+    draw_objects(false);
+    double all_ms = draw_objects(false), culled_ms = draw_objects(true);
+    std::cout << "occlusion culling: " << stats.objects_occluded << " of " << stats.objects_tested
+              << " objects hidden, " << stats.objects_outside << " off screen, in " << cull_ms << " ms ("
+              << stats.raster_ms << " raster, " << stats.test_ms << " test)\n";
+    std::cout << "  drawing all: " << all_ms << " ms, drawing the rest: " << culled_ms << " ms\n";
+
+    // Depth formats on the same scene, with the same shading: what changes is the
+    // memory traffic of the depth tests and clears
+    for (rst::depth_format format : {rst::depth_format::float32, rst::depth_format::reversed_float32,
+                                     rst::depth_format::unorm24, rst::depth_format::unorm16})
+    {
+        r.set_depth_format(format);
+        draw_objects(false);
+        double ms = draw_objects(false);
+        std::cout << "  depth " << rst::to_string(format) << ": " << ms << " ms drawing all, "
+                  << rst::depth_buffer::bytes_per_pixel(format) << " bytes a pixel\n";
+    }
+    r.set_depth_format(rst::depth_format::float32);
+
+    // The same scene again, with every edge of every object over it
+    rst::arena edge_storage;
+    rst::wireframe_edges spot_edges = rst::build_wireframe_edges(spot, edge_storage);
+    auto draw_wireframes = [&](bool antialias)
+    {
+        rst::wireframe_settings settings;
+        settings.antialias = antialias;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            r.set_model(objects[i].model);
+            r.draw_wireframe(spot, spot_edges, settings);
+        }
+        return elapsed_ms(start);
+    };
+    draw_objects(false);
+    draw_wireframes(false);
+    double lines_ms = draw_wireframes(false), smooth_ms = draw_wireframes(true);
+    std::cout << "wireframe: " << spot_edges.count * objects.size() << " edges in " << lines_ms << " ms, "
+              << smooth_ms << " ms antialiased\n";
+
+    // Turntable, one frame after the other and then with the geometry of each
+    // frame overlapping the shading of the one before
+    const int frames = 24;
+    rst::rasterizer turntable(700, 700);
+    turntable.set_fragment_shader(phong_fragment_shader);
+    turntable.set_view(get_view_matrix({0, 0, 10}));
+    turntable.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+    auto record_frame = [&](int frame)
+    {
+        return [&spot, frame](rst::rasterizer& target)
+        {
+            target.set_model(get_model_matrix(140.0f + 15.0f * frame));
+            target.draw(spot);
+        };
+    };
+    std::vector<unsigned char> sequential((size_t)frames * 700 * 700 * 3), pipelined(sequential.size());
+    rst::thread_pool::global().reset_stats();
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        turntable.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        record_frame(frame)(turntable);
+        turntable.resolve(&sequential[(size_t)frame * 700 * 700 * 3]);
+    }
+    double sequential_ms = elapsed_ms(start) / frames;
+    {
+        rst::frame_pipeline pipeline(turntable);
+        start = std::chrono::steady_clock::now();
+        pipeline.submit(record_frame(0));
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            if (frame + 1 < frames)
+                pipeline.submit(record_frame(frame + 1));
+            pipeline.present(&pipelined[(size_t)frame * 700 * 700 * 3]);
+        }
+    }
+    double pipelined_ms = elapsed_ms(start) / frames;
+    std::cout << "turntable: " << sequential_ms << " ms/frame in sequence, " << pipelined_ms
+              << " ms/frame pipelined (" << (sequential == pipelined ? "same" : "different") << " images)\n";
+
+    // Load balance over both turntables: a worker well below the others starved
+    auto workers = rst::thread_pool::global().stats();
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        const auto& w = workers[i];
+        std::cout << "  " << (i + 1 < workers.size() ? "worker " + std::to_string(i) : std::string("callers")) << ": "
+                  << 100 * w.utilization << "% busy, " << w.chunks << " chunks, " << w.tasks << " tasks, "
+                  << w.steals << " steals\n";
+    }
+
+    // The turntable anti-aliased: temporally, shading each pixel once a frame, and by
+    // 2x2 supersampling, which shades four times as many (the downsample not counted)
+    auto time_turntable = [&](rst::rasterizer& target)
+    {
+        target.set_fragment_shader(phong_fragment_shader);
+        target.set_view(get_view_matrix({0, 0, 10}));
+        target.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        std::vector<unsigned char> image((size_t)target.render_width() * target.render_height() * 3);
+        start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            target.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            record_frame(frame)(target);
+            target.resolve(image.data());
+        }
+        return elapsed_ms(start) / frames;
+    };
+    turntable.set_taa(true);
+    double temporal_ms = time_turntable(turntable);
+    turntable.set_taa(false);
+    rst::rasterizer supersampled(1400, 1400);
+    double supersampled_ms = time_turntable(supersampled);
+    std::cout << "anti-aliasing: " << sequential_ms << " ms/frame without, " << temporal_ms << " ms temporal, "
+              << supersampled_ms << " ms 2x2 supersampled\n";
+    return 0;
+}
+
 int main(int argc, const char** argv)
 {
-    std::vector<Triangle*> TriangleList;
+    if (argc >= 3 && std::string(argv[1]) == "--daemon")
+    {
+        // Rasterizer --daemon <socket> [workers] [budget MiB] [report seconds]: serve render
+        // requests, see render_request
+        rst::render_daemon::config cfg;
+        cfg.socket_path = argv[2];
+        try
+        {
+            if (argc >= 4)
+                cfg.workers = std::max(1, std::stoi(argv[3]));
+            if (argc >= 5)
+                rst::set_memory_budget((size_t)std::stoul(argv[4]) << 20);
+            if (argc >= 6)
+                cfg.memory_report_seconds = std::stof(argv[5]);
+        }
+        catch (const std::logic_error&)
+        {
+            std::cerr << "Usage: " << argv[0] << " --daemon <socket> [workers] [budget MiB] [report seconds]\n";
+            return 1;
+        }
+        cfg.load_model = [](const std::string& path, rst::arena& storage, rst::mesh& result)
+        {
+            objl::Loader loader;
+            if (!loader.LoadFile(path))
+                return false;
+            result = load_mesh(loader, storage);
+            return true;
+        };
+        cfg.shaders = {
+                {"normal", normal_fragment_shader},
+                {"phong", phong_fragment_shader},
+                {"texture", texture_fragment_shader},
+                {"bump", bump_fragment_shader},
+                {"displacement", displacement_fragment_shader}
+        };
+        cfg.set_camera = [](const rst::render_request& request, rst::rasterizer& r)
+        {
+            r.set_model(get_model_matrix(request.angle));
+            r.set_view(get_view_matrix(request.eye_pos));
+            r.set_projection(get_projection_matrix(request.fov, (float)request.width / request.height, 0.1, 50));
+        };
+
+        rst::render_daemon daemon(std::move(cfg));
+        running_daemon = &daemon;
+        std::signal(SIGINT, stop_daemon);
+        std::signal(SIGTERM, stop_daemon);
+        std::signal(SIGPIPE, SIG_IGN);
+        if (!daemon.run())
+        {
+            std::cerr << "Cannot listen on " << argv[2] << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (argc >= 4 && std::string(argv[1]) == "--preprocess")
+    {
+        // Rasterizer --preprocess <in.obj> <out.rstm> [triangles per chunk]: one-off conversion
+        // to the chunked format that "--stream" renders from without holding the mesh in memory
+        objl::Loader loader;
+        rst::arena storage(1 << 20);
+        if (!loader.LoadFile(argv[2]))
+        {
+            std::cerr << "Cannot load " << argv[2] << "\n";
+            return 1;
+        }
+        size_t chunk_triangles = argc >= 5 ? std::stoul(argv[4]) : 1 << 16;
+        if (!rst::write_stream_mesh(argv[3], load_mesh(loader, storage), chunk_triangles))
+        {
+            std::cerr << "Cannot write " << argv[3] << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (argc >= 4 && std::string(argv[1]) == "--preprocess-texture")
+    {
+        // Rasterizer --preprocess-texture <image> <out.vtex> [page size]: one-off conversion
+        // to the paged format that "--vtex" samples from without loading the image
+        int page_size = argc >= 5 ? std::stoi(argv[4]) : 128;
+        if (!rst::write_virtual_texture(argv[2], argv[3], page_size))
+        {
+            std::cerr << "Cannot convert " << argv[2] << " to " << argv[3] << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // Geometry lives as long as the program
+    rst::memory_account mesh_memory("mesh spot");
+    rst::arena mesh_arena(1 << 20, &mesh_memory, rst::memory_kind::meshes);
 
     float angle = 140.0;
     bool command_line = false;
@@ -249,27 +769,47 @@ int main(int argc, const char** argv)
     objl::Loader Loader;
     std::string obj_path = "../models/spot/";
 
-    // Load .obj File
-    bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
-    for(auto mesh:Loader.LoadedMeshes)
+    // Loading runs as tasks on the shared pool, the mesh while the options are read
+    // and the texture alongside. Not ahead of --processes, whose workers have to be
+    // forked before this process starts any threads.
+    bool forking = std::any_of(argv, argv + argc, [](const char* a) { return std::strcmp(a, "--processes") == 0; });
+    rst::thread_pool* loaders = forking ? nullptr : &rst::thread_pool::global();
+    auto start_loading = [&](std::function<void()> load) -> rst::thread_pool::task
     {
-        for(int i=0;i<mesh.Vertices.size();i+=3)
-        {
-            Triangle* t = new Triangle();
-            for(int j=0;j<3;j++)
-            {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
-            }
-            TriangleList.push_back(t);
-        }
+        if (loaders)
+            return loaders->submit(std::move(load));
+        load();
+        return nullptr;
+    };
+    auto finish_loading = [&](const rst::thread_pool::task& loading)
+    {
+        if (loaders)
+            loaders->wait(loading);
+    };
+
+    rst::mesh spot;
+    auto mesh_loaded = start_loading([&]
+    {
+        Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
+        spot = load_mesh(Loader, mesh_arena);
+    });
+    // The task writes to Loader, spot and mesh_arena, so every way out of main from
+    // here on, the early returns for bad options included, waits for it first
+    struct loading_guard
+    {
+        std::function<void()> finish;
+        ~loading_guard() { finish(); }
+    } mesh_load_guard{[&] { finish_loading(mesh_loaded); }};
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench")
+    {
+        finish_loading(mesh_loaded);
+        return run_benchmarks(spot);
     }
 
     rst::rasterizer r(700, 700);
 
     auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
 
     std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
 
@@ -278,76 +818,670 @@ int main(int argc, const char** argv)
         command_line = true;
         filename = std::string(argv[1]);
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (argc >= 3 && std::string(argv[2]) == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
             active_shader = texture_fragment_shader;
             texture_path = "spot_texture.png";
-            r.set_texture(Texture(obj_path + texture_path));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (argc >= 3 && std::string(argv[2]) == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
             active_shader = normal_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (argc >= 3 && std::string(argv[2]) == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
             active_shader = phong_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (argc >= 3 && std::string(argv[2]) == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = bump_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (argc >= 3 && std::string(argv[2]) == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = displacement_fragment_shader;
         }
     }
 
-    Eigen::Vector3f eye_pos = {0,0,10};
+    // Rasterizer <output> <shader> [options]
+    //   --stream <mesh.rstm>          draw a preprocessed mesh out of core
+    //   --opacity <alpha>             draw the model transparent
+    //   --oit <lists|weighted>        how transparency is resolved (default lists)
+    //   --views <n>                   render n cameras around the model in one draw,
+    //                                 written as <output stem>_<k><ext>
+    //   --shadows <samples>           ray-traced shadows; 1 is hard, more soften them
+    //   --ao <samples>                ray-traced ambient occlusion
+    //   --ssao <radius>               screen-space ambient occlusion from a depth prepass
+    //   --poster <width>x<height>     render at any size in bounded memory, streaming
+    //                                 the rows to a PNG or (.tif) TIFF
+    //   --progressive <samples>       interactive viewer that previews at low resolution
+    //                                 and refines with jittered samples while idle
+    //   --vrs <1x2|2x2|4x4|auto>      shade once per block of pixels; auto picks the
+    //                                 rate per tile from the previous frame
+    //   --heatmaps on                 also write depth test, fragment and shader cycle
+    //                                 heatmaps as <output stem>_<counter><ext>
+    //   --processes <n>               split the frame over n worker processes sharing
+    //                                 a framebuffer; needs --stream
+    //   --memory-budget <MiB>         optional buffers, textures and render targets that
+    //                                 would take the process past this are left out
+    //   --memory-report <text|json>   print memory use per rasterizer and asset when
+    //                                 done, or every few seconds while interactive
+    //   --vtex <texture.vtex>         sample a preprocessed virtual texture instead of
+    //                                 the image, paging it in as it is seen
+    //   --vtex-cache <MiB>            physical page cache of the virtual texture
+    //                                 (default 16)
+    //   --wireframe <on|aa>           overlay the mesh edges, depth tested against the
+    //                                 shaded surface; aa antialiases them
+    //   --depth <float32|reversed|unorm24|unorm16>
+    //                                 depth buffer format (default float32)
+    //   --pin <compact|spread>        pin the worker threads to CPUs, filling one NUMA
+    //                                 node at a time or alternating between them; with
+    //                                 --processes each process gets its own CPUs
+    //   --taa on                      temporal anti-aliasing: jittered frames blended
+    //                                 with their reprojected history; 'r' resets it.
+    //                                 Ignored for --poster
+    rst::stream_mesh streamed;
+    std::string stream_path;
+    bool streaming = false;
+    int processes = 0;
+    int view_count = 1;
+    float ssao_radius = 0.0f;
+    int poster_width = 0, poster_height = 0;
+    int progressive_samples = 0;
+    std::string shading_rate = "1x1";
+    bool heatmaps = false;
+    std::string memory_report;
+    std::string vtex_path;
+    size_t vtex_cache_mib = 16;
+    std::string wireframe;
+    bool pin = false;
+    rst::depth_format depth_format = rst::depth_format::float32;
+    bool taa = false;
+    float opacity = 1.0f;
+    rst::transparency oit_mode = rst::transparency::fragment_lists;
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        std::string option = argv[i], value = argv[i + 1];
+        if (option == "--stream")
+        {
+            if (!streamed.open(value))
+            {
+                std::cerr << "Cannot open streamed mesh " << value << "\n";
+                return 1;
+            }
+            streaming = true;
+            stream_path = value;
+        }
+        else if (option == "--opacity")
+        {
+            opacity = std::stof(value);
+        }
+        else if (option == "--oit")
+        {
+            oit_mode = value == "weighted" ? rst::transparency::weighted_blended : rst::transparency::fragment_lists;
+        }
+        else if (option == "--views")
+        {
+            view_count = std::max(1, std::stoi(value));
+        }
+        else if (option == "--shadows")
+        {
+            ray_lighting.shadow_samples = std::stoi(value);
+        }
+        else if (option == "--ao")
+        {
+            ray_lighting.ao_samples = std::stoi(value);
+        }
+        else if (option == "--ssao")
+        {
+            ssao_radius = std::stof(value);
+        }
+        else if (option == "--progressive")
+        {
+            progressive_samples = std::max(1, std::stoi(value));
+            command_line = false;
+        }
+        else if (option == "--vrs")
+        {
+            if (value != "1x1" && value != "1x2" && value != "2x2" && value != "4x4" && value != "auto")
+            {
+                std::cerr << "Bad shading rate " << value << "\n";
+                return 1;
+            }
+            shading_rate = value;
+        }
+        else if (option == "--processes")
+        {
+            processes = std::max(1, std::stoi(value));
+        }
+        else if (option == "--heatmaps")
+        {
+            heatmaps = value == "on";
+        }
+        else if (option == "--vtex")
+        {
+            vtex_path = value;
+        }
+        else if (option == "--vtex-cache")
+        {
+            vtex_cache_mib = std::max(1ul, std::stoul(value));
+        }
+        else if (option == "--wireframe")
+        {
+            if (value != "on" && value != "aa")
+            {
+                std::cerr << "Bad wireframe mode " << value << "\n";
+                return 1;
+            }
+            wireframe = value;
+        }
+        else if (option == "--depth")
+        {
+            const rst::depth_format formats[] = {rst::depth_format::float32, rst::depth_format::reversed_float32,
+                                                 rst::depth_format::unorm24, rst::depth_format::unorm16};
+            auto found = std::find_if(std::begin(formats), std::end(formats),
+                                      [&](rst::depth_format f) { return value == rst::to_string(f); });
+            if (found == std::end(formats))
+            {
+                std::cerr << "Bad depth format " << value << "\n";
+                return 1;
+            }
+            depth_format = *found;
+        }
+        else if (option == "--pin")
+        {
+            if (value != "compact" && value != "spread")
+            {
+                std::cerr << "Bad placement " << value << "\n";
+                return 1;
+            }
+            pin = true;
+            if (loaders && !loaders->pin(value == "compact" ? rst::thread_pool::placement::compact
+                                                            : rst::thread_pool::placement::spread))
+                std::cerr << "Cannot pin the worker threads\n";
+        }
+        else if (option == "--taa")
+        {
+            taa = value == "on";
+        }
+        else if (option == "--memory-budget")
+        {
+            rst::set_memory_budget((size_t)std::stoul(value) << 20);
+        }
+        else if (option == "--memory-report")
+        {
+            if (value != "text" && value != "json")
+            {
+                std::cerr << "Bad memory report format " << value << "\n";
+                return 1;
+            }
+            memory_report = value;
+        }
+        else if (option == "--poster")
+        {
+            if (std::sscanf(value.c_str(), "%dx%d", &poster_width, &poster_height) != 2 ||
+                poster_width <= 0 || poster_height <= 0)
+            {
+                std::cerr << "Bad poster size " << value << "\n";
+                return 1;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown option " << option << "\n";
+            return 1;
+        }
+    }
+    // Shadow and occlusion rays run against the in-memory mesh, placed in view space
+    // like the lights are
+    rst::bvh scene;
+    bool ray_traced = (ray_lighting.shadow_samples > 0 || ray_lighting.ao_samples > 0) && !streaming;
+
+    // Shared by every target; pages come in between frames, see draw_complete
+    std::shared_ptr<rst::virtual_texture> virtual_pages;
+    if (!vtex_path.empty())
+    {
+        if (processes > 0 || progressive_samples > 0)
+        {
+            std::cerr << "--vtex works with a single process rendering whole frames\n";
+            return 1;
+        }
+        virtual_pages = std::make_shared<rst::virtual_texture>();
+        if (!virtual_pages->open(vtex_path, vtex_cache_mib << 20))
+        {
+            std::cerr << "Cannot open virtual texture " << vtex_path << "\n";
+            return 1;
+        }
+    }
 
-    r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+    std::shared_ptr<Texture> decoded;
+    auto texture_decoded = start_loading([&]
+    {
+        if (!virtual_pages)
+            decoded = std::make_shared<Texture>(obj_path + texture_path);
+    });
+    finish_loading(mesh_loaded);
+    finish_loading(texture_decoded);
+
+    // Edges are shared by the triangles on either side, so each is listed once
+    rst::wireframe_edges edges;
+    rst::wireframe_settings wireframe_style;
+    if (!wireframe.empty())
+    {
+        if (streaming)
+        {
+            std::cerr << "--wireframe needs an in-memory mesh\n";
+            return 1;
+        }
+        edges = rst::build_wireframe_edges(spot, mesh_arena);
+        wireframe_style.antialias = wireframe == "aa";
+    }
+
+    // Everything but the camera, for the main target and any extra ones
+    auto configure = [&](rst::rasterizer& target)
+    {
+        // Copies share the decoded pixels
+        Texture texture = virtual_pages ? Texture(virtual_pages) : *decoded;
+        if (texture.width > 0)
+            target.set_texture(texture);
+        else
+            std::cerr << "Texture left out: over the memory budget\n";
+        target.set_fragment_shader(active_shader);
+        if (!target.set_depth_format(depth_format))
+            std::cerr << "Depth format " << rst::to_string(depth_format) << " left out: over the memory budget\n";
+        if (opacity < 1.0f)
+        {
+            if (!target.set_transparency(oit_mode))
+                std::cerr << "Transparency left out: over the memory budget\n";
+            target.set_opacity(opacity);
+        }
+        if (ray_traced)
+            target.set_scene(&scene);
+        if (ssao_radius > 0.0f)
+        {
+            rst::ssao_settings settings;
+            settings.radius = ssao_radius;
+            if (!target.set_ssao(true, settings))
+                std::cerr << "SSAO left out: over the memory budget\n";
+        }
+        // The progressive viewer jitters the samples it accumulates itself
+        if (taa && progressive_samples == 0 && !target.set_taa(true))
+            std::cerr << "TAA left out: over the memory budget\n";
+        if (shading_rate == "auto")
+            target.set_adaptive_shading(true);
+        else if (shading_rate == "1x2")
+            target.set_shading_rate(rst::shading_rate::r1x2);
+        else if (shading_rate == "2x2")
+            target.set_shading_rate(rst::shading_rate::r2x2);
+        else if (shading_rate == "4x4")
+            target.set_shading_rate(rst::shading_rate::r4x4);
+    };
+    configure(r);
+
+    auto draw_geometry = [&](rst::rasterizer& target)
+    {
+        if (streaming)
+            target.draw(streamed);
+        else
+            target.draw(spot);
+    };
+    auto draw_scene = [&](rst::rasterizer& target)
+    {
+        if (ssao_radius > 0.0f)
+        {
+            target.begin_prepass();
+            draw_geometry(target);
+            target.end_prepass();
+        }
+        draw_geometry(target);
+        if (edges.count > 0)
+            target.draw_wireframe(spot, edges, wireframe_style);
+    };
+    // Draws again while the last draw brought in virtual texture pages, so a single
+    // image comes out at full detail rather than from the resident fallback mips
+    auto draw_complete = [&](rst::rasterizer& target)
+    {
+        draw_scene(target);
+        for (int pass = 0; virtual_pages && pass < 8 && virtual_pages->update(true) > 0; ++pass)
+        {
+            target.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            draw_scene(target);
+        }
+    };
+
+    Eigen::Vector3f eye_pos = {0,0,10};
 
     int key = 0;
     int frame_count = 0;
 
+    auto print_memory_report = [&](std::ostream& out)
+    {
+        out << (memory_report == "json" ? rst::memory_report_json() + "\n" : rst::memory_report());
+    };
+    auto last_memory_report = std::chrono::steady_clock::now();
+    auto report_memory_now_and_then = [&]
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (memory_report.empty() || now - last_memory_report < std::chrono::seconds(5))
+            return;
+        last_memory_report = now;
+        print_memory_report(std::cerr);
+    };
+
+    if (command_line && processes > 0)
+    {
+        if (!streaming)
+        {
+            std::cerr << "--processes needs a --stream mesh\n";
+            return 1;
+        }
+
+        // Started before anything here runs on the thread pool; see start()
+        rst::sort_first_renderer::config cfg;
+        cfg.width = 700;
+        cfg.height = 700;
+        cfg.workers = processes;
+        cfg.mesh_path = stream_path;
+        cfg.configure = configure;
+        cfg.pin_workers = pin;
+        rst::sort_first_renderer renderer(cfg);
+        if (!renderer.start())
+        {
+            std::cerr << "Cannot start " << processes << " worker processes\n";
+            return 1;
+        }
+        // A few frames give the bands time to even out
+        for (int frame = 0; frame < 4; ++frame)
+        {
+            if (!renderer.render(get_model_matrix(angle), get_view_matrix(eye_pos),
+                                 get_projection_matrix(45.0, 1, 0.1, 50)))
+            {
+                std::cerr << "A worker process failed\n";
+                return 1;
+            }
+            std::cout << "frame " << frame << ":";
+            for (const auto& band : renderer.bands())
+                std::cout << " " << band.rows << " rows " << band.ms << " ms;";
+            std::cout << "\n";
+        }
+        cv::Mat image(700, 700, CV_8UC3, const_cast<unsigned char*>(renderer.image()));
+        cv::imwrite(filename, image);
+        return 0;
+    }
+
+    if (command_line && poster_width > 0)
+    {
+        // Region size bounds the memory; the image itself never exists in full
+        rst::rasterizer region(1024, 256);
+        configure(region);
+        region.set_model(get_model_matrix(angle));
+        region.set_view(get_view_matrix(eye_pos));
+        if (ray_traced)
+            scene.build(spot, get_view_matrix(eye_pos) * get_model_matrix(angle));
+
+        auto writer = rst::make_row_writer(filename);
+        if (!writer->open(filename, poster_width, poster_height))
+        {
+            std::cerr << "Cannot write " << filename << "\n";
+            return 1;
+        }
+        Eigen::Matrix4f projection = get_projection_matrix(45.0, (float)poster_width / poster_height, 0.1, 50);
+        if (!rst::render_poster(region, projection, poster_width, poster_height, draw_complete, *writer))
+        {
+            std::cerr << "Writing " << filename << " failed\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (command_line && view_count > 1)
+    {
+        if (streaming)
+        {
+            std::cerr << "--views needs an in-memory mesh\n";
+            return 1;
+        }
+
+        // One target per camera; the mesh is transformed for all of them at once
+        std::vector<std::unique_ptr<rst::rasterizer>> views;
+        std::vector<rst::rasterizer*> targets;
+        for (int k = 0; k < view_count; ++k)
+        {
+            views.push_back(std::make_unique<rst::rasterizer>(700, 700));
+            rst::rasterizer& v = *views.back();
+            configure(v);
+            v.set_scene(nullptr);
+            v.set_ssao(false);
+            v.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            v.set_model(get_model_matrix(angle));
+            v.set_view(get_orbit_view_matrix(eye_pos, 360.0f * k / view_count));
+            v.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+            targets.push_back(&v);
+        }
+
+        auto draw_views = [&]
+        {
+            rst::rasterizer::draw_multiview(spot, targets.data(), targets.size());
+            for (rst::rasterizer* v : targets)
+            {
+                if (edges.count > 0)
+                    v->draw_wireframe(spot, edges, wireframe_style);
+            }
+        };
+        draw_views();
+        for (int pass = 0; virtual_pages && pass < 8 && virtual_pages->update(true) > 0; ++pass)
+        {
+            for (rst::rasterizer* v : targets)
+                v->clear(rst::Buffers::Color | rst::Buffers::Depth);
+            draw_views();
+        }
+
+        size_t dot = filename.find_last_of('.');
+        std::string stem = filename.substr(0, dot), ext = dot == std::string::npos ? ".png" : filename.substr(dot);
+        cv::Mat image(700, 700, CV_8UC3);
+        for (int k = 0; k < view_count; ++k)
+        {
+            views[k]->resolve(image.data);
+            cv::imwrite(stem + "_" + std::to_string(k) + ext, image);
+        }
+        return 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        if (ray_traced)
+            scene.build(spot, get_view_matrix(eye_pos) * get_model_matrix(angle));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image(700, 700, CV_8UC3);
+        if (!r.set_pixel_stats(heatmaps))
+        {
+            std::cerr << "Heatmaps left out: over the memory budget\n";
+            heatmaps = false;
+        }
+        if (shading_rate == "auto")
+        {
+            // Adaptive rates come from the previous image, so render one to start from
+            draw_scene(r);
+            r.resolve(image.data);
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        }
+        draw_complete(r);
+        if (virtual_pages)
+        {
+            auto vt = virtual_pages->stats();
+            std::cout << "virtual texture: " << vt.resident << " of " << vt.capacity << " pages resident, "
+                      << vt.requests << " requested, " << vt.evictions << " evicted\n";
+        }
+
+        if (rst::alloc_hook::enabled())
+        {
+            // Arenas grow during the first frame and fold into one block on the next
+            // reset; from the third frame on nothing may touch the heap
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            draw_scene(r);
+            size_t before = rst::alloc_hook::allocations();
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            draw_scene(r);
+            size_t steady = rst::alloc_hook::allocations() - before;
+            std::cout << "Heap allocations in steady-state frame: " << steady << "\n";
+            if (steady != 0)
+                return 1;
+        }
+
+        // Temporal anti-aliasing converges over frames of the still camera, two per
+        // jitter offset, before the one written out
+        for (int frame = 0; taa && frame < 2 * rst::taa_settings().jitter_period; ++frame)
+        {
+            r.resolve(image.data);
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            draw_scene(r);
+        }
+        r.resolve(image.data);
 
         cv::imwrite(filename, image);
 
+        if (heatmaps)
+        {
+            // Counters are per internal pixel, which is the output pixel here
+            size_t dot = filename.find_last_of('.');
+            std::string stem = filename.substr(0, dot), ext = dot == std::string::npos ? ".png" : filename.substr(dot);
+            const rst::pixel_stats& stats = r.pixel_statistics();
+            const std::pair<rst::heatmap, const char*> maps[] = {{rst::heatmap::depth_tests, "depth_tests"},
+                                                                 {rst::heatmap::fragments, "fragments"},
+                                                                 {rst::heatmap::cycles, "cycles"}};
+            for (const auto& [which, name] : maps)
+            {
+                double full = rst::write_heatmap(stats, which, image.data);
+                cv::imwrite(stem + "_" + name + ext, image);
+                std::cout << name << " heatmap: red at " << full << "\n";
+            }
+        }
+
+        if (!memory_report.empty())
+            print_memory_report(std::cout);
+        return 0;
+    }
+
+    if (progressive_samples > 0)
+    {
+        // The viewer only shows what the worker publishes and restarts it on input,
+        // so a key press costs at most one tile of the pass in flight
+        rst::progressive_renderer progressive(r, 700, 700, progressive_samples);
+        auto restart = [&]
+        {
+            float frame_angle = angle;
+            progressive.restart([&, frame_angle](rst::rasterizer& target)
+            {
+                target.set_model(get_model_matrix(frame_angle));
+                target.set_view(get_view_matrix(eye_pos));
+                target.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+                if (ray_traced)
+                    scene.refit(spot, get_view_matrix(eye_pos) * get_model_matrix(frame_angle));
+            }, draw_scene);
+        };
+        restart();
+
+        cv::Mat image(700, 700, CV_8UC3, cv::Scalar(0, 0, 0));
+        int shown = -1;
+        while (key != 27)
+        {
+            int samples = progressive.latest(image.data);
+            if (samples != shown)
+            {
+                cv::imshow("image", image);
+                shown = samples;
+                if (samples == progressive_samples)
+                    cv::imwrite(filename, image);
+            }
+            report_memory_now_and_then();
+            key = cv::waitKey(10);
+
+            if (key == 'a' || key == 'd')
+            {
+                angle += key == 'a' ? -0.1 : 0.1;
+                restart();
+            }
+        }
+        return 0;
+    }
+
+    // Hold ~30 fps interactively by trading resolution for shading cost
+    r.set_dynamic_resolution(true, 1000.0f / 30);
+
+    cv::Mat image(700, 700, CV_8UC3);
+    // The geometry of the next frame is recorded while this one is shaded. Not with
+    // a ray-traced scene, which is refitted for every frame while the shaders read
+    // it, nor with SSAO, whose prepass has to finish before the frame is shaded, nor
+    // with the wireframe overlay, which draws straight into the finished frame, nor
+    // with TAA, which picks the jitter of the next frame when resolving this one,
+    // nor with a streamed mesh, whose chunks a recording would all keep at once.
+    if (!ray_traced && ssao_radius <= 0.0f && edges.count == 0 && !taa && !streaming)
+    {
+        rst::frame_pipeline pipeline(r);
+        auto submit = [&]
+        {
+            float frame_angle = angle;
+            pipeline.submit([&, frame_angle](rst::rasterizer& target)
+            {
+                target.set_model(get_model_matrix(frame_angle));
+                target.set_view(get_view_matrix(eye_pos));
+                target.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+                draw_geometry(target);
+            });
+        };
+        submit();
+        while (key != 27)
+        {
+            auto frame_start = std::chrono::steady_clock::now();
+            submit();
+            pipeline.present(image.data);
+            // Nothing samples textures until the next present
+            if (virtual_pages)
+                virtual_pages->update();
+            pipeline.end_frame(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+
+            cv::imshow("image", image);
+            cv::imwrite(filename, image);
+            report_memory_now_and_then();
+            key = cv::waitKey(10);
+
+            if (key == 'a')
+                angle -= 0.1;
+            else if (key == 'd')
+                angle += 0.1;
+        }
         return 0;
     }
 
     while(key != 27)
     {
+        auto frame_start = std::chrono::steady_clock::now();
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        // Only the model turns, so the tree keeps its topology
+        if (ray_traced)
+            scene.refit(spot, get_view_matrix(eye_pos) * get_model_matrix(angle));
 
         //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        draw_scene(r);
+        r.resolve(image.data);
+        if (virtual_pages)
+            virtual_pages->update();
+        r.end_frame(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
 
         cv::imshow("image", image);
         cv::imwrite(filename, image);
+        report_memory_now_and_then();
         key = cv::waitKey(10);
 
         if (key == 'a' )
@@ -358,6 +1492,10 @@ int main(int argc, const char** argv)
         {
             angle += 0.1;
         }
+        else if (key == 'r')
+        {
+            r.reset_history();
+        }
 
     }
     return 0;
@@ -3,15 +3,26 @@
 //
 
 #include <algorithm>
+#include <tuple>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
 
+template <typename T>
+static void store_buffer(std::vector<std::vector<T>>& bufs, int id, const std::vector<T>& data)
+{
+    if ((int)bufs.size() <= id)
+        bufs.resize(id + 1);
+    bufs[id] = data;
+}
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
     auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    store_buffer(pos_buf, id, positions);
 
     return {id};
 }
@@ -19,7 +30,7 @@ rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
     auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    store_buffer(ind_buf, id, indices);
 
     return {id};
 }
@@ -27,7 +38,7 @@ rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i>
 rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
 {
     auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    store_buffer(col_buf, id, cols);
 
     return {id};
 }
@@ -35,7 +46,7 @@ rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f>
 rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
 {
     auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    store_buffer(nor_buf, id, normals);
 
     normal_id = id;
 
@@ -43,105 +54,301 @@ rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>
 }
 
 
-// Bresenham's line drawing algorithm
+// A line after projection: screen-space endpoints plus 1/w and z/w at each, which
+// are affine in screen space, so clipping and stepping can interpolate them
+// linearly and still recover the perspective-correct depth as z/w / (1/w)
+struct rst::rasterizer::screen_line
+{
+    float x0, y0, x1, y1;
+    float q0, q1;
+    float zq0, zq1;
+};
+
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
 {
-    auto x1 = begin.x();
-    auto y1 = begin.y();
-    auto x2 = end.x();
-    auto y2 = end.y();
+    screen_line line{begin.x(), begin.y(), end.x(), end.y(), 1.0f, 1.0f, begin.z(), end.z()};
+    if (!clip_to_target(line))
+        return;
+    wireframe_settings settings;
+    settings.depth_test = false;
+    rasterize_line<false>(line, 0, height, settings);
+}
 
-    Eigen::Vector3f line_color = {255, 255, 255};
+// Liang-Barsky against [0, width] x [0, height]
+bool rst::rasterizer::clip_to_target(screen_line& line) const
+{
+    float dx = line.x1 - line.x0, dy = line.y1 - line.y0;
+    float t0 = 0.0f, t1 = 1.0f;
+    const float p[4] = {-dx, dx, -dy, dy};
+    const float q[4] = {line.x0, width - line.x0, line.y0, height - line.y0};
+    for (int i = 0; i < 4; ++i)
+    {
+        if (p[i] == 0.0f)
+        {
+            if (q[i] < 0.0f)
+                return false;
+            continue;
+        }
+        float t = q[i] / p[i];
+        if (p[i] < 0.0f)
+            t0 = std::max(t0, t);
+        else
+            t1 = std::min(t1, t);
+    }
+    if (t0 > t1)
+        return false;
 
-    int x,y,dx,dy,dx1,dy1,px,py,xe,ye,i;
+    screen_line in = line;
+    auto at = [](float a, float b, float t) { return a + (b - a) * t; };
+    line.x0 = at(in.x0, in.x1, t0);
+    line.y0 = at(in.y0, in.y1, t0);
+    line.q0 = at(in.q0, in.q1, t0);
+    line.zq0 = at(in.zq0, in.zq1, t0);
+    line.x1 = at(in.x0, in.x1, t1);
+    line.y1 = at(in.y0, in.y1, t1);
+    line.q1 = at(in.q0, in.q1, t1);
+    line.zq1 = at(in.zq0, in.zq1, t1);
+    return true;
+}
 
-    dx=x2-x1;
-    dy=y2-y1;
-    dx1=fabs(dx);
-    dy1=fabs(dy);
-    px=2*dy1-dx1;
-    py=2*dx1-dy1;
+// The line is walked along its major axis in spans that keep to one row (or
+// column) and one tile: a span settles its tile's clear state and pixel index
+// once, then steps the index along the buffer. Pixels are those whose centre on
+// the major axis the line passes; the minor coordinate picks one row (or
+// column), or with Antialias the two nearest, weighted by how close the line
+// runs to each.
+template <bool Antialias>
+void rst::rasterizer::rasterize_line(const screen_line& line, int row_begin, int row_end,
+                                     const wireframe_settings& settings)
+{
+    bool x_major = std::abs(line.x1 - line.x0) >= std::abs(line.y1 - line.y0);
+    float a0 = x_major ? line.x0 : line.y0, a1 = x_major ? line.x1 : line.y1;
+    float b0 = x_major ? line.y0 : line.x0, b1 = x_major ? line.y1 : line.x1;
+    float q0 = line.q0, q1 = line.q1, z0 = line.zq0, z1 = line.zq1;
+    if (a1 < a0)
+    {
+        std::swap(a0, a1);
+        std::swap(b0, b1);
+        std::swap(q0, q1);
+        std::swap(z0, z1);
+    }
+    float length = a1 - a0;
+    if (!(length > 0.0f))
+        return;
+    float slope = (b1 - b0) / length;
 
-    if(dy1<=dx1)
+    // Major-axis pixels whose centres the line covers, narrowed to the rows given
+    int first = std::max(0, (int)std::ceil(a0 - 0.5f));
+    int last = std::min((x_major ? width : height) - 1, (int)std::ceil(a1 - 0.5f) - 1);
+    if (!x_major)
     {
-        if(dx>=0)
-        {
-            x=x1;
-            y=y1;
-            xe=x2;
-        }
+        first = std::max(first, row_begin);
+        last = std::min(last, row_end - 1);
+    }
+    else if (slope != 0.0f)
+    {
+        // Columns where the line is within a pixel of the rows
+        float enter = a0 + ((slope > 0 ? row_begin - 1 : row_end + 1) - b0) / slope - 0.5f;
+        float leave = a0 + ((slope > 0 ? row_end + 1 : row_begin - 1) - b0) / slope - 0.5f;
+        first = std::max(first, (int)std::floor(std::clamp(enter, -1.0f, (float)width)));
+        last = std::min(last, (int)std::ceil(std::clamp(leave, -1.0f, (float)width)));
+    }
+    else if (b0 < row_begin - 1 || b0 > row_end + 1)
+        return;
+
+    int minor_limit = x_major ? height : width;
+    // Rows are stored top first, so a step up is a step back through the buffer
+    int step = x_major ? 1 : -width;
+    const Eigen::Vector3f& color = settings.color;
+
+    // The pixels of a span on one row (or column)
+    struct lane
+    {
+        bool live;
+        int index;
+        bool depth_cleared;
+        std::uint32_t clear_depth;
+    };
+    auto open = [&](int a, int b) -> lane
+    {
+        int x = x_major ? a : b, y = x_major ? b : a;
+        if (b < 0 || b >= minor_limit || y < row_begin || y >= row_end)
+            return {false, 0, false, 0};
+        tile_state& tile = tiles[(y / tile_size) * tiles_x + x / tile_size];
+        if (tile.color_cleared)
+            materialize_color(x / tile_size, y / tile_size);
+        return {true, get_index(x, y), tile.depth_cleared, tile.clear_depth};
+    };
+    auto write = [&](const lane& l, int offset, float weight, float depth)
+    {
+        int index = l.index + offset;
+        if (weight <= 0.0f || (settings.depth_test &&
+            !(depth_buf.key(depth - settings.depth_bias) < (l.depth_cleared ? l.clear_depth : depth_buf.load(index)))))
+            return;
+        Eigen::Vector3f& pixel = frame_buf[index];
+        if constexpr (Antialias)
+            pixel += (color - pixel) * weight;
         else
+            pixel = color;
+    };
+
+    float inv_length = 1.0f / length;
+    auto minor_at = [&](int a) { return b0 + slope * (a + 0.5f - a0); };
+    auto lane_of = [](float b) { return (int)std::floor(Antialias ? b - 0.5f : b); };
+    for (int a = first; a <= last;)
+    {
+        float b = minor_at(a);
+        int base = lane_of(b);
+        int stop = std::min(last, (a / tile_size + 1) * tile_size - 1);
+        lane lower = open(a, base), upper{};
+        if constexpr (Antialias)
+            upper = open(a, base + 1);
+        for (int offset = 0;; offset += step)
         {
-            x=x2;
-            y=y2;
-            xe=x1;
-        }
-        Eigen::Vector2i point = Eigen::Vector2i(x, y);
-        set_pixel(point,line_color);
-        for(i=0;x<xe;i++)
-        {
-            x=x+1;
-            if(px<0)
+            float t = (a + 0.5f - a0) * inv_length;
+            float depth = (z0 + (z1 - z0) * t) / (q0 + (q1 - q0) * t);
+            if constexpr (Antialias)
             {
-                px=px+2*dy1;
-            }
-            else
-            {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    y=y+1;
-                }
-                else
-                {
-                    y=y-1;
-                }
-                px=px+2*(dy1-dx1);
+                float above = b - 0.5f - base;
+                if (lower.live)
+                    write(lower, offset, 1.0f - above, depth);
+                if (upper.live)
+                    write(upper, offset, above, depth);
             }
-//            delay(0);
-            Eigen::Vector2i point = Eigen::Vector2i(x, y);
-            set_pixel(point,line_color);
+            else if (lower.live)
+                write(lower, offset, 1.0f, depth);
+
+            if (++a > stop)
+                break;
+            b = minor_at(a);
+            if (lane_of(b) != base)
+                break;
         }
     }
-    else
+}
+
+void rst::rasterizer::rasterize_lines(const screen_line* lines, size_t count, const wireframe_settings& settings)
+{
+    // Binned to bands of one tile row, the unit of work; a line is listed in
+    // every band its rows, widened by the antialiasing neighbour, reach
+    auto band_range = [&](const screen_line& l, int& begin, int& end)
+    {
+        float lo = std::min(l.y0, l.y1) - 1.0f, hi = std::max(l.y0, l.y1) + 1.0f;
+        begin = std::clamp((int)lo / tile_size, 0, tiles_y - 1);
+        end = std::clamp((int)hi / tile_size, 0, tiles_y - 1) + 1;
+    };
+    auto* offsets = frame_arena.alloc_array<std::uint32_t>(tiles_y + 1);
+    std::fill_n(offsets, tiles_y + 1, 0u);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int begin, end;
+        band_range(lines[i], begin, end);
+        for (int b = begin; b < end; ++b)
+            ++offsets[b + 1];
+    }
+    for (int b = 0; b < tiles_y; ++b)
+        offsets[b + 1] += offsets[b];
+    auto* entries = frame_arena.alloc_array<std::uint32_t>(offsets[tiles_y]);
+    auto* fill = frame_arena.alloc_array<std::uint32_t>(tiles_y);
+    std::copy_n(offsets, tiles_y, fill);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int begin, end;
+        band_range(lines[i], begin, end);
+        for (int b = begin; b < end; ++b)
+            entries[fill[b]++] = (std::uint32_t)i;
+    }
+
+    thread_pool::global().parallel_for(tiles_y, 1, [&](size_t begin, size_t end)
     {
-        if(dy>=0)
+        for (size_t b = begin; b < end && !cancelled(); ++b)
         {
-            x=x1;
-            y=y1;
-            ye=y2;
+            int row_begin = (int)b * tile_size, row_end = std::min(height, row_begin + tile_size);
+            for (std::uint32_t e = offsets[b]; e < offsets[b + 1]; ++e)
+            {
+                if (settings.antialias)
+                    rasterize_line<true>(lines[entries[e]], row_begin, row_end, settings);
+                else
+                    rasterize_line<false>(lines[entries[e]], row_begin, row_end, settings);
+            }
         }
-        else
+    });
+}
+
+rst::wireframe_edges rst::build_wireframe_edges(const mesh& m, arena& storage)
+{
+    std::vector<std::uint64_t> keys;
+    keys.reserve(m.triangle_count * 3);
+    for (size_t k = 0; k < m.triangle_count; ++k)
+    {
+        for (int j = 0; j < 3; ++j)
         {
-            x=x2;
-            y=y2;
-            ye=y1;
+            std::uint64_t a = m.indices ? m.indices[k * 3 + j] : k * 3 + j;
+            std::uint64_t b = m.indices ? m.indices[k * 3 + (j + 1) % 3] : k * 3 + (j + 1) % 3;
+            if (a == b)
+                continue;
+            keys.push_back(std::min(a, b) << 32 | std::max(a, b));
         }
-        Eigen::Vector2i point = Eigen::Vector2i(x, y);
-        set_pixel(point,line_color);
-        for(i=0;y<ye;i++)
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    wireframe_edges edges;
+    auto* pairs = storage.alloc_array<std::uint32_t>(keys.size() * 2);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        pairs[i * 2] = (std::uint32_t)(keys[i] >> 32);
+        pairs[i * 2 + 1] = (std::uint32_t)keys[i];
+    }
+    edges.vertex_pairs = pairs;
+    edges.count = keys.size();
+    return edges;
+}
+
+void rst::rasterizer::draw_wireframe(const mesh& m, const wireframe_edges& edges, const wireframe_settings& settings)
+{
+    // The frame arena is free even while recording: recorded draws use their own
+    frame_arena.reset();
+    auto out = vertex_outputs::allocate(frame_arena, m.vertices.count);
+    run_vertex_stage(camera_uniforms(), m.vertices, out);
+
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+    // Clipped at a w just in front of the eye, then to the target; a zero-length
+    // result marks an edge that is not visible at all
+    constexpr float min_w = 1e-3f;
+    auto* lines = frame_arena.alloc_array<screen_line>(edges.count);
+    thread_pool::global().parallel_for(edges.count, 4096, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
         {
-            y=y+1;
-            if(py<=0)
+            std::uint32_t e[2] = {edges.vertex_pairs[i * 2], edges.vertex_pairs[i * 2 + 1]};
+            Eigen::Vector4f c[2];
+            for (int j = 0; j < 2; ++j)
+                c[j] = {out.cx[e[j]], out.cy[e[j]], out.cz[e[j]], out.cw[e[j]]};
+            screen_line& l = lines[i];
+            l = {0, 0, 0, 0, 1, 1, 0, 0};
+            if (c[0].w() < min_w && c[1].w() < min_w)
+                continue;
+            for (int j = 0; j < 2; ++j)
             {
-                py=py+2*dx1;
+                if (c[j].w() < min_w)
+                    c[j] = c[j] + (c[1 - j] - c[j]) * ((min_w - c[j].w()) / (c[1 - j].w() - c[j].w()));
             }
-            else
+            float sx[2], sy[2], q[2], zq[2];
+            for (int j = 0; j < 2; ++j)
             {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    x=x+1;
-                }
-                else
-                {
-                    x=x-1;
-                }
-                py=py+2*(dx1-dy1);
+                q[j] = 1.0f / c[j].w();
+                sx[j] = 0.5f * width * (c[j].x() * q[j] + 1.0f);
+                sy[j] = 0.5f * height * (c[j].y() * q[j] + 1.0f);
+                zq[j] = (c[j].z() * q[j] * f1 + f2) * q[j];
             }
-//            delay(0);
-            Eigen::Vector2i point = Eigen::Vector2i(x, y);
-            set_pixel(point,line_color);
+            screen_line clipped{sx[0], sy[0], sx[1], sy[1], q[0], q[1], zq[0], zq[1]};
+            if (clip_to_target(clipped))
+                l = clipped;
         }
-    }
+    });
+    rasterize_lines(lines, edges.count, settings);
 }
 
 auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
@@ -149,7 +356,7 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
+static bool insideTriangle(float x, float y, const Vector4f* _v){
     Vector3f v[3];
     for(int i=0;i<3;i++)
         v[i] = {_v[i].x(),_v[i].y(), 1.0};
@@ -171,73 +378,507 @@ static std::tuple<float, float, float> computeBarycentric2D(float x, float y, co
 }
 
 void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+    begin_draw();
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+    // Unindexed: corner j of triangle k is vertex 3k + j
+    auto in = vertex_arrays::allocate(draw_memory(), TriangleList.size() * 3);
+    for (size_t k = 0; k < TriangleList.size(); ++k)
+    {
+        const Triangle* t = TriangleList[k];
+        for (int j = 0; j < 3; ++j)
+        {
+            size_t i = k * 3 + j;
+            in.px[i] = t->v[j].x();
+            in.py[i] = t->v[j].y();
+            in.pz[i] = t->v[j].z();
+            in.nx[i] = t->normal[j].x();
+            in.ny[i] = t->normal[j].y();
+            in.nz[i] = t->normal[j].z();
+            in.u[i] = t->tex_coords[j].x();
+            in.v[i] = t->tex_coords[j].y();
+        }
+    }
+
+    draw_vertices(in, nullptr, TriangleList.size());
+}
+
+void rst::rasterizer::begin_draw()
+{
+    // A recording keeps every draw's geometry until the frame is replayed
+    if (!recording)
+        frame_arena.reset();
+}
+
+void rst::rasterizer::draw(const mesh& m)
+{
+    begin_draw();
+    draw_vertices(m.vertices, m.indices, m.triangle_count);
+}
+
+rst::vertex_uniforms rst::rasterizer::camera_uniforms() const
+{
+    vertex_uniforms uniforms;
+    uniforms.model = model;
+    uniforms.view = view;
+    uniforms.projection = jittered_projection();
+    uniforms.mv = view * model;
+    uniforms.mvp = uniforms.projection * uniforms.mv;
+    uniforms.normal_matrix = uniforms.mv.topLeftCorner<3, 3>().inverse().transpose();
+    return uniforms;
+}
+
+void rst::rasterizer::draw_vertices(const vertex_arrays& in, const std::uint32_t* indices, size_t triangle_count)
+{
+    auto out = vertex_outputs::allocate(draw_memory(), in.count);
+    run_vertex_stage(camera_uniforms(), in, out);
+    draw_transformed(out, indices, triangle_count);
+}
+
+void rst::rasterizer::draw_transformed(const vertex_outputs& out, const std::uint32_t* indices, size_t triangle_count)
+{
+    if (cancelled())
+        return;
+    // Dense scans cull most of their triangles, so only survivors get constructed
+    arena& memory = draw_memory();
+    auto* setup = static_cast<setup_triangle*>(memory.allocate(sizeof(setup_triangle) * triangle_count, alignof(setup_triangle)));
+    auto* home_tile = memory.alloc_array<std::uint32_t>(triangle_count);
+    size_t setup_count = setup_triangles(out, indices, triangle_count, setup, home_tile);
+
+    tile_bins bins = bin_triangles(setup, home_tile, setup_count);
+    if (recording)
+    {
+        recording->draws.push_back({bins, opacity});
+        recording->projection = projection;
+    }
+    else
+        rasterize_draw(bins, opacity);
+}
+
+void rst::rasterizer::rasterize_draw(const tile_bins& bins, float alpha)
+{
+    raster_opacity = alpha;
+    rasterize_bins(bins);
+    if (alpha < 1.0f && oit.mode() != transparency::none)
+        oit_pending = true;
+}
+
+void rst::rasterizer::begin_recording(recorded_frame& frame)
+{
+    frame.memory.reset();
+    frame.draws.clear();
+    frame.projection = projection;
+    recording = &frame;
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
+void rst::rasterizer::replay(const recorded_frame& frame)
+{
+    depth_buf.set_projection(frame.projection);
+    for (const auto& call : frame.draws)
     {
-        Triangle newtri = *t;
+        if (cancelled())
+            return;
+        rasterize_draw(call.bins, call.opacity);
+    }
+}
+
+void rst::rasterizer::draw(stream_mesh& m)
+{
+    if (m.chunk_count() > 0)
+        m.prefetch(0);
+    for (size_t c = 0; c < m.chunk_count(); ++c)
+    {
+        // Everything derived from the previous chunk is dead by now
+        begin_draw();
+        if (c + 1 < m.chunk_count())
+            m.prefetch(c + 1);
+
+        mesh chunk;
+        if (m.chunk(c, chunk))
+            draw_vertices(chunk.vertices, chunk.indices, chunk.triangle_count);
+        m.release(c);
+    }
+}
 
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
+void rst::rasterizer::draw_multiview(const mesh& m, rasterizer* const* targets, size_t count)
+{
+    if (count == 0)
+        return;
+    const Eigen::Matrix4f model = targets[0]->model;
+    Eigen::Matrix3f model_normal_matrix = model.topLeftCorner<3, 3>().inverse().transpose();
+    // Targets the shared world-space pass cannot serve
+    auto separate = [&](const rasterizer* r) { return r->batch_shader || r->vertex_shader || r->model != model; };
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+    // Views sharing the built-in transform and the first target's model
+    auto* views = scratch_arena().make_array<view_transform>(count);
+    auto* outs = scratch_arena().make_array<vertex_outputs>(count);
+    auto** shared = scratch_arena().make_array<rasterizer*>(count);
+    size_t shared_count = 0;
+    for (size_t k = 0; k < count; ++k)
+    {
+        rasterizer* r = targets[k];
+        if (separate(r))
+            continue;
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
+        r->begin_draw();
+        view_transform& v = views[shared_count];
+        v.view = r->view;
+        v.view_projection = r->jittered_projection() * r->view;
+        v.normal_matrix = r->view.topLeftCorner<3, 3>().inverse().transpose();
+        vertex_outputs& out = outs[shared_count];
+        out = vertex_outputs::allocate(r->draw_memory(), m.vertices.count);
+        out.u = m.vertices.u;
+        out.v = m.vertices.v;
+        shared[shared_count++] = r;
+    }
+    if (shared_count > 0)
+    {
+        thread_pool::global().parallel_for(m.vertices.count, 8192, [&](size_t begin, size_t end)
+        {
+            transform_vertices_multiview(model, model_normal_matrix, m.vertices, views, outs, shared_count, begin, end);
         });
+        // Culling and everything after is per view
+        for (size_t k = 0; k < shared_count; ++k)
+            shared[k]->draw_transformed(outs[k], m.indices, m.triangle_count);
+    }
+    scratch_arena().reset();
+
+    // The legacy vertex shader path reuses the scratch arena, so these run last
+    for (size_t k = 0; k < count; ++k)
+        if (separate(targets[k]))
+            targets[k]->draw(m);
+}
 
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
+// home_tile[i] is the one tile setup[i] lies in, or no_tile if it spans several;
+// most triangles of a dense mesh are binned from that without touching setup[i]
+rst::tile_bins rst::rasterizer::bin_triangles(const setup_triangle* setup, const std::uint32_t* home_tile, size_t count)
+{
+    size_t tile_count = tiles.size();
+    tile_bins bins;
+    bins.tris = setup;
+    arena& memory = draw_memory();
+    bins.offsets = memory.alloc_array<std::uint32_t>(tile_count + 1);
+    std::fill_n(bins.offsets, tile_count + 1, 0);
+
+    // Counting pass, then scatter: two walks over the bounding boxes beat growing
+    // per-tile vectors and keep the bins in one arena allocation
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (home_tile[i] != no_tile)
+        {
+            ++bins.offsets[home_tile[i] + 1];
+            continue;
         }
+        const setup_triangle& s = setup[i];
+        for (int ty = s.min_y / tile_size; ty <= s.max_y / tile_size; ++ty)
+            for (int tx = s.min_x / tile_size; tx <= s.max_x / tile_size; ++tx)
+                ++bins.offsets[ty * tiles_x + tx + 1];
+    }
+    for (size_t t = 0; t < tile_count; ++t)
+        bins.offsets[t + 1] += bins.offsets[t];
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+    bins.entries = memory.alloc_array<std::uint32_t>(bins.offsets[tile_count]);
+    auto* cursor = memory.alloc_array<std::uint32_t>(tile_count);
+    std::copy_n(bins.offsets, tile_count, cursor);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (home_tile[i] != no_tile)
+        {
+            bins.entries[cursor[home_tile[i]]++] = (std::uint32_t)i;
+            continue;
+        }
+        const setup_triangle& s = setup[i];
+        for (int ty = s.min_y / tile_size; ty <= s.max_y / tile_size; ++ty)
+            for (int tx = s.min_x / tile_size; tx <= s.max_x / tile_size; ++tx)
+                bins.entries[cursor[ty * tiles_x + tx]++] = (std::uint32_t)i;
+    }
+    return bins;
+}
 
-        //Viewport transformation
-        for (auto & vert : v)
+void rst::rasterizer::rasterize_bins(const tile_bins& bins)
+{
+    // Each tile is owned by exactly one worker, so pixels and tile state need no locking
+    thread_pool::global().parallel_for(tiles.size(), 1, [&](size_t begin, size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            if (cancelled())
+                return;
+            int tx = (int)t % tiles_x, ty = (int)t / tiles_x;
+            if (stats_enabled)
+                rasterize_tile<true>(bins, tx, ty);
+            else
+                rasterize_tile<false>(bins, tx, ty);
         }
+    });
+}
 
-        for (int i = 0; i < 3; ++i)
+template <bool Stats>
+void rst::rasterizer::rasterize_tile(const tile_bins& bins, int tx, int ty)
+{
+    size_t t = ty * tiles_x + tx;
+    for (std::uint32_t e = bins.offsets[t]; e < bins.offsets[t + 1]; ++e)
+    {
+        const setup_triangle& s = bins.tris[bins.entries[e]];
+        if (s.small)
+            rasterize_small<Stats>(s, tx, ty);
+        else
+            rasterize_triangle<Stats>(s, tx, ty);
+    }
+}
+
+namespace
+{
+    // Vertices [begin, begin + count) of a set of arrays, as arrays of their own
+    float* offset(float* p, size_t begin)
+    {
+        return p ? p + begin : nullptr;
+    }
+
+    rst::vertex_arrays vertex_window(const rst::vertex_arrays& a, size_t begin, size_t count)
+    {
+        return {count, offset(a.px, begin), offset(a.py, begin), offset(a.pz, begin),
+                offset(a.nx, begin), offset(a.ny, begin), offset(a.nz, begin), offset(a.u, begin), offset(a.v, begin)};
+    }
+
+    rst::vertex_outputs vertex_window(const rst::vertex_outputs& a, size_t begin, size_t count)
+    {
+        return {count, offset(a.cx, begin), offset(a.cy, begin), offset(a.cz, begin), offset(a.cw, begin),
+                offset(a.vx, begin), offset(a.vy, begin), offset(a.vz, begin),
+                offset(a.nx, begin), offset(a.ny, begin), offset(a.nz, begin), offset(a.u, begin), offset(a.v, begin)};
+    }
+}
+
+void rst::rasterizer::run_vertex_stage(const vertex_uniforms& uniforms, const vertex_arrays& in, const vertex_outputs& out)
+{
+    auto batch = [&](size_t begin, size_t end)
+    {
+        if (batch_shader)
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            batch_shader(uniforms, in, out, begin, end);
+            return;
         }
+        if (!vertex_shader)
+        {
+            transform_vertices(uniforms, in, out, begin, end);
+            return;
+        }
+
+        // Legacy per-vertex shader: let it move the positions, then run the kernel on
+        // this batch alone, so scratch holds only the batch's positions
+        size_t n = end - begin;
+        arena& scratch = scratch_arena();
+        scratch.reset();
+        vertex_arrays moved = vertex_window(in, begin, n);
+        moved.px = scratch.alloc_array<float>(n);
+        moved.py = scratch.alloc_array<float>(n);
+        moved.pz = scratch.alloc_array<float>(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            vertex_shader_payload payload;
+            payload.position = {in.px[begin + i], in.py[begin + i], in.pz[begin + i]};
+            Eigen::Vector3f p = vertex_shader(payload);
+            moved.px[i] = p.x();
+            moved.py[i] = p.y();
+            moved.pz[i] = p.z();
+        }
+        transform_vertices(uniforms, moved, vertex_window(out, begin, n), 0, n);
+    };
+
+    // Small meshes are not worth waking the workers for
+    thread_pool::global().parallel_for(in.count, 8192, batch);
+}
+
+namespace
+{
+    // A triangle whose bounding box holds at most 2x2 pixel centres, waiting for
+    // its candidate pixels to be tested together with others
+    struct small_candidate
+    {
+        size_t idx[3];
+        Eigen::Vector4f v[3];
+        int min_x, max_x, min_y, max_y;
+        std::array<Eigen::Vector3f, 3> plane;
+    };
+
+    // Coverage of the candidate pixels of up to eight small triangles, one slot at a
+    // time across all of them. Bit k of covered[i] is pixel
+    // (min_x + (k & 1), min_y + (k >> 1)) of triangle i.
+    void small_coverage(const small_candidate* tris, int count, unsigned* covered)
+    {
+        alignas(32) float plane[9][8] = {};
+        alignas(32) float px[8] = {}, py[8] = {};
+        unsigned candidates[8] = {};
+        for (int i = 0; i < count; ++i)
+        {
+            const small_candidate& s = tris[i];
+            bool wide = s.max_x > s.min_x, tall = s.max_y > s.min_y;
+            candidates[i] = 1u | (wide ? 2u : 0u) | (tall ? 4u : 0u) | (wide && tall ? 8u : 0u);
+            px[i] = s.min_x + 0.5f;
+            py[i] = s.min_y + 0.5f;
+            for (int e = 0; e < 3; ++e)
+                for (int c = 0; c < 3; ++c)
+                    plane[e * 3 + c][i] = s.plane[e][c];
+            covered[i] = 0;
+        }
+
+        for (int slot = 0; slot < 4; ++slot)
+        {
+            float dx = (float)(slot & 1), dy = (float)(slot >> 1);
+#if defined(__AVX__)
+            __m256 x = _mm256_add_ps(_mm256_load_ps(px), _mm256_set1_ps(dx));
+            __m256 y = _mm256_add_ps(_mm256_load_ps(py), _mm256_set1_ps(dy));
+            __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+            for (int e = 0; e < 3; ++e)
+            {
+                __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(plane[e * 3]), x),
+                                                       _mm256_mul_ps(_mm256_load_ps(plane[e * 3 + 1]), y)),
+                                         _mm256_load_ps(plane[e * 3 + 2]));
+                inside = _mm256_and_ps(inside, _mm256_cmp_ps(w, _mm256_setzero_ps(), _CMP_GT_OQ));
+            }
+            unsigned bits = (unsigned)_mm256_movemask_ps(inside);
+            for (int i = 0; i < count; ++i)
+                covered[i] |= (bits >> i & 1u) << slot;
+#else
+            for (int i = 0; i < count; ++i)
+            {
+                bool inside = true;
+                for (int e = 0; e < 3; ++e)
+                    inside &= plane[e * 3][i] * (px[i] + dx) + plane[e * 3 + 1][i] * (py[i] + dy) + plane[e * 3 + 2][i] > 0;
+                covered[i] |= (unsigned)inside << slot;
+            }
+#endif
+        }
+        for (int i = 0; i < count; ++i)
+            covered[i] &= candidates[i];
+    }
+}
+
+// Small triangles are held back in groups of eight and their few candidate pixel
+// centres tested at once; the ones that cover none, usually most of a dense scan,
+// are dropped before anything else is built for them. Output order is input order.
+size_t rst::rasterizer::setup_triangles(const vertex_outputs& out, const std::uint32_t* indices, size_t triangle_count,
+                                        setup_triangle* setup, std::uint32_t* home_tile)
+{
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    // Perspective division and viewport once per vertex, not once per corner
+    arena& memory = draw_memory();
+    float* sx = memory.alloc_array<float>(out.count);
+    float* sy = memory.alloc_array<float>(out.count);
+    float* sz = memory.alloc_array<float>(out.count);
+    thread_pool::global().parallel_for(out.count, 8192, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            float w = out.cw[i];
+            sx[i] = 0.5*width*(out.cx[i]/w+1.0);
+            sy[i] = 0.5*height*(out.cy[i]/w+1.0);
+            sz[i] = out.cz[i]/w * f1 + f2;
+        }
+    });
+
+    size_t setup_count = 0;
+    auto emit = [&](const size_t* idx, const Eigen::Vector4f* v, int min_x, int max_x, int min_y, int max_y) -> setup_triangle&
+    {
+        int tile_x = min_x / tile_size, tile_y = min_y / tile_size;
+        bool one_tile = tile_x == max_x / tile_size && tile_y == max_y / tile_size;
+        home_tile[setup_count] = one_tile ? (std::uint32_t)(tile_y * tiles_x + tile_x) : no_tile;
+        setup_triangle& s = *new (setup + setup_count++) setup_triangle;
+        s.min_x = min_x;
+        s.max_x = max_x;
+        s.min_y = min_y;
+        s.max_y = max_y;
+        s.small = false;
+        Triangle& newtri = s.tri;
 
         for (int i = 0; i < 3; ++i)
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            //screen space coordinates
+            newtri.setVertex(i, v[i]);
+            //view space normal and position
+            newtri.setNormal(i, {out.nx[idx[i]], out.ny[idx[i]], out.nz[idx[i]]});
+            newtri.setTexCoord(i, {out.u[idx[i]], out.v[idx[i]]});
+            s.view_pos[i] = {out.vx[idx[i]], out.vy[idx[i]], out.vz[idx[i]]};
         }
 
         newtri.setColor(0, 148,121.0,92.0);
         newtri.setColor(1, 148,121.0,92.0);
         newtri.setColor(2, 148,121.0,92.0);
+        return s;
+    };
+
+    small_candidate pending[8];
+    int pending_count = 0;
+    auto flush = [&]
+    {
+        unsigned covered[8];
+        small_coverage(pending, pending_count, covered);
+        for (int i = 0; i < pending_count; ++i)
+        {
+            if (!covered[i])
+                continue;
+            const small_candidate& c = pending[i];
+            setup_triangle& s = emit(c.idx, c.v, c.min_x, c.max_x, c.min_y, c.max_y);
+            s.small = true;
+            s.coverage = (std::uint8_t)covered[i];
+            s.plane = c.plane;
+        }
+        pending_count = 0;
+    };
+
+    for (size_t k = 0; k < triangle_count; ++k)
+    {
+        size_t idx[3];
+        for (int j = 0; j < 3; ++j)
+            idx[j] = indices ? indices[k * 3 + j] : k * 3 + j;
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+        Eigen::Vector4f v[3];
+        for (int j = 0; j < 3; ++j)
+            v[j] = {sx[idx[j]], sy[idx[j]], sz[idx[j]], out.cw[idx[j]]};
+        // No near-plane clipping yet: drop anything that reaches behind the eye
+        if (v[0].w() <= 0 || v[1].w() <= 0 || v[2].w() <= 0)
+            continue;
+
+        // Pixels whose centre lies within the bounding box; the rest cannot be covered
+        int min_x = std::max(0, (int)std::ceil(std::min({v[0].x(), v[1].x(), v[2].x()}) - 0.5f));
+        int max_x = std::min(width - 1, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()}) - 0.5f));
+        int min_y = std::max(0, (int)std::ceil(std::min({v[0].y(), v[1].y(), v[2].y()}) - 0.5f));
+        int max_y = std::min(height - 1, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()}) - 0.5f));
+        // Off screen, or so thin it falls between pixel centres; common in dense scans
+        if (min_x > max_x || min_y > max_y)
+            continue;
+
+        if (max_x - min_x > 1 || max_y - min_y > 1)
+        {
+            // Keep submission order: earlier small triangles go first
+            if (pending_count > 0)
+                flush();
+            emit(idx, v, min_x, max_x, min_y, max_y);
+            continue;
+        }
+
+        small_candidate& c = pending[pending_count++];
+        std::copy_n(idx, 3, c.idx);
+        std::copy_n(v, 3, c.v);
+        c.min_x = min_x;
+        c.max_x = max_x;
+        c.min_y = min_y;
+        c.max_y = max_y;
+        // Barycentric i as a plane in (x, y, 1), same as computeBarycentric2D
+        for (int i = 0; i < 3; ++i)
+        {
+            const Eigen::Vector4f& b = v[(i + 1) % 3];
+            const Eigen::Vector4f& e = v[(i + 2) % 3];
+            Eigen::Vector3f edge(b.y() - e.y(), e.x() - b.x(), b.x() * e.y() - e.x() * b.y());
+            c.plane[i] = edge / edge.dot(Eigen::Vector3f(v[i].x(), v[i].y(), 1.0f));
+        }
+        if (pending_count == 8)
+            flush();
     }
+    if (pending_count > 0)
+        flush();
+    return setup_count;
 }
 
 static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
@@ -256,31 +897,250 @@ static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const E
     return Eigen::Vector2f(u, v);
 }
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+// Colours of the coarse shading blocks of one tile that one triangle has shaded so
+// far: the first covered pixel of a block is shaded and the rest reuse its colour
+struct rst::rasterizer::shading_blocks
 {
-    // TODO: From your HW3, get the triangle rasterization code.
-    // TODO: Inside your rasterization loop:
-    //    * v[i].w() is the vertex view space depth value z.
-    //    * Z is interpolated view space depth for the current pixel
-    //    * zp is depth between zNear and zFar, used for z-buffer
+    explicit shading_blocks(shading_rate rate)
+        : width(rate == shading_rate::r2x2 ? 2 : rate == shading_rate::r4x4 ? 4 : 1),
+          height(rate == shading_rate::r1x1 ? 1 : rate == shading_rate::r4x4 ? 4 : 2),
+          coarse(width * height > 1)
+    {
+    }
 
-    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    // zp *= Z;
+    static constexpr int max_blocks = tile_size * tile_size / 2;
+    int width, height;
+    bool coarse;
+    Eigen::Vector3f color[max_blocks];
+    std::uint64_t shaded[max_blocks / 64] = {};
+};
 
-    // TODO: Interpolate the attributes:
-    // auto interpolated_color
-    // auto interpolated_normal
-    // auto interpolated_texcoords
-    // auto interpolated_shadingcoords
+//Screen space rasterization of the part of s inside tile (tx, ty), in 2x2 quads.
+//Lanes 0-3 are (x, y), (x+1, y), (x, y+1), (x+1, y+1). Every lane of a quad with
+//a live pixel is interpolated, including helper lanes outside the triangle, so
+//each fragment gets screen-space derivatives as lane differences like on a GPU.
+template <bool Stats>
+void rst::rasterizer::rasterize_triangle(const setup_triangle& s, int tx, int ty)
+{
+    const Eigen::Vector4f* v = s.tri.v;
 
-    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-    // Use: payload.view_pos = interpolated_shadingcoords;
-    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-    // Use: auto pixel_color = fragment_shader(payload);
+    bool transparent = raster_opacity < 1.0f && oit.mode() != transparency::none;
+    // Transparent surfaces do not occlude ambient light
+    if (prepass && transparent)
+        return;
+    int x0 = std::max(s.min_x, tx * tile_size), x1 = std::min(s.max_x, tx * tile_size + tile_size - 1);
+    int y0 = std::max(s.min_y, ty * tile_size), y1 = std::min(s.max_y, ty * tile_size + tile_size - 1);
+    shading_blocks blocks(tiles[ty * tiles_x + tx].rate);
 
- 
+    // Tiles are an even number of pixels wide, so quads never straddle two
+    for (int qy = y0 & ~1; qy <= y1; qy += 2)
+    {
+        for (int qx = x0 & ~1; qx <= x1; qx += 2)
+        {
+            float alpha[4], beta[4], gamma[4];
+            unsigned covered = 0;
+            for (int l = 0; l < 4; ++l)
+            {
+                int x = qx + (l & 1), y = qy + (l >> 1);
+                float px = x + 0.5f, py = y + 0.5f;
+                std::tie(alpha[l], beta[l], gamma[l]) = computeBarycentric2D(px, py, v);
+                if (x >= x0 && x <= x1 && y >= y0 && y <= y1 && insideTriangle(px, py, v))
+                    covered |= 1u << l;
+            }
+            if (covered)
+                shade_quad<Stats>(s, tx, ty, qx, qy, alpha, beta, gamma, covered, blocks);
+        }
+    }
+}
+
+// A small triangle's part of tile (tx, ty). Coverage was settled in setup; only
+// the quads holding a covered pixel are visited, each once.
+template <bool Stats>
+void rst::rasterizer::rasterize_small(const setup_triangle& s, int tx, int ty)
+{
+    bool transparent = raster_opacity < 1.0f && oit.mode() != transparency::none;
+    if (prepass && transparent)
+        return;
+
+    unsigned hit = 0;
+    for (int k = 0; k < 4; ++k)
+    {
+        int x = s.min_x + (k & 1), y = s.min_y + (k >> 1);
+        if ((s.coverage >> k & 1) && x / tile_size == tx && y / tile_size == ty)
+            hit |= 1u << k;
+    }
+
+    shading_blocks blocks(tiles[ty * tiles_x + tx].rate);
+    while (hit)
+    {
+        int slot = __builtin_ctz(hit);
+        int qx = (s.min_x + (slot & 1)) & ~1, qy = (s.min_y + (slot >> 1)) & ~1;
+        unsigned lanes = 0;
+        for (int k = slot; k < 4; ++k)
+        {
+            int x = s.min_x + (k & 1), y = s.min_y + (k >> 1);
+            if ((hit >> k & 1) && (x & ~1) == qx && (y & ~1) == qy)
+            {
+                lanes |= 1u << ((x & 1) | (y & 1) << 1);
+                hit &= ~(1u << k);
+            }
+        }
+        float alpha[4], beta[4], gamma[4];
+        for (int l = 0; l < 4; ++l)
+        {
+            Eigen::Vector3f p(qx + (l & 1) + 0.5f, qy + (l >> 1) + 0.5f, 1.0f);
+            alpha[l] = s.plane[0].dot(p);
+            beta[l] = s.plane[1].dot(p);
+            gamma[l] = s.plane[2].dot(p);
+        }
+        shade_quad<Stats>(s, tx, ty, qx, qy, alpha, beta, gamma, lanes, blocks);
+    }
+}
+
+// Depth tests the covered lanes of the quad at (qx, qy) and shades the survivors.
+// alpha, beta and gamma hold the screen-space barycentrics of all four lanes.
+template <bool Stats>
+void rst::rasterizer::shade_quad(const setup_triangle& s, int tx, int ty, int qx, int qy,
+                                 const float* alpha, const float* beta, const float* gamma,
+                                 unsigned covered, shading_blocks& blocks)
+{
+    const Triangle& t = s.tri;
+    const auto& view_pos = s.view_pos;
+    const Eigen::Vector4f* v = t.v;
+    tile_state& tile = tiles[ty * tiles_x + tx];
+    bool transparent = raster_opacity < 1.0f && oit.mode() != transparency::none;
+
+    float Z[4], zp[4];
+    std::uint32_t key[4];
+    int index[4];
+    unsigned live = 0;
+    for (int l = 0; l < 4; ++l)
+    {
+        if (!(covered & (1u << l)))
+            continue;
+        int x = qx + (l & 1), y = qy + (l >> 1);
+
+        // v[i].w() is the vertex view space depth, zp the depth between zNear and zFar
+        float q = alpha[l] / v[0].w() + beta[l] / v[1].w() + gamma[l] / v[2].w();
+        Z[l] = 1.0 / q;
+        zp[l] = alpha[l] * v[0].z() / v[0].w() + beta[l] * v[1].z() / v[1].w() + gamma[l] * v[2].z() / v[2].w();
+        zp[l] *= Z[l];
+        key[l] = depth_buf.key(zp[l], q);
+
+        if (tile.depth_cleared)
+            materialize_depth(tx, ty);
+        index[l] = get_index(x, y);
+        if constexpr (Stats)
+            ++stats.depth_tests[index[l]];
+        // After a prepass the depth buffer already holds the visible surface,
+        // which is shaded when it comes round again. A NaN depth, from a sliver
+        // with no usable barycentrics, fails.
+        std::uint32_t stored = depth_buf.load(index[l]);
+        if (std::isnan(zp[l]) || !(ao_ready ? key[l] <= stored : key[l] < stored))
+            continue;
+        if (!transparent)
+        {
+            depth_buf.store(index[l], key[l]);
+            oit.occlude(ty * tiles_x + tx, (y - ty * tile_size) * tile_size + x - tx * tile_size, zp[l]);
+        }
+        live |= 1u << l;
+    }
+    if (live == 0)
+        return;
+
+    if (prepass)
+    {
+        for (int l = 0; l < 4; ++l)
+        {
+            if (!(live & (1u << l)))
+                continue;
+            float a = alpha[l] / v[0].w(), b = beta[l] / v[1].w(), c = gamma[l] / v[2].w();
+            view_depth[index[l]] = Z[l];
+            normal_buf[index[l]] = interpolate(a, b, c, t.normal[0], t.normal[1], t.normal[2], a + b + c).normalized();
+        }
+        return;
+    }
+
+    // Perspective-correct attributes for all four lanes. A helper lane far
+    // enough out can land behind the eye; it borrows a live lane's values.
+    Eigen::Vector3f color[4], normal[4], shading[4];
+    Eigen::Vector2f texcoords[4];
+    int fallback = __builtin_ctz(live);
+    for (int l = 0; l < 4; ++l)
+    {
+        float a = alpha[l] / v[0].w(), b = beta[l] / v[1].w(), c = gamma[l] / v[2].w();
+        float weight = a + b + c;
+        if (!(live & (1u << l)) && !(weight > 0))
+        {
+            a = alpha[fallback] / v[0].w(), b = beta[fallback] / v[1].w(), c = gamma[fallback] / v[2].w();
+            weight = a + b + c;
+        }
+        color[l] = interpolate(a, b, c, t.color[0], t.color[1], t.color[2], weight);
+        normal[l] = interpolate(a, b, c, t.normal[0], t.normal[1], t.normal[2], weight);
+        texcoords[l] = interpolate(a, b, c, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], weight);
+        shading[l] = interpolate(a, b, c, view_pos[0], view_pos[1], view_pos[2], weight);
+    }
+
+    for (int l = 0; l < 4; ++l)
+    {
+        if (!(live & (1u << l)))
+            continue;
+        int x = qx + (l & 1), y = qy + (l >> 1);
+        // Differences along the lane's own row and column of the quad
+        int across = l ^ 1, down = l ^ 2;
+        float sx = (l & 1) ? -1.0f : 1.0f, sy = (l & 2) ? -1.0f : 1.0f;
+
+        int lx = x - tx * tile_size, ly = y - ty * tile_size;
+        int block = (ly / blocks.height) * (tile_size / blocks.width) + lx / blocks.width;
+        Eigen::Vector3f shaded;
+        if (blocks.coarse && (blocks.shaded[block >> 6] >> (block & 63) & 1))
+        {
+            shaded = blocks.color[block];
+        }
+        else
+        {
+            // A coarse sample covers the whole block, and so does its footprint
+            sx *= blocks.width;
+            sy *= blocks.height;
+            fragment_shader_payload payload(color[l], normal[l].normalized(), texcoords[l], texture ? &*texture : nullptr);
+            payload.view_pos = shading[l];
+            payload.tex_coords_ddx = (texcoords[across] - texcoords[l]) * sx;
+            payload.tex_coords_ddy = (texcoords[down] - texcoords[l]) * sy;
+            payload.view_pos_ddx = (shading[across] - shading[l]) * sx;
+            payload.view_pos_ddy = (shading[down] - shading[l]) * sy;
+            payload.normal_ddx = (normal[across] - normal[l]) * sx;
+            payload.normal_ddy = (normal[down] - normal[l]) * sy;
+            payload.color_ddx = (color[across] - color[l]) * sx;
+            payload.color_ddy = (color[down] - color[l]) * sy;
+            payload.scene = scene;
+            if (ao_ready)
+                payload.ambient_occlusion = ssao.at(x, height - 1 - y);
+            if constexpr (Stats)
+            {
+                std::uint64_t start = cycle_count();
+                shaded = fragment_shader(payload);
+                stats.cycles[index[l]] += cycle_count() - start;
+                ++stats.fragments[index[l]];
+            }
+            else
+            {
+                shaded = fragment_shader(payload);
+            }
+            if (blocks.coarse)
+            {
+                blocks.color[block] = shaded;
+                blocks.shaded[block >> 6] |= std::uint64_t(1) << (block & 63);
+            }
+        }
+        if (transparent)
+        {
+            oit.add(ty * tiles_x + tx, ly * tile_size + lx, shaded, raster_opacity, zp[l], Z[l]);
+            continue;
+        }
+        if (tile.color_cleared)
+            materialize_color(tx, ty);
+        frame_buf[index[l]] = shaded;
+    }
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -296,37 +1156,547 @@ void rst::rasterizer::set_view(const Eigen::Matrix4f& v)
 void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 {
     projection = p;
+    // A recorded frame takes its projection along, as the depth buffer may still
+    // be in use by the frame being replayed
+    if (!recording)
+        depth_buf.set_projection(p);
 }
 
+// Clearing only flags the tiles; see materialize_color/materialize_depth
 void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        for (auto& tile : tiles)
+        {
+            tile.color_cleared = true;
+            tile.clear_color = clear_color;
+        }
+        oit.reset();
+        oit_pending = false;
+        if (stats_enabled)
+            stats.reset(width, height);
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        for (auto& tile : tiles)
+        {
+            tile.depth_cleared = true;
+            tile.clear_depth = depth_buf.far_key();
+        }
+        prepass = false;
+        ao_ready = false;
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+void rst::rasterizer::materialize_color(int tx, int ty)
+{
+    tile_state& tile = tiles[ty * tiles_x + tx];
+    int x0 = tx * tile_size, x1 = std::min(width, x0 + tile_size);
+    int y0 = ty * tile_size, y1 = std::min(height, y0 + tile_size);
+    for (int y = y0; y < y1; ++y)
+        std::fill_n(frame_buf.begin() + get_index(x0, y), x1 - x0, tile.clear_color);
+    tile.color_cleared = false;
+}
+
+void rst::rasterizer::materialize_depth(int tx, int ty)
+{
+    tile_state& tile = tiles[ty * tiles_x + tx];
+    int x0 = tx * tile_size, x1 = std::min(width, x0 + tile_size);
+    int y0 = ty * tile_size, y1 = std::min(height, y0 + tile_size);
+    for (int y = y0; y < y1; ++y)
+    {
+        depth_buf.fill(get_index(x0, y), x1 - x0, tile.clear_depth);
+        if (ssao_enabled)
+            std::fill_n(view_depth.begin() + get_index(x0, y), x1 - x0, std::numeric_limits<float>::infinity());
+    }
+    tile.depth_cleared = false;
+}
+
+Eigen::Matrix4f rst::rasterizer::jittered_projection() const
+{
+    // A clip-space shear, so the offset is the same number of pixels at every depth
+    Eigen::Matrix4f shift = Eigen::Matrix4f::Identity();
+    shift(0, 3) = 2 * jitter.x() / width;
+    shift(1, 3) = 2 * jitter.y() / height;
+    return shift * projection;
+}
+
+bool rst::rasterizer::set_ssao(bool enable, const ssao_settings& settings)
+{
+    if (enable && view_depth.empty())
+    {
+        size_t pixels = (size_t)output_width * output_height;
+        size_t depth_bytes = pixels * sizeof(float);
+        size_t other_bytes = pixels * sizeof(Eigen::Vector3f) + ssao_pass::footprint(output_width, output_height);
+        if (!memory_use.charge(memory_kind::depth, depth_bytes))
+            return false;
+        if (!memory_use.charge(memory_kind::framebuffer, other_bytes))
+        {
+            memory_use.release(memory_kind::depth, depth_bytes);
+            return false;
+        }
+        view_depth.resize(pixels);
+        normal_buf.resize(pixels);
+        ssao.reserve(output_width, output_height);
+    }
+    ssao_enabled = enable;
+    ssao_config = settings;
+    prepass = false;
+    ao_ready = false;
+    clear(Buffers::Depth);
+    return true;
+}
+
+void rst::rasterizer::begin_prepass()
+{
+    if (!ssao_enabled)
+        return;
+    prepass = true;
+    ao_ready = false;
+}
+
+void rst::rasterizer::end_prepass()
+{
+    if (!prepass)
+        return;
+    prepass = false;
+
+    // Tiles nothing reached still have to read as empty
+    for (int ty = 0; ty < tiles_y; ++ty)
+        for (int tx = 0; tx < tiles_x; ++tx)
+            if (tiles[ty * tiles_x + tx].depth_cleared)
+                materialize_depth(tx, ty);
+
+    ssao_inputs in{view_depth.data(), normal_buf.data(), width, height, jittered_projection()};
+    ssao.run(in, ssao_config);
+    ao_ready = true;
+}
+
+bool rst::rasterizer::set_taa(bool enable, const taa_settings& settings)
+{
+    if (enable && !taa.reserved())
+    {
+        if (!memory_use.charge(memory_kind::framebuffer, taa_pass::footprint(output_width, output_height)))
+            return false;
+        taa.reserve(output_width, output_height);
+    }
+    taa_enabled = enable;
+    taa_config = settings;
+    taa.reset();
+    jitter = enable ? taa.jitter(taa_config) : Eigen::Vector2f::Zero();
+    return true;
+}
+
+void rst::rasterizer::apply_taa()
+{
+    for (int ty = 0; ty < tiles_y; ++ty)
+        for (int tx = 0; tx < tiles_x; ++tx)
+            if (tiles[ty * tiles_x + tx].color_cleared)
+                materialize_color(tx, ty);
+
+    // Pixel centres go back to NDC with the depth they hold and forward with last
+    // frame's transforms. Where nothing was drawn the background sits at the far
+    // plane and only moves with the camera. The frame was drawn jittered, so what a
+    // centre shows lies at centre - jitter in the unjittered image the history is
+    // kept in, and is unprojected with the jittered transforms.
+    Eigen::Matrix4f vp = projection * view, mvp = vp * model;
+    Eigen::Matrix4f drawn_vp = jittered_projection() * view;
+    Eigen::Matrix4f to_previous = previous_mvp * (drawn_vp * model).inverse();
+    Eigen::Matrix4f far_to_previous = previous_vp * drawn_vp.inverse();
+    float jx = jitter.x(), jy = jitter.y();
+    float f1 = (depth_buffer::far_depth - depth_buffer::near_depth) / 2;
+    float f2 = (depth_buffer::far_depth + depth_buffer::near_depth) / 2;
+    Eigen::Vector2f* motion = taa.motion();
+    thread_pool::global().parallel_for(height, 16, [&](size_t begin, size_t end)
+    {
+        for (int row = (int)begin; row < (int)end; ++row)
+        {
+            int y = height - 1 - row;
+            for (int x = 0; x < width; ++x)
+            {
+                int index = row * width + x;
+                const tile_state& tile = tiles[(y / tile_size) * tiles_x + x / tile_size];
+                float depth = depth_buf.depth(tile.depth_cleared ? tile.clear_depth : depth_buf.load(index));
+                Eigen::Vector4f ndc(2 * (x + 0.5f) / width - 1, 2 * (y + 0.5f) / height - 1, 1, 1);
+                Eigen::Vector4f p;
+                if (std::isfinite(depth))
+                {
+                    ndc.z() = (depth - f2) / f1;
+                    p = to_previous * ndc;
+                }
+                else
+                    p = far_to_previous * ndc;
+                // Behind last frame's camera: nothing to reproject from
+                if (!(p.w() > 0))
+                {
+                    motion[index] = Eigen::Vector2f::Constant(std::numeric_limits<float>::infinity());
+                    continue;
+                }
+                motion[index] = {0.5f * (p.x() / p.w() + 1) * width - (x + 0.5f - jx),
+                                 (y + 0.5f - jy) - 0.5f * (p.y() / p.w() + 1) * height};
+            }
+        }
+    });
+
+    taa.run({frame_buf.data(), motion, width, height}, taa_config);
+    previous_mvp = mvp;
+    previous_vp = vp;
+    jitter = taa.jitter(taa_config);
+}
+
+void rst::rasterizer::set_shading_rate(shading_rate rate)
+{
+    adaptive_shading = false;
+    for (auto& tile : tiles)
+        tile.rate = rate;
+}
+
+void rst::rasterizer::set_shading_rate(int tx, int ty, shading_rate rate)
+{
+    adaptive_shading = false;
+    if (tx >= 0 && tx < tiles_x && ty >= 0 && ty < tiles_y)
+        tiles[ty * tiles_x + tx].rate = rate;
+}
+
+void rst::rasterizer::set_adaptive_shading(bool enable, float threshold)
+{
+    adaptive_shading = enable;
+    shading_threshold = threshold;
+    if (!enable)
+        set_shading_rate(shading_rate::r1x1);
+}
+
+// Picks every tile's rate for the next frame from the current image. The gradient
+// of a tile is its steepest 4x4 neighbourhood's mean luminance step along x and y,
+// so a single edge through an otherwise flat tile still keeps it fine. A block n
+// pixels across reuses one colour over n - 1 steps.
+void rst::rasterizer::update_shading_rates()
+{
+    thread_pool::global().parallel_for(tiles.size(), 1, [&](size_t begin, size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
+        {
+            tile_state& tile = tiles[t];
+            if (tile.color_cleared)
+            {
+                // Nothing was drawn, so nothing says what to expect; shade it fully
+                tile.rate = shading_rate::r1x1;
+                continue;
+            }
+            int tx = (int)t % tiles_x, ty = (int)t / tiles_x;
+            int x0 = tx * tile_size, x1 = std::min(width, x0 + tile_size);
+            int y0 = ty * tile_size, y1 = std::min(height, y0 + tile_size);
+            auto luminance = [&](int x, int y)
+            {
+                const Eigen::Vector3f& c = frame_buf[get_index(x, y)];
+                return (0.2126f * std::min(c.x(), 255.0f) + 0.7152f * std::min(c.y(), 255.0f) +
+                        0.0722f * std::min(c.z(), 255.0f)) * (1.0f / 255.0f);
+            };
+
+            float gx = 0.0f, gy = 0.0f;
+            for (int by = y0; by < y1; by += 4)
+            {
+                for (int bx = x0; bx < x1; bx += 4)
+                {
+                    float sum_x = 0.0f, sum_y = 0.0f;
+                    int count = 0;
+                    for (int y = by; y < std::min(by + 4, y1); ++y)
+                    {
+                        for (int x = bx; x < std::min(bx + 4, x1); ++x, ++count)
+                        {
+                            float l = luminance(x, y);
+                            if (x + 1 < x1)
+                                sum_x += std::abs(luminance(x + 1, y) - l);
+                            if (y + 1 < y1)
+                                sum_y += std::abs(luminance(x, y + 1) - l);
+                        }
+                    }
+                    gx = std::max(gx, sum_x / count);
+                    gy = std::max(gy, sum_y / count);
+                }
+            }
+
+            float limit = shading_threshold;
+            if (3 * gx <= limit && 3 * gy <= limit)
+                tile.rate = shading_rate::r4x4;
+            else if (gx <= limit && gy <= limit)
+                tile.rate = shading_rate::r2x2;
+            else if (gy <= limit)
+                tile.rate = shading_rate::r1x2;
+            else
+                tile.rate = shading_rate::r1x1;
+        }
+    });
+}
+
+bool rst::rasterizer::set_transparency(transparency mode, size_t node_budget)
+{
+    // Sized for the output resolution, like the other buffers
+    int max_tiles = ((output_width + tile_size - 1) / tile_size) * ((output_height + tile_size - 1) / tile_size);
+    size_t held = oit.bytes();
+    memory_use.release(memory_kind::framebuffer, held);
+    if (!memory_use.charge(memory_kind::framebuffer,
+                           oit_buffer::footprint(mode, max_tiles, tile_size * tile_size, node_budget)))
+    {
+        memory_use.add(memory_kind::framebuffer, held);
+        return false;
+    }
+    oit.configure(mode, max_tiles, tile_size * tile_size, node_budget);
+    oit_pending = false;
+    return true;
+}
+
+void rst::rasterizer::composite_transparency()
+{
+    if (!oit_pending)
+        return;
+    thread_pool::global().parallel_for(tiles.size(), 1, [&](size_t begin, size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
+        {
+            if (!oit.touched(t))
+                continue;
+            int tx = (int)t % tiles_x, ty = (int)t / tiles_x;
+            tile_state& tile = tiles[t];
+            if (tile.color_cleared)
+                materialize_color(tx, ty);
+            int x0 = tx * tile_size, x1 = std::min(width, x0 + tile_size);
+            int y0 = ty * tile_size, y1 = std::min(height, y0 + tile_size);
+            for (int y = y0; y < y1; ++y)
+            {
+                for (int x = x0; x < x1; ++x)
+                {
+                    int index = get_index(x, y);
+                    float depth = depth_buf.depth(tile.depth_cleared ? tile.clear_depth : depth_buf.load(index));
+                    int local = (y - y0) * tile_size + (x - x0);
+                    frame_buf[index] = oit.composite(t, local, frame_buf[index], depth);
+                }
+            }
+        }
+    });
+    // Composited once; a second resolve must not blend the same fragments again
+    oit.reset();
+    oit_pending = false;
+}
+
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
+{
+    composite_transparency();
+    for (int ty = 0; ty < tiles_y; ++ty)
+        for (int tx = 0; tx < tiles_x; ++tx)
+            if (tiles[ty * tiles_x + tx].color_cleared)
+                materialize_color(tx, ty);
+    return frame_buf;
+}
+
+static unsigned char to_u8(float v)
+{
+    return (unsigned char)std::clamp(std::lrint(v), 0l, 255l);
+}
+
+// Colour at internal pixel (x, row), with row counted from the top like the buffer
+Eigen::Vector3f rst::rasterizer::color_at(int x, int row) const
+{
+    const tile_state& tile = tiles[((height - 1 - row) / tile_size) * tiles_x + x / tile_size];
+    return tile.color_cleared ? tile.clear_color : frame_buf[row * width + x];
+}
+
+void rst::rasterizer::resolve(unsigned char* bgr)
+{
+    composite_transparency();
+    if (taa_enabled)
+        apply_taa();
+    if (adaptive_shading)
+        update_shading_rates();
+
+    if (width != output_width || height != output_height)
+    {
+        // Bilinear upscale, sampling at pixel centres
+        float sx = (float)width / output_width, sy = (float)height / output_height;
+        for (int oy = 0; oy < output_height; ++oy)
+        {
+            float fy = std::clamp((oy + 0.5f) * sy - 0.5f, 0.0f, height - 1.0f);
+            int r0 = (int)fy, r1 = std::min(r0 + 1, height - 1);
+            float wy = fy - r0;
+            unsigned char* out = bgr + (size_t)oy * output_width * 3;
+            for (int ox = 0; ox < output_width; ++ox, out += 3)
+            {
+                float fx = std::clamp((ox + 0.5f) * sx - 0.5f, 0.0f, width - 1.0f);
+                int c0 = (int)fx, c1 = std::min(c0 + 1, width - 1);
+                float wx = fx - c0;
+                Eigen::Vector3f top = (1 - wx) * color_at(c0, r0) + wx * color_at(c1, r0);
+                Eigen::Vector3f bottom = (1 - wx) * color_at(c0, r1) + wx * color_at(c1, r1);
+                Eigen::Vector3f c = (1 - wy) * top + wy * bottom;
+                out[0] = to_u8(c.z());
+                out[1] = to_u8(c.y());
+                out[2] = to_u8(c.x());
+            }
+        }
+        return;
+    }
+
+    for (int ty = 0; ty < tiles_y; ++ty)
+    {
+        for (int tx = 0; tx < tiles_x; ++tx)
+        {
+            const tile_state& tile = tiles[ty * tiles_x + tx];
+            int x0 = tx * tile_size, x1 = std::min(width, x0 + tile_size);
+            int y0 = ty * tile_size, y1 = std::min(height, y0 + tile_size);
+            for (int y = y0; y < y1; ++y)
+            {
+                int row = get_index(x0, y);
+                unsigned char* out = bgr + (size_t)row * 3;
+                if (tile.color_cleared)
+                {
+                    unsigned char b = to_u8(tile.clear_color.z()), g = to_u8(tile.clear_color.y()), r = to_u8(tile.clear_color.x());
+                    for (int x = x0; x < x1; ++x, out += 3)
+                    {
+                        out[0] = b;
+                        out[1] = g;
+                        out[2] = r;
+                    }
+                }
+                else
+                {
+                    const Eigen::Vector3f* in = &frame_buf[row];
+                    for (int x = x0; x < x1; ++x, out += 3, ++in)
+                    {
+                        out[0] = to_u8(in->z());
+                        out[1] = to_u8(in->y());
+                        out[2] = to_u8(in->x());
+                    }
+                }
+            }
+        }
+    }
+}
+
+namespace
+{
+    std::string account_name(int w, int h)
+    {
+        static std::atomic<int> created{0};
+        return "rasterizer " + std::to_string(w) + "x" + std::to_string(h) + " #" + std::to_string(created++);
+    }
+}
+
+rst::rasterizer::rasterizer(int w, int h)
+    : memory_use(account_name(w, h)), frame_arena(1 << 16, &memory_use, memory_kind::bins),
+      width(w), height(h), output_width(w), output_height(h)
 {
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    depth_buf.configure(depth_format::float32, w * h);
+
+    tiles_x = (w + tile_size - 1) / tile_size;
+    tiles_y = (h + tile_size - 1) / tile_size;
+    tiles.resize(tiles_x * tiles_y);
+    for (auto& tile : tiles)
+        tile.clear_depth = depth_buf.far_key();
+
+    // Already allocated, and a rasterizer cannot do without them: counted, never
+    // refused. Callers with a budget check footprint() beforehand.
+    memory_use.add(memory_kind::framebuffer, frame_buf.size() * sizeof(Eigen::Vector3f) +
+                                             tiles.size() * sizeof(tile_state));
+    memory_use.add(memory_kind::depth, depth_buf.bytes());
 
     texture = std::nullopt;
 }
 
+size_t rst::rasterizer::footprint(int w, int h, depth_format depth)
+{
+    size_t tile_count = (size_t)((w + tile_size - 1) / tile_size) * ((h + tile_size - 1) / tile_size);
+    return (size_t)w * h * sizeof(Eigen::Vector3f) + depth_buffer::footprint(depth, (size_t)w * h) +
+           tile_count * sizeof(tile_state);
+}
+
+bool rst::rasterizer::set_depth_format(depth_format format)
+{
+    if (format == depth_buf.format())
+        return true;
+    size_t pixels = (size_t)output_width * output_height;
+    size_t held = depth_buf.bytes();
+    memory_use.release(memory_kind::depth, held);
+    if (!memory_use.charge(memory_kind::depth, depth_buffer::footprint(format, pixels)))
+    {
+        memory_use.add(memory_kind::depth, held);
+        return false;
+    }
+    depth_buf.configure(format, pixels);
+    clear(Buffers::Depth);
+    return true;
+}
+
+bool rst::rasterizer::set_pixel_stats(bool enable)
+{
+    if (enable && stats.depth_tests.empty())
+    {
+        if (!memory_use.charge(memory_kind::framebuffer, pixel_stats::footprint(output_width, output_height)))
+            return false;
+        stats.reserve(output_width, output_height);
+        stats.reset(width, height);
+    }
+    stats_enabled = enable;
+    return true;
+}
+
+void rst::rasterizer::set_dynamic_resolution(bool enable, float budget_ms, float min)
+{
+    dynamic_resolution = enable;
+    frame_budget_ms = budget_ms;
+    min_scale = std::clamp(min, 0.05f, 1.0f);
+    if (!enable)
+        set_render_scale(1.0f);
+}
+
+void rst::rasterizer::set_render_scale(float s)
+{
+    // Quantized so the controller settles instead of nudging the size every frame
+    s = std::clamp(std::round(s * 32) / 32, min_scale, 1.0f);
+    if (s == scale)
+        return;
+    scale = s;
+    width = std::max(1, (int)std::lround(output_width * s));
+    height = std::max(1, (int)std::lround(output_height * s));
+
+    // Shrinking never frees and growing stays within the capacity reserved at
+    // construction, so neither allocates
+    tiles_x = (width + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+    tiles.resize(tiles_x * tiles_y);
+    // Rates were picked for tiles that no longer cover the same pixels
+    if (adaptive_shading)
+        for (auto& tile : tiles)
+            tile.rate = shading_rate::r1x1;
+    clear(Buffers::Color | Buffers::Depth);
+}
+
+void rst::rasterizer::end_frame(float frame_ms)
+{
+    if (!dynamic_resolution || frame_ms <= 0)
+        return;
+
+    // Cost is roughly proportional to pixel count, i.e. to scale squared. Move half
+    // way towards the scale that would have hit the budget, and leave a dead band
+    // around it so measurement noise does not make the image pump.
+    float ratio = frame_budget_ms / frame_ms;
+    if (ratio > 0.9f && ratio < 1.1f)
+        return;
+    float target = scale * std::sqrt(ratio);
+    set_render_scale(scale + 0.5f * (target - scale));
+}
+
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
+    int ind = (height-1-point.y())*width + point.x();
+    if (tile_at(point.x(), point.y()).color_cleared)
+        materialize_color(point.x() / tile_size, point.y() / tile_size);
     frame_buf[ind] = color;
 }
 
@@ -335,6 +1705,11 @@ void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_sha
     vertex_shader = vert_shader;
 }
 
+void rst::rasterizer::set_vertex_shader(batch_vertex_shader vert_shader)
+{
+    batch_shader = vert_shader;
+}
+
 void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader)
 {
     fragment_shader = frag_shader;
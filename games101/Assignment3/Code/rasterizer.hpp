@@ -7,9 +7,24 @@
 #include <eigen3/Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <limits>
 #include "global.hpp"
+#include "PixelStats.hpp"
+#include "Arena.hpp"
+#include "MemoryAccount.hpp"
+#include "BVH.hpp"
+#include "DepthBuffer.hpp"
 #include "Shader.hpp"
+#include "SSAO.hpp"
+#include "ThreadPool.hpp"
+#include "Transparency.hpp"
+#include "StreamMesh.hpp"
+#include "TAA.hpp"
 #include "Triangle.hpp"
+#include "VertexStage.hpp"
 
 using namespace Eigen;
 
@@ -57,10 +72,102 @@ namespace rst
         int col_id = 0;
     };
 
+    // Edge length of the square screen tiles the framebuffer is managed in
+    constexpr int tile_size = 32;
+
+    // Variable-rate shading: coverage and depth stay per pixel, but the fragment
+    // shader runs once per block of this many pixels (width x height) and the
+    // result is shared by every covered pixel of the block.
+    enum class shading_rate : std::uint8_t
+    {
+        r1x1,
+        r1x2,
+        r2x2,
+        r4x4
+    };
+
+    // A tile whose flag is still set has not been touched since the last clear() and
+    // logically holds its clear value; the pixels are only written (materialized) on
+    // the first depth test or colour write that lands in it.
+    struct tile_state
+    {
+        bool color_cleared = true;
+        bool depth_cleared = true;
+        Eigen::Vector3f clear_color = Eigen::Vector3f::Zero();
+        std::uint32_t clear_depth = 0;      // a depth_buffer key
+        shading_rate rate = shading_rate::r1x1;
+    };
+
+    // Output of the geometry stage: a screen-space triangle plus the view-space
+    // positions of its corners. Lives in the frame arena.
+    struct setup_triangle
+    {
+        Triangle tri;
+        std::array<Eigen::Vector3f, 3> view_pos;
+        // Pixels whose centres the bounding box contains, clamped to the render target
+        int min_x, max_x, min_y, max_y;
+        // At most 2x2 candidate pixels: rasterized by the small-triangle path from
+        // the barycentric planes, alpha = plane[0].dot((x, y, 1)) and so on. Bit k of
+        // coverage is pixel (min_x + (k & 1), min_y + (k >> 1)).
+        bool small;
+        std::uint8_t coverage;
+        std::array<Eigen::Vector3f, 3> plane;
+    };
+
+    // Setup triangle indices per tile in submission order, in CSR form: tile t owns
+    // entries[offsets[t] .. offsets[t + 1]).
+    struct tile_bins
+    {
+        const setup_triangle* tris = nullptr;
+        std::uint32_t* offsets = nullptr;
+        std::uint32_t* entries = nullptr;
+    };
+
+    // The distinct edges of a mesh, as pairs of vertex indices, for wireframe draws
+    struct wireframe_edges
+    {
+        const std::uint32_t* vertex_pairs = nullptr;
+        size_t count = 0;
+    };
+
+    // Collects every edge of m's triangles once, however many triangles share it.
+    // Sorts all of them, so build it once per mesh, next to the mesh.
+    wireframe_edges build_wireframe_edges(const mesh& m, arena& storage);
+
+    struct wireframe_settings
+    {
+        Eigen::Vector3f color = {255, 255, 255};
+        // With depth_test, how far behind the depth buffer an edge may lie and still
+        // show, in depth buffer units. Keeps the edges of the shaded surface itself
+        // from breaking up where it rasterized slightly in front of them.
+        bool depth_test = true;
+        float depth_bias = 0.05f;
+        // Two-pixel lines weighted by coverage (Wu's algorithm) instead of one pixel
+        bool antialias = false;
+    };
+
+    // A frame's geometry, recorded to be rasterized later (see frame_pipeline): the
+    // binned setup triangles of every draw, in storage of the frame's own.
+    struct recorded_frame
+    {
+        struct draw_call
+        {
+            tile_bins bins;
+            float opacity;
+        };
+
+        arena memory{1 << 20};
+        std::vector<draw_call> draws;
+        // Projection of the last draw, which depth is tested and resolved for
+        Eigen::Matrix4f projection = Eigen::Matrix4f::Identity();
+    };
+
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
+        // Bytes a new w x h rasterizer allocates up front, for checking a budget first
+        static size_t footprint(int w, int h, depth_format depth = depth_format::float32);
         pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
@@ -71,48 +178,263 @@ namespace rst
         void set_projection(const Eigen::Matrix4f& p);
 
         void set_texture(Texture tex) { texture = tex; }
+        // Handed to fragment shaders for ray queries; built in view space by the caller
+        void set_scene(const bvh* geometry) { scene = geometry; }
+        void clear_texture() { texture = std::nullopt; }
 
+        // A per-vertex shader only maps model-space positions and is run through an
+        // adapter; a batch shader replaces the whole vertex stage.
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
+        void set_vertex_shader(batch_vertex_shader vert_shader);
         void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
+        // How the depth buffer stores depth: float32 by default; reversed_float32 for
+        // precision far away; unorm24 and unorm16 for less memory traffic in every
+        // depth test, clear and prepass. Clears the depth buffer. False, with the
+        // format left as it was, when the new buffer would exceed a budget.
+        bool set_depth_format(depth_format format);
+        depth_format get_depth_format() const { return depth_buf.format(); }
+
+        // Order-independent transparency. Draws issued while the opacity is below 1 are
+        // depth tested against, but do not write, the opaque depth buffer; their
+        // fragments are kept per the mode and composited over the opaque image by
+        // resolve()/frame_buffer(). With transparency::none everything is opaque.
+        // False, with the previous mode kept, when the buffers would exceed a budget.
+        bool set_transparency(transparency mode, size_t node_budget = 1 << 21);
+        void set_opacity(float alpha) { opacity = alpha; }
+        size_t transparency_overflow() const { return oit.overflowed(); }
+
+        // Screen-space ambient occlusion. Draws between begin_prepass() and
+        // end_prepass() only lay down depth and view-space normals; end_prepass()
+        // computes SSAO from them, and the same draws issued again afterwards shade
+        // each visible pixel once, with the result in payload.ambient_occlusion.
+        // False, with SSAO left as it was, when its buffers would exceed a budget.
+        bool set_ssao(bool enable, const ssao_settings& settings = {});
+        void begin_prepass();
+        void end_prepass();
+
+        // Temporal anti-aliasing. Each frame is drawn with a different sub-pixel
+        // jitter, and resolve() blends it into the frames before it, reprojected
+        // along per-pixel motion vectors, so edges converge to a supersampled look
+        // while every pixel is still shaded once a frame. Motion is that of the
+        // model, view and projection set when resolve() runs relative to those of the
+        // previous resolve(). False, with TAA left as it was, when its buffers would
+        // exceed a budget.
+        bool set_taa(bool enable, const taa_settings& settings = {});
+        // Drops the blended frames, for camera cuts
+        void reset_history() { taa.reset(); }
+
+        // Variable-rate shading. A fixed rate applies to every tile, or to the tile
+        // covering pixels [tx * tile_size, +tile_size) x [ty * tile_size, +tile_size),
+        // y up as in set_pixel(). Adaptive shading instead picks each tile's rate in
+        // resolve(), from the luminance gradient of the image being resolved, for the
+        // next frame: a block is shaded coarsely while the luminance across it is
+        // expected to change by at most `threshold` (on a 0-1 scale).
+        void set_shading_rate(shading_rate rate);
+        void set_shading_rate(int tx, int ty, shading_rate rate);
+        void set_adaptive_shading(bool enable, float threshold = 0.01f);
+
+        // Per-pixel cost statistics for tuning scenes: depth tests, fragment shader
+        // invocations and the cycles spent in them, gathered from each colour clear on.
+        // The tile loops are compiled with and without the counters, so leaving this
+        // off costs nothing. Enabling it sizes the counters once, and fails when they
+        // would exceed a budget.
+        bool set_pixel_stats(bool enable);
+        const pixel_stats& pixel_statistics() const { return stats; }
+
+        // Sub-pixel offset of the whole image, in pixels, for accumulating samples.
+        // Temporal anti-aliasing sets its own while it is enabled.
+        void set_jitter(float x, float y) { jitter = {x, y}; }
+
+        // While *flag is set, draws stop at the next tile and leave the frame
+        // incomplete; the caller is expected to throw that frame away.
+        void set_cancel_flag(const std::atomic<bool>* flag) { cancel = flag; }
+        bool cancelled() const { return cancel && cancel->load(std::memory_order_relaxed); }
+
+        void set_clear_color(const Eigen::Vector3f& color) { clear_color = color; }
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
         void draw(std::vector<Triangle *> &TriangleList);
+        void draw(const mesh& m);
+        // Out-of-core draw: each chunk is transformed, binned and rasterized, then
+        // dropped while the next one is already being paged in.
+        void draw(stream_mesh& m);
+        // Draws one mesh into several rasterizers, each with its own view and
+        // projection (stereo pairs, cube-map faces, thumbnails). The mesh is read and
+        // moved to world space once, with the first target's model matrix, then
+        // projected into every view in the same pass. Targets with another model
+        // matrix or a custom vertex shader fall back to a regular draw.
+        static void draw_multiview(const mesh& m, rasterizer* const* targets, size_t count);
+        // Wireframe overlay: m's edges as lines over the image, with the camera and
+        // vertex shader triangle draws use, clipped to the near plane and the render
+        // target. Nothing is written to the depth buffer, so call it after the
+        // surfaces it should be tested against. Drawn at once, even while recording.
+        void draw_wireframe(const mesh& m, const wireframe_edges& edges, const wireframe_settings& settings = {});
+
+        // Materializes every tile still pending a clear, so prefer resolve() for output.
+        // Rows are render_width() long, which is smaller than the output while
+        // dynamic resolution has scaled the internal target down.
+        std::vector<Eigen::Vector3f>& frame_buffer();
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Writes the image at output resolution as packed 8-bit BGR rows (width * 3
+        // bytes each, top row first), bilinearly upscaling a scaled-down internal
+        // target. Tiles nothing was drawn into come straight from their clear colour.
+        void resolve(unsigned char* bgr);
+
+        // Dynamic resolution. The internal target shrinks or grows each end_frame()
+        // so that the measured frame time approaches frame_budget_ms. Buffers are
+        // sized for the output once and never reallocated when the scale changes.
+        void set_dynamic_resolution(bool enable, float frame_budget_ms, float min_scale = 0.25f);
+        void set_render_scale(float scale);
+        float render_scale() const { return scale; }
+        int render_width() const { return width; }
+        int render_height() const { return height; }
+        void end_frame(float frame_ms);
+
+        // Transient per-frame storage; reset at the start of every draw.
+        arena& frame_memory() { return frame_arena; }
+
+        // Everything this rasterizer holds, by kind. Textures are accounted to
+        // themselves, as they may be shared between rasterizers.
+        memory_account& memory_usage() { return memory_use; }
+
+        // Split frames. Between begin_recording() and end_recording(), triangle draws
+        // stop after binning, with the camera as it is at each call, and append their
+        // bins to `frame`; replay() then rasterizes and shades them in order. One
+        // thread may record a frame while another replays an earlier one, as long as
+        // neither changes anything but the camera. The projection reaches the depth
+        // buffer only when the frame is replayed. Depth prepasses are not recorded.
+        void begin_recording(recorded_frame& frame);
+        void end_recording() { recording = nullptr; }
+        void replay(const recorded_frame& frame);
 
     private:
+        // Screen-space line with no depth test, clipped to the render target
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
+        struct screen_line;
+        bool clip_to_target(screen_line& line) const;
+        // The pixels of `line` in rows [row_begin, row_end), which one thread owns
+        template <bool Antialias>
+        void rasterize_line(const screen_line& line, int row_begin, int row_end, const wireframe_settings& settings);
+        void rasterize_lines(const screen_line* lines, size_t count, const wireframe_settings& settings);
+
+        vertex_uniforms camera_uniforms() const;
+
+        void draw_vertices(const vertex_arrays& in, const std::uint32_t* indices, size_t triangle_count);
+        void run_vertex_stage(const vertex_uniforms& uniforms, const vertex_arrays& in, const vertex_outputs& out);
+        void draw_transformed(const vertex_outputs& out, const std::uint32_t* indices, size_t triangle_count);
+        // Storage for a draw's geometry: the frame being recorded, or else the frame
+        // arena, which starts over with every draw
+        arena& draw_memory() { return recording ? recording->memory : frame_arena; }
+        void begin_draw();
+        // Constructs the triangles that survive culling in setup; returns their count
+        size_t setup_triangles(const vertex_outputs& out, const std::uint32_t* indices, size_t triangle_count,
+                               setup_triangle* setup, std::uint32_t* home_tile);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        Eigen::Matrix4f jittered_projection() const;
+
+        static constexpr std::uint32_t no_tile = ~0u;
+        tile_bins bin_triangles(const setup_triangle* setup, const std::uint32_t* home_tile, size_t count);
+        void rasterize_draw(const tile_bins& bins, float alpha);
+        void rasterize_bins(const tile_bins& bins);
+        // Stats: whether to update the per-pixel counters
+        template <bool Stats>
+        void rasterize_tile(const tile_bins& bins, int tx, int ty);
+        template <bool Stats>
+        void rasterize_triangle(const setup_triangle& s, int tx, int ty);
+        template <bool Stats>
+        void rasterize_small(const setup_triangle& s, int tx, int ty);
+        struct shading_blocks;
+        template <bool Stats>
+        void shade_quad(const setup_triangle& s, int tx, int ty, int qx, int qy,
+                        const float* alpha, const float* beta, const float* gamma,
+                        unsigned covered, shading_blocks& blocks);
+
+        tile_state& tile_at(int x, int y) { return tiles[(y / tile_size) * tiles_x + x / tile_size]; }
+        void materialize_color(int tx, int ty);
+        void materialize_depth(int tx, int ty);
+        Eigen::Vector3f color_at(int x, int row) const;
+        void composite_transparency();
+        void apply_taa();
+        void update_shading_rates();
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
+        // Declared first so it outlives every tracked member
+        memory_account memory_use;
+
         Eigen::Matrix4f model;
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
         int normal_id = -1;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        // Indexed by buffer id. Ids are shared between the kinds, so each vector is sparse.
+        std::vector<std::vector<Eigen::Vector3f>> pos_buf;
+        std::vector<std::vector<Eigen::Vector3i>> ind_buf;
+        std::vector<std::vector<Eigen::Vector3f>> col_buf;
+        std::vector<std::vector<Eigen::Vector3f>> nor_buf;
 
         std::optional<Texture> texture;
+        const bvh* scene = nullptr;
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
+        batch_vertex_shader batch_shader;
 
         std::vector<Eigen::Vector3f> frame_buf;
-        std::vector<float> depth_buf;
+        depth_buffer depth_buf;
         int get_index(int x, int y);
 
+        std::vector<tile_state> tiles;
+        int tiles_x, tiles_y;
+        Eigen::Vector3f clear_color = Eigen::Vector3f::Zero();
+
+        oit_buffer oit;
+        float opacity = 1.0f;
+        // Opacity of the draw being rasterized, which may be a recorded one
+        float raster_opacity = 1.0f;
+        bool oit_pending = false;
+
+        arena frame_arena;
+        recorded_frame* recording = nullptr;
+
+        bool stats_enabled = false;
+        pixel_stats stats;
+
+        bool adaptive_shading = false;
+        float shading_threshold = 0.01f;
+
+        Eigen::Vector2f jitter = Eigen::Vector2f::Zero();
+        const std::atomic<bool>* cancel = nullptr;
+
+        bool ssao_enabled = false;
+        ssao_settings ssao_config;
+        ssao_pass ssao;
+        // Prepass outputs, allocated only with SSAO enabled
+        std::vector<float> view_depth;
+        std::vector<Eigen::Vector3f> normal_buf;
+        bool prepass = false;
+        bool ao_ready = false;
+
+        bool taa_enabled = false;
+        taa_settings taa_config;
+        taa_pass taa;
+        // Unjittered transforms of the previous resolve(), for the motion vectors
+        Eigen::Matrix4f previous_mvp = Eigen::Matrix4f::Identity(), previous_vp = Eigen::Matrix4f::Identity();
+
+        // Current internal target; output_width/height is the resolution buffers were sized for
         int width, height;
+        int output_width, output_height;
+
+        bool dynamic_resolution = false;
+        float frame_budget_ms = 0;
+        float min_scale = 0.25f;
+        float scale = 1.0f;
 
         int next_id = 0;
         int get_next_id() { return next_id++; }